@@ -11,20 +11,97 @@ function Convert(options) {
     return new Convert(options);
   }
 
+  checkJobId(options && options.jobId);
   this._options = options;
   this._bufs = [];
+  // native input of the running convert, when the platform supports streaming
+  this._input = null;
+  this._error = null;
+  this._finished = false;
+  this._onFinish = null;
+  // done() of the chunk written while the native source was full
+  this._onDrain = null;
 
   // init Transform
   stream.Transform.call(this, options);
 }
 util.inherits(Convert, stream.Transform);
 
+// Animated sources keep all their frames only when converted whole, they are collected like on platforms without convertStream
+Convert.prototype._streaming = function () {
+  return !!module.exports.convertStream && !this._options.animated;
+};
+
+// Starts the native convert on the first chunk, the source is decoded while the rest arrives
+// and encoded chunks are pushed as soon as they are produced.
+// Both sides apply backpressure: input is taken while the decoder keeps up, output is produced while the reader does.
+Convert.prototype._start = function () {
+  var self = this;
+  this._input = module.exports.convertStream(this._options, function (chunk) {
+    // false pauses the encoder until _read() asks for more
+    return self.push(chunk);
+  }, function (err) {
+    self._finished = true;
+    self._error = err || null;
+    // the decoder may have stopped reading before the input ended
+    self._drained();
+    if (self._onFinish) {
+      self._onFinish(self._error);
+    } else if (self._error) {
+      // failed before the input ended, e.g. timed out waiting for it
+      self.destroy(self._error);
+    }
+  }, function () {
+    self._drained();
+  });
+};
+
+Convert.prototype._drained = function () {
+  var done = this._onDrain;
+  this._onDrain = null;
+  if (done) {
+    done();
+  }
+};
+
+Convert.prototype._read = function (size) {
+  if (this._input) {
+    this._input.resume();
+  }
+  stream.Transform.prototype._read.call(this, size);
+};
+
 Convert.prototype._transform = function (chunk, enc, done) {
-  this._bufs.push(chunk);
-  done();
+  if (!this._streaming()) {
+    this._bufs.push(chunk);
+    return done();
+  }
+  if (this._error) {
+    return done(this._error);
+  }
+  if (!this._input) {
+    this._start();
+  }
+  if (this._input.write(chunk)) {
+    return done();
+  }
+  // the decoder is behind, the next chunk is taken once it caught up
+  this._onDrain = done;
 };
 
 Convert.prototype._flush = function(done) {
+  if (this._streaming()) {
+    if (!this._input) {
+      this._start();
+    }
+    this._input.end();
+    if (this._finished) {
+      return done(this._error);
+    }
+    this._onFinish = done;
+    return;
+  }
+
   this._options.srcData = Buffer.concat(this._bufs);
   var self = this;
   module.exports.convert(this._options,function(err,data){
@@ -36,8 +113,105 @@ Convert.prototype._flush = function(done) {
   });
 }
 
+Convert.prototype._destroy = function (err, done) {
+  if (this._input && !this._finished) {
+    this._input.abort();
+  }
+  done(err);
+};
+
 module.exports.streams = { convert : Convert };
 
+// Async calls given an AbortSignal as options.signal get a jobId, cancelled when the signal aborts.
+// They fail with an AbortError once the signal aborted, whether or not the native job was already done.
+// Their jobIds are counted down from 0xffffffff in a range callers can't use,
+// so a signal never cancels a caller's call with the same jobId, and cancel(jobId) never a signal's.
+var signalJobIds = 0x80000000;
+var signalJobs = 0;
+var nativeCancel = module.exports.cancel;
+
+function checkJobId(jobId) {
+  if (jobId >= signalJobIds) {
+    throw new Error('jobId should be below ' + signalJobIds + ', larger ids are reserved for signal');
+  }
+}
+
+module.exports.cancel = function (jobId) {
+  checkJobId(jobId);
+  return nativeCancel.apply(module.exports, arguments);
+};
+
+function abortError() {
+  var err = new Error('job cancelled');
+  err.name = 'AbortError';
+  return err;
+}
+
+['convert', 'identify', 'composite', 'getConstPixels', 'quantizeColors', 'load', 'fingerprint'].forEach(function (name) {
+  var native = module.exports[name];
+  module.exports[name] = function (options, callback) {
+    checkJobId(options && options.jobId);
+    var signal = options && options.signal;
+    if (!signal || typeof callback !== 'function') {
+      return native.apply(module.exports, arguments);
+    }
+    if (signal.aborted) {
+      return process.nextTick(callback, abortError());
+    }
+    var jobId = 0xffffffff - signalJobs;
+    signalJobs = (signalJobs + 1) % signalJobIds;
+    function onAbort() {
+      nativeCancel(jobId);
+    }
+    signal.addEventListener('abort', onAbort);
+    return native(Object.assign({}, options, { signal: undefined, jobId: jobId }), function (err, result) {
+      signal.removeEventListener('abort', onAbort);
+      if (signal.aborted) {
+        return callback(abortError());
+      }
+      callback(err, result);
+    });
+  };
+});
+
+// stats({ interval: ms, report: fn }) also calls report(snapshot) every interval ms, without keeping the process alive,
+// until stats({ interval: 0 }) stops it
+var nativeStats = module.exports.stats;
+var statsTimer = null;
+
+module.exports.stats = function (options) {
+  if (options && options.interval !== undefined) {
+    if (options.interval > 0 && typeof options.report !== 'function') {
+      throw new Error('stats()\'s "report" should be a function');
+    }
+    clearInterval(statsTimer);
+    statsTimer = null;
+    if (options.interval > 0) {
+      statsTimer = setInterval(function () {
+        options.report(nativeStats());
+      }, options.interval);
+      statsTimer.unref();
+    }
+  }
+  return nativeStats();
+};
+
+// Handles returned by load() run the module's functions on their decoded image,
+// image.convert(options, callback) is convert({ image: image, ... }, callback)
+['convert', 'identify', 'composite', 'getConstPixels', 'quantizeColors', 'fingerprint'].forEach(function (name) {
+  module.exports.Image.prototype[name] = function (options, callback) {
+    if (typeof options === 'function') {
+      callback = options;
+      options = {};
+    }
+    var args = [Object.assign({}, options, { image: this })];
+    if (callback) {
+      args.push(callback);
+    }
+    return module.exports[name].apply(module.exports, args);
+  };
+});
+
 function promisify(func) {
   return function(options) {
     return new Promise((resolve, reject) => {
@@ -55,4 +229,6 @@ module.exports.promises = {
   convert: promisify(module.exports.convert),
   identify: promisify(module.exports.identify),
   composite: promisify(module.exports.composite),
+  load: promisify(module.exports.load),
+  fingerprint: promisify(module.exports.fingerprint),
 };
@@ -8,331 +8,2980 @@
 
 #include "imagemagick.h"
 #include <list>
-#include <sstream>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <deque>
+#include <vector>
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <exception>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Streaming convert reads and writes through stdio streams backed by callbacks
+#if defined(__GLIBC__) || defined(__APPLE__) || defined(__FreeBSD__)
+#define IMAGEMAGICK_NATIVE_STREAMS 1
+#endif
+
+// Lanes of the worker pool, interactive jobs are always picked before batch ones
+enum JobPriority {
+    InteractivePriority = 0,
+    BatchPriority       = 1,
+    PriorityCount       = 2
+};
+
+struct pool_port;
+
+// Work and after work callbacks of a queued job, like uv_queue_work's
+struct pool_job {
+    uv_work_t* req;
+    uv_work_cb work;
+    void (*after)(uv_work_t*);
+    // loop the after callback runs on
+    pool_port* port;
+};
 
-// RAII to reset image magick's resource limit
-class LocalResourceLimiter
+// Where the jobs queued by one JS environment come back: the main thread's loop or a worker_thread's.
+// Every environment runs on a thread of its own, which queues and completes its jobs through its own port.
+struct pool_port {
+    uv_async_t async;
+    // guarded by the pool's mutex
+    std::deque<pool_job> completed;
+    std::deque<pool_job> notifications;
+    // jobs of the port a worker is running
+    unsigned int running;
+    // set once the environment is gone, its jobs are dropped as they finish
+    bool closed;
+    // set once the closed handle was released by the loop
+    bool released;
+    // called back then, lets the environment's teardown go on
+    void (*onReleased)(void*);
+    void* onReleasedArg;
+
+    // loop thread only
+    unsigned int outstanding;
+
+    pool_port() : running(0), closed(false), released(false), onReleased(NULL), onReleasedArg(NULL), outstanding(0) {}
+};
+
+// Runs async jobs on the addon's own threads,
+// so long image work doesn't hold the libuv threadpool fs, dns.lookup and zlib depend on.
+// The threads are shared by all JS environments of the process,
+// finished jobs are handed back to the loop thread that queued them through its port's uv_async_t.
+class WorkerPool
 {
 public:
-    LocalResourceLimiter()
-      : originalMemory(0),
-        memoryLimited(0),
-        originalDisk(0),
-        diskLimited(0) {
+    WorkerPool()
+      : size(DefaultSize()),
+        queueDepth(0),
+        threads(0),
+        retiring(0),
+        running(0) {
     }
-    ~LocalResourceLimiter() {
-        if (memoryLimited) {
-            MagickCore::SetMagickResourceLimit(MagickCore::MemoryResource,originalMemory);
+
+    // Runs work on a worker thread then after on the loop thread.
+    // Returns false when the lane already holds queueDepth jobs, after is then called without running work.
+    bool Queue(uv_work_t* req, uv_work_cb work, void (*after)(uv_work_t*), int priority) {
+        pool_port* port = Hold();
+
+        pool_job job = { req, work, after, port };
+        std::lock_guard<std::mutex> lock(mutex);
+        if ( queueDepth && pending[ priority ].size() >= queueDepth ) {
+            port->completed.push_back(job);
+            uv_async_send(&port->async);
+            return false;
         }
-        if (diskLimited) {
-            MagickCore::SetMagickResourceLimit(MagickCore::DiskResource,originalDisk);
+        pending[ priority ].push_back(job);
+        SpawnWorkers();
+        cond.notify_one();
+        return true;
+    }
+
+    // Calls after(req) on a later turn of the loop without running any work,
+    // for jobs answered on the loop thread that must not call back synchronously.
+    void Complete(uv_work_t* req, void (*after)(uv_work_t*)) {
+        pool_port* port = Hold();
+
+        pool_job job = { req, NULL, after, port };
+        std::lock_guard<std::mutex> lock(mutex);
+        port->completed.push_back(job);
+        uv_async_send(&port->async);
+    }
+
+    // Takes a job that has not started out of its lane, its after callback then runs without work.
+    // Returns false when the job is already running or done.
+    bool Dequeue(uv_work_t* req) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int priority = 0; priority < PriorityCount; priority++) {
+            for (std::deque<pool_job>::iterator it = pending[ priority ].begin(); it != pending[ priority ].end(); ++it) {
+                if ( it->req == req ) {
+                    it->port->completed.push_back(*it);
+                    uv_async_send(&it->port->async);
+                    pending[ priority ].erase(it);
+                    return true;
+                }
+            }
         }
+        return false;
     }
-    void LimitMemory(MagickCore::MagickSizeType to) {
-        if ( ! memoryLimited ) {
-            memoryLimited  = true;
-            originalMemory = MagickCore::GetMagickResourceLimit(MagickCore::MemoryResource);
+
+    // Runs cb(req) on the loop thread, called from a worker while it runs req's work.
+    // Notifications are delivered before the after callback of that job.
+    void Notify(uv_work_t* req, void (*cb)(uv_work_t*)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pool_port* port = WorkingPort();
+        if ( port->closed ) {
+            return;
         }
-        MagickCore::SetMagickResourceLimit(MagickCore::MemoryResource, to);
+        pool_job job = { req, NULL, cb, port };
+        port->notifications.push_back(job);
+        uv_async_send(&port->async);
     }
-    void LimitDisk(MagickCore::MagickSizeType to) {
-        if ( ! diskLimited ) {
-            diskLimited  = true;
-            originalDisk = MagickCore::GetMagickResourceLimit(MagickCore::DiskResource);
+
+    // Loop thread, when its JS environment is torn down. Its queued jobs are dropped,
+    // running ones finish without calling back. Their contexts are leaked, the callbacks they hold died with the environment.
+    // done(doneArg) is called once the loop released the port's handle.
+    void ClosePort(void (*done)(void*), void* doneArg) {
+        pool_port* port = LoopPort();
+        if ( ! port ) {
+            done(doneArg);
+            return;
+        }
+        LoopPort() = NULL;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int priority = 0; priority < PriorityCount; priority++) {
+            std::deque<pool_job> &lane = pending[ priority ];
+            lane.erase(std::remove_if(lane.begin(), lane.end(), [port](const pool_job &job) { return job.port == port; }), lane.end());
         }
-        MagickCore::SetMagickResourceLimit(MagickCore::DiskResource,   to);
+        port->completed.clear();
+        port->notifications.clear();
+        port->closed = true;
+        port->onReleased = done;
+        port->onReleasedArg = doneArg;
+        uv_close(reinterpret_cast<uv_handle_t*>(&port->async), ClosedPort);
     }
 
-private:
-    MagickCore::MagickSizeType originalMemory;
-    bool memoryLimited;
-    MagickCore::MagickSizeType originalDisk;
-    bool diskLimited;
-};
+    void Configure(unsigned int newSize, unsigned int newQueueDepth) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size       = newSize;
+        queueDepth = newQueueDepth;
+        if ( threads > size + retiring ) {
+            retiring = threads - size;
+            cond.notify_all();
+        }
+        else if ( threads ) {
+            SpawnWorkers();
+        }
+    }
 
-// Base context for calls shared on sync and async code paths
-struct im_ctx_base {
-    Nan::Callback * callback;
-    std::string error;
+    unsigned int Size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return size;
+    }
+    unsigned int QueueDepth() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queueDepth;
+    }
+    unsigned int Running() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return running;
+    }
+    unsigned int Queued(int priority) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pending[ priority ].size();
+    }
 
-    char* srcData;
-    size_t length;
-    int debug;
-    int ignoreWarnings;
-    std::string srcFormat;
+private:
+    // same default size as libuv's threadpool, which async jobs used to run on
+    static unsigned int DefaultSize() {
+        const char *value = getenv("UV_THREADPOOL_SIZE");
+        int workers = value ? atoi(value) : 0;
+        return workers > 0 ? workers : 4;
+    }
 
-    // generated blob by convert or composite
-    Magick::Blob dstBlob;
+    // port of the environment running on the calling loop thread
+    static pool_port*& LoopPort() {
+        static thread_local pool_port* port = NULL;
+        return port;
+    }
+    // port of the job the calling worker runs
+    static pool_port*& WorkingPort() {
+        static thread_local pool_port* port = NULL;
+        return port;
+    }
 
-    virtual ~im_ctx_base() {}
-};
-// Extra context for identify
-struct identify_im_ctx : im_ctx_base {
-    Magick::Image image;
+    // loop thread, keeps the loop alive until the after callback of one more job ran
+    pool_port* Hold() {
+        pool_port* port = LoopPort();
+        if ( ! port ) {
+            port = LoopPort() = new pool_port();
+            uv_async_init(Nan::GetCurrentEventLoop(), &port->async, AfterWork);
+            port->async.data = port;
+        }
+        port->outstanding++;
+        uv_ref(reinterpret_cast<uv_handle_t*>(&port->async));
+        return port;
+    }
 
-    identify_im_ctx() {}
-};
-// Extra context for convert
-struct convert_im_ctx : im_ctx_base {
-    unsigned int maxMemory;
+    // called with the mutex held
+    void SpawnWorkers() {
+        // retiring workers have not exited yet, take them back instead of starting new ones
+        while ( retiring && threads - retiring < size ) {
+            retiring--;
+        }
+        while ( threads < size ) {
+            threads++;
+            std::thread(&WorkerPool::Work, this).detach();
+        }
+    }
 
-    unsigned int width;
-    unsigned int height;
-    unsigned int xoffset;
-    unsigned int yoffset;
-    bool strip;
-    bool trim;
-    bool autoOrient;
-    double trimFuzz;
-    std::string resizeStyle;
-    std::string gravity;
-    std::string format;
-    std::string filter;
-    std::string blur;
-    std::string background;
-    Magick::ColorspaceType colorspace;
-    unsigned int quality;
-    int rotate;
-    int density;
-    int flip;
+    void Work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            while ( ! retiring && pending[ InteractivePriority ].empty() && pending[ BatchPriority ].empty() ) {
+                cond.wait(lock);
+            }
+            if ( retiring ) {
+                retiring--;
+                threads--;
+                return;
+            }
+            int priority = pending[ InteractivePriority ].empty() ? BatchPriority : InteractivePriority;
+            pool_job job = pending[ priority ].front();
+            pending[ priority ].pop_front();
+            running++;
+            job.port->running++;
+            WorkingPort() = job.port;
+
+            lock.unlock();
+            job.work(job.req);
+            lock.lock();
+
+            WorkingPort() = NULL;
+            running--;
+            job.port->running--;
+            if ( job.port->closed ) {
+                // the port's handle was closed with its environment, whichever comes last frees it
+                if ( job.port->released && ! job.port->running ) {
+                    delete job.port;
+                }
+                continue;
+            }
+            job.port->completed.push_back(job);
+            uv_async_send(&job.port->async);
+        }
+    }
 
-    convert_im_ctx() {}
-};
-// Extra context for composite
-struct composite_im_ctx : im_ctx_base {
-    char* compositeData;
-    size_t compositeLength;
+    // loop thread, once the closed port's handle is released: frees it unless a worker still runs one of its jobs
+    static void ClosedPort(uv_handle_t* handle) {
+        pool_port* port = static_cast<pool_port*>(handle->data);
+        void (*done)(void*) = port->onReleased;
+        void* doneArg = port->onReleasedArg;
+        {
+            std::lock_guard<std::mutex> lock(Shared().mutex);
+            port->released = true;
+            if ( ! port->running ) {
+                delete port;
+            }
+        }
+        done(doneArg);
+    }
 
-    std::string gravity;
+    static void AfterWork(uv_async_t* handle) {
+        pool_port* port = static_cast<pool_port*>(handle->data);
 
-    composite_im_ctx() {}
-};
+        std::deque<pool_job> notified;
+        std::deque<pool_job> done;
+        {
+            std::lock_guard<std::mutex> lock(Shared().mutex);
+            notified.swap(port->notifications);
+            done.swap(port->completed);
+        }
+        for (size_t i = 0; i < notified.size(); i++) {
+            notified[ i ].after(notified[ i ].req);
+        }
+        for (size_t i = 0; i < done.size(); i++) {
+            port->outstanding--;
+            done[ i ].after(done[ i ].req);
+        }
+        // let the process exit when nothing is in flight
+        if ( ! port->outstanding ) {
+            uv_unref(reinterpret_cast<uv_handle_t*>(&port->async));
+        }
+    }
 
+    // the process wide pool
+    static WorkerPool& Shared();
 
-inline Local<Value> WrapPointer(char *ptr, size_t length) {
-    Nan::EscapableHandleScope scope;
-    return scope.Escape(Nan::CopyBuffer(ptr, length).ToLocalChecked());
-}
-inline Local<Value> WrapPointer(char *ptr) {
-    return WrapPointer(ptr, 0);
-}
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<pool_job> pending[ PriorityCount ];
 
+    unsigned int size;
+    unsigned int queueDepth;
+    unsigned int threads;
+    unsigned int retiring;
+    unsigned int running;
+};
 
-#define RETURN_BLOB_OR_ERROR(req) \
-    do { \
-        im_ctx_base* _context = static_cast<im_ctx_base*>(req->data); \
-        if (!_context->error.empty()) { \
-            Nan::ThrowError(_context->error.c_str()); \
-        } else { \
-            const Local<Value> _retBuffer = WrapPointer((char *)_context->dstBlob.data(), _context->dstBlob.length()); \
-            info.GetReturnValue().Set(_retBuffer); \
-        } \
-        delete req; \
-    } while(0);
+// never destroyed, its detached threads may still wait on it at exit
+static WorkerPool& pool = *new WorkerPool();
 
+WorkerPool& WorkerPool::Shared() {
+    return pool;
+}
 
-bool ReadImageMagick(Magick::Image *image, Magick::Blob srcBlob, std::string srcFormat, im_ctx_base *context) {
-    if( ! srcFormat.empty() ){
-        if (context->debug) printf( "reading with format: %s\n", srcFormat.c_str() );
-        image->magick( srcFormat.c_str() );
+// Cancellation state of a call with a "jobId" or "timeoutMs", shared by the jobs of a composite batch.
+// Read by ImageMagick's progress monitor, on any of the threads an operation runs on.
+struct job_control {
+    // "jobId" of cancel(), 0 when the call can only time out
+    uint32_t id;
+    // uv_hrtime() after which the call times out, 0 for none
+    uint64_t deadline;
+    std::atomic<bool> aborted;
+    // set once the progress monitor stopped an ImageMagick operation, leaving an incomplete image behind
+    std::atomic<bool> interrupted;
+
+    job_control() : id(0), deadline(0), aborted(false), interrupted(false) {}
+
+    bool Stopped() const {
+        return aborted || ( deadline && uv_hrtime() > deadline );
     }
+    const char* Reason() const {
+        return aborted ? "job cancelled" : "job timed out";
+    }
+};
 
-    try {
-        image->read( srcBlob );
+// Process wide budget of pixel cache memory shared by all jobs.
+// Jobs reserve the estimated size of their decoded images before reading them,
+// and wait for other jobs to finish (async calls) or fail (sync calls) while the budget is used up.
+class MemoryBudget
+{
+public:
+    MemoryBudget()
+      : limit(0),
+        wait(true),
+        inUse(0),
+        peak(0),
+        admitted(0),
+        waited(0),
+        rejected(0) {
     }
-    catch (Magick::Warning& warning) {
-        if (!context->ignoreWarnings) {
-            context->error = warning.what();
-            return false;
-        } else if (context->debug) {
-            printf("warning: %s\n", warning.what());
+
+    // Returns an empty string when bytes were reserved, the error otherwise.
+    // A job waiting with a control gives up once its call is cancelled or times out.
+    std::string Reserve(MagickCore::MagickSizeType bytes, bool canWait, const job_control *control) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if ( limit && inUse + bytes > limit ) {
+            if ( bytes > limit ) {
+                rejected++;
+                return std::string("image exceeds the memory budget");
+            }
+            if ( ! canWait || ! wait ) {
+                rejected++;
+                return std::string("memory budget exhausted");
+            }
+            waited++;
+            while ( limit && inUse + bytes > limit ) {
+                if ( bytes > limit ) {
+                    rejected++;
+                    return std::string("image exceeds the memory budget");
+                }
+                if ( ! control ) {
+                    cond.wait(lock);
+                    continue;
+                }
+                cond.wait_for(lock, std::chrono::milliseconds(20));
+                if ( control->Stopped() ) {
+                    return std::string(control->Reason());
+                }
+            }
         }
+        inUse += bytes;
+        if ( inUse > peak ) {
+            peak = inUse;
+        }
+        admitted++;
+        return std::string();
     }
-    catch (std::exception& err) {
-        context->error = err.what();
-        return false;
-    }
-    catch (...) {
-        context->error = std::string("unhandled error");
-        return false;
-    }
-    return true;
-}
 
-void AutoOrient(Magick::Image *image) {
-    switch (image->orientation()) {
-        case Magick::OrientationType::UndefinedOrientation: // No orientation info
-        case Magick::OrientationType::TopLeftOrientation:
-            break;
-        case Magick::OrientationType::TopRightOrientation:
-            image->rotate(180);
-            image->flip();
-            break;
-        case Magick::OrientationType::BottomRightOrientation:
-            image->rotate(180);
-            break;
-        case Magick::OrientationType::BottomLeftOrientation:
-            image->flip();
-            break;
-        case Magick::OrientationType::LeftTopOrientation:
-            image->flip();
-            image->rotate(90);
-            break;
-        case Magick::OrientationType::RightTopOrientation:
-            image->rotate(90);
-            break;
-        case Magick::OrientationType::RightBottomOrientation:
-            image->flip();
-            image->rotate(270);
-            break;
-        case Magick::OrientationType::LeftBottomOrientation:
-            image->rotate(270);
-            break;
+    void Release(MagickCore::MagickSizeType bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        inUse -= bytes;
+        cond.notify_all();
     }
 
-    // Erase orientation metadata after rotating the image to avoid double-rotation
-    image->orientation(Magick::OrientationType::UndefinedOrientation);
-}
-
-void DoConvert(uv_work_t* req) {
-
-    convert_im_ctx* context = static_cast<convert_im_ctx*>(req->data);
+    void Configure(MagickCore::MagickSizeType newLimit, bool newWait) {
+        std::lock_guard<std::mutex> lock(mutex);
+        limit = newLimit;
+        wait  = newWait;
+        cond.notify_all();
+    }
 
-    MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, 1);
-    LocalResourceLimiter limiter;
+    MagickCore::MagickSizeType Limit()    { std::lock_guard<std::mutex> lock(mutex); return limit; }
+    bool Wait()                           { std::lock_guard<std::mutex> lock(mutex); return wait; }
+    MagickCore::MagickSizeType InUse()    { std::lock_guard<std::mutex> lock(mutex); return inUse; }
+    MagickCore::MagickSizeType Peak()     { std::lock_guard<std::mutex> lock(mutex); return peak; }
+    MagickCore::MagickSizeType Admitted() { std::lock_guard<std::mutex> lock(mutex); return admitted; }
+    MagickCore::MagickSizeType Waited()   { std::lock_guard<std::mutex> lock(mutex); return waited; }
+    MagickCore::MagickSizeType Rejected() { std::lock_guard<std::mutex> lock(mutex); return rejected; }
 
-    int debug = context->debug;
+private:
+    std::mutex mutex;
+    std::condition_variable cond;
+
+    MagickCore::MagickSizeType limit;
+    bool wait;
+    MagickCore::MagickSizeType inUse;
+    MagickCore::MagickSizeType peak;
+    MagickCore::MagickSizeType admitted;
+    MagickCore::MagickSizeType waited;
+    MagickCore::MagickSizeType rejected;
+};
 
-    if (debug) printf( "debug: on\n" );
-    if (debug) printf( "ignoreWarnings: %d\n", context->ignoreWarnings );
+// never destroyed, like the worker pool
+static MemoryBudget& budget = *new MemoryBudget();
 
-    if (context->maxMemory > 0) {
-        limiter.LimitMemory(context->maxMemory);
-        limiter.LimitDisk(context->maxMemory); // avoid using unlimited disk as cache
-        if (debug) printf( "maxMemory set to: %d\n", context->maxMemory );
+// RAII to give a job's reservation back to the memory budget
+class MemoryReservation
+{
+public:
+    MemoryReservation() : bytes(0) {}
+    ~MemoryReservation() {
+        if (bytes) {
+            budget.Release(bytes);
+        }
+    }
+    std::string Reserve(MagickCore::MagickSizeType more, bool canWait, const job_control *control) {
+        std::string error = budget.Reserve(more, canWait, control);
+        if ( error.empty() ) {
+            bytes += more;
+        }
+        return error;
     }
 
-    Magick::Blob srcBlob( context->srcData, context->length );
+private:
+    MagickCore::MagickSizeType bytes;
+};
 
+// Image decoded once by load(), shared by the jobs run on its handle.
+// Jobs hold the mutex while they use the image, so jobs on one handle run one at a time.
+struct loaded_image {
     Magick::Image image;
+    std::mutex mutex;
+    // the pixel cache stays reserved in the memory budget as long as the image is loaded
+    MemoryReservation reservation;
+    MagickCore::MagickSizeType bytes;
 
-    if ( !ReadImageMagick(&image, srcBlob, context->srcFormat, context) )
-        return;
+    loaded_image() : bytes(0) {}
+};
 
-    if (!context->background.empty()) {
-        try {
-            Magick::Color bg(context->background.c_str());
-            Magick::Image background(image.size(), bg);
+// MurmurHash3 x64 128 by Austin Appleby (public domain), hashes the sources and options of cached calls
+static inline uint64_t Rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
 
-            if (debug) {
-                printf("background: %s\n", static_cast<std::string>(bg).c_str());
-            }
+static inline uint64_t Fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
 
-            background.composite(image, Magick::ForgetGravity, Magick::OverCompositeOp);
-            image.composite(background, Magick::ForgetGravity, Magick::CopyCompositeOp);
-        } catch ( Magick::WarningOption &warning ){
-            if (debug) printf("Warning: %s\n", warning.what());
-        }
+// 32 hex digits of the 128 bit hash of data
+std::string Hash128(const char *data, size_t length) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    const size_t blocks = length / 16;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+
+    for (size_t i = 0; i < blocks; i++) {
+        uint64_t k1, k2;
+        memcpy(&k1, bytes + i * 16, 8);
+        memcpy(&k2, bytes + i * 16 + 8, 8);
+
+        k1 *= c1; k1 = Rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = Rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = Rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = Rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
     }
 
-    if (debug) printf("original width,height: %d, %d\n", (int) image.columns(), (int) image.rows());
+    const uint8_t *tail = bytes + blocks * 16;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    switch ( length & 15 ) {
+        case 15: k2 ^= ((uint64_t) tail[ 14 ]) << 48; // fall through
+        case 14: k2 ^= ((uint64_t) tail[ 13 ]) << 40; // fall through
+        case 13: k2 ^= ((uint64_t) tail[ 12 ]) << 32; // fall through
+        case 12: k2 ^= ((uint64_t) tail[ 11 ]) << 24; // fall through
+        case 11: k2 ^= ((uint64_t) tail[ 10 ]) << 16; // fall through
+        case 10: k2 ^= ((uint64_t) tail[ 9 ]) << 8;   // fall through
+        case  9: k2 ^= ((uint64_t) tail[ 8 ]);
+                 k2 *= c2; k2 = Rotl64(k2, 33); k2 *= c1; h2 ^= k2; // fall through
+        case  8: k1 ^= ((uint64_t) tail[ 7 ]) << 56;  // fall through
+        case  7: k1 ^= ((uint64_t) tail[ 6 ]) << 48;  // fall through
+        case  6: k1 ^= ((uint64_t) tail[ 5 ]) << 40;  // fall through
+        case  5: k1 ^= ((uint64_t) tail[ 4 ]) << 32;  // fall through
+        case  4: k1 ^= ((uint64_t) tail[ 3 ]) << 24;  // fall through
+        case  3: k1 ^= ((uint64_t) tail[ 2 ]) << 16;  // fall through
+        case  2: k1 ^= ((uint64_t) tail[ 1 ]) << 8;   // fall through
+        case  1: k1 ^= ((uint64_t) tail[ 0 ]);
+                 k1 *= c1; k1 = Rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
 
-    unsigned int width = context->width;
-    if (debug) printf( "width: %d\n", width );
+    h1 ^= length; h2 ^= length;
+    h1 += h2; h2 += h1;
+    h1 = Fmix64(h1); h2 = Fmix64(h2);
+    h1 += h2; h2 += h1;
 
-    unsigned int height = context->height;
-    if (debug) printf( "height: %d\n", height );
+    char hex[ 33 ];
+    snprintf(hex, sizeof(hex), "%016llx%016llx", (unsigned long long) h1, (unsigned long long) h2);
+    return std::string(hex);
+}
 
-    if ( context->strip ) {
-        if (debug) printf( "strip: true\n" );
-        image.strip();
+// Blobs not sharing their data with blobs, Buffers handed to JS must never alias a cache entry
+void CopyBlobs(const std::vector<Magick::Blob> &blobs, std::vector<Magick::Blob> *copies) {
+    copies->resize(blobs.size());
+    for (size_t i = 0; i < blobs.size(); i++) {
+        (*copies)[ i ].update(blobs[ i ].data(), blobs[ i ].length());
     }
+}
 
-    if ( context->trim ) {
-        if (debug) printf( "trim: true\n" );
-        double trimFuzz = context->trimFuzz;
-        if ( trimFuzz != trimFuzz ) {
-            image.trim();
-        } else {
-            if (debug) printf( "fuzz: %lf\n", trimFuzz );
-            double fuzz = image.colorFuzz();
-            image.colorFuzz(trimFuzz);
-            image.trim();
-            image.colorFuzz(fuzz);
-            if (debug) printf( "restored fuzz: %lf\n", fuzz );
-        }
-        if (debug) printf( "trimmed width,height: %d, %d\n", (int) image.columns(), (int) image.rows() );
+// Content addressed cache of results, keyed by the operation, its normalized options and a hash of its sources.
+// Entries are kept in memory in an LRU bounded by bytes, and optionally in files of a local directory,
+// which outlive the process and are never evicted by the addon.
+class ResultCache
+{
+public:
+    ResultCache()
+      : limit(0),
+        bytes(0),
+        hits(0),
+        diskHits(0),
+        misses(0),
+        coalesced(0),
+        evictions(0),
+        files(0) {
     }
 
-    const char* resizeStyle = context->resizeStyle.c_str();
-    if (debug) printf( "resizeStyle: %s\n", resizeStyle );
-
-    const char* gravity = context->gravity.c_str();
-    if ( strcmp("Center", gravity)!=0
-      && strcmp("East", gravity)!=0
-      && strcmp("West", gravity)!=0
-      && strcmp("North", gravity)!=0
-      && strcmp("South", gravity)!=0
-      && strcmp("NorthEast", gravity)!=0
-      && strcmp("NorthWest", gravity)!=0
-      && strcmp("SouthEast", gravity)!=0
-      && strcmp("SouthWest", gravity)!=0
-      && strcmp("None", gravity)!=0
-    ) {
-        context->error = std::string("gravity not supported");
-        return;
+    bool Enabled() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return limit || ! dir.empty();
     }
-    if (debug) printf( "gravity: %s\n", gravity );
 
-    if( ! context->format.empty() ){
-        if (debug) printf( "format: %s\n", context->format.c_str() );
-        image.magick( context->format.c_str() );
+    void Configure(MagickCore::MagickSizeType newLimit, const std::string &newDir) {
+        std::lock_guard<std::mutex> lock(mutex);
+        limit = newLimit;
+        dir   = newDir;
+        Evict();
     }
 
-    if( ! context->filter.empty() ){
-        const char *filter = context->filter.c_str();
+    // Copies the entry of key from memory into blobs, returns false when there is none
+    bool Get(const std::string &key, std::vector<Magick::Blob> *blobs) {
+        std::vector<Magick::Blob> shared;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::unordered_map<std::string, std::list<cache_entry>::iterator>::iterator found = index.find(key);
+            if ( found == index.end() ) {
+                return false;
+            }
+            lru.splice(lru.begin(), lru, found->second);
+            shared = found->second->blobs;
+            hits++;
+        }
+        CopyBlobs(shared, blobs);
+        return true;
+    }
 
-        ssize_t option_info = MagickCore::ParseCommandOption(MagickCore::MagickFilterOptions, Magick::MagickFalse, filter);
-        if (option_info != -1) {
-            if (debug) printf( "filter: %s\n", filter );
-            image.filterType( (Magick::FilterTypes)option_info );
+    // Keeps a copy of blobs in memory, evicting the least recently used entries beyond the limit
+    void Put(const std::string &key, const std::vector<Magick::Blob> &blobs) {
+        MagickCore::MagickSizeType size = key.size();
+        for (size_t i = 0; i < blobs.size(); i++) {
+            size += blobs[ i ].length();
         }
-        else {
-            context->error = std::string("filter not supported");
+        if ( size > Limit() ) {
             return;
         }
+        cache_entry entry;
+        entry.key  = key;
+        entry.size = size;
+        CopyBlobs(blobs, &entry.blobs);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unordered_map<std::string, std::list<cache_entry>::iterator>::iterator found = index.find(key);
+        if ( found != index.end() ) {
+            bytes -= found->second->size;
+            lru.erase(found->second);
+        }
+        lru.push_front(entry);
+        index[ key ] = lru.begin();
+        bytes += size;
+        Evict();
     }
 
-    if( ! context->blur.empty() ) {
-        double blur = atof (context->blur.c_str());
-        if (debug) printf( "blur: %.1f\n", blur );
-        image.blur(0, blur);
+    // Reads the entry of key from the cache directory into blobs and memory, worker threads
+    bool Read(const std::string &key, std::vector<Magick::Blob> *blobs) {
+        std::string path = Path(key);
+        if ( path.empty() ) {
+            return false;
+        }
+        FILE *file = fopen(path.c_str(), "rb");
+        if ( ! file ) {
+            return false;
+        }
+        bool ok = true;
+        uint32_t count = 0;
+        if ( fread(&count, sizeof(count), 1, file) != 1 ) {
+            ok = false;
+        }
+        std::vector<Magick::Blob> read;
+        for (uint32_t i = 0; ok && i < count; i++) {
+            uint64_t length = 0;
+            if ( fread(&length, sizeof(length), 1, file) != 1 ) {
+                ok = false;
+                break;
+            }
+            void *data = malloc(length ? length : 1);
+            if ( ! data || fread(data, 1, length, file) != length ) {
+                free(data);
+                ok = false;
+                break;
+            }
+            Magick::Blob blob;
+            blob.updateNoCopy(data, length, Magick::Blob::MallocAllocator);
+            read.push_back(blob);
+        }
+        fclose(file);
+        if ( ! ok ) {
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            diskHits++;
+        }
+        Put(key, read);
+        blobs->swap(read);
+        return true;
     }
 
-    if ( width || height ) {
-        if ( ! width  ) { width  = image.columns(); }
-        if ( ! height ) { height = image.rows();    }
+    // Writes blobs to the cache directory, through a temporary file so readers never see a partial entry
+    void Write(const std::string &key, const std::vector<Magick::Blob> &blobs) {
+        std::string path = Path(key);
+        if ( path.empty() ) {
+            return;
+        }
+        std::string temporary;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            temporary = path + "." + std::to_string(++files) + ".tmp";
+        }
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if ( ! file ) {
+            return;
+        }
+        uint32_t count = blobs.size();
+        bool ok = fwrite(&count, sizeof(count), 1, file) == 1;
+        for (size_t i = 0; ok && i < blobs.size(); i++) {
+            uint64_t length = blobs[ i ].length();
+            ok = fwrite(&length, sizeof(length), 1, file) == 1
+              && fwrite(blobs[ i ].data(), 1, length, file) == length;
+        }
+        if ( fclose(file) != 0 || ! ok || rename(temporary.c_str(), path.c_str()) != 0 ) {
+            remove(temporary.c_str());
+        }
+    }
 
-        // do resize
-        if ( strcmp( resizeStyle, "aspectfill" ) == 0 ) {
-            // ^ : Fill Area Flag ('^' flag)
-            // is not implemented in Magick++
-            // and gravity: center, extent doesnt look like working as exptected
-            // so we do it ourselves
+    void CountMiss()      { std::lock_guard<std::mutex> lock(mutex); misses++; }
+    void CountCoalesced() { std::lock_guard<std::mutex> lock(mutex); coalesced++; }
 
-            // keep aspect ratio, get the exact provided size, crop top/bottom or left/right if necessary
-            double aspectratioExpected = (double)height / (double)width;
-            double aspectratioOriginal = (double)image.rows() / (double)image.columns();
-            unsigned int xoffset = 0;
-            unsigned int yoffset = 0;
-            unsigned int resizewidth;
-            unsigned int resizeheight;
+    MagickCore::MagickSizeType Limit()     { std::lock_guard<std::mutex> lock(mutex); return limit; }
+    std::string Dir()                      { std::lock_guard<std::mutex> lock(mutex); return dir; }
+    MagickCore::MagickSizeType Bytes()     { std::lock_guard<std::mutex> lock(mutex); return bytes; }
+    MagickCore::MagickSizeType Entries()   { std::lock_guard<std::mutex> lock(mutex); return lru.size(); }
+    MagickCore::MagickSizeType Hits()      { std::lock_guard<std::mutex> lock(mutex); return hits; }
+    MagickCore::MagickSizeType DiskHits()  { std::lock_guard<std::mutex> lock(mutex); return diskHits; }
+    MagickCore::MagickSizeType Misses()    { std::lock_guard<std::mutex> lock(mutex); return misses; }
+    MagickCore::MagickSizeType Coalesced() { std::lock_guard<std::mutex> lock(mutex); return coalesced; }
+    MagickCore::MagickSizeType Evictions() { std::lock_guard<std::mutex> lock(mutex); return evictions; }
 
-            if ( aspectratioExpected > aspectratioOriginal ) {
-                // expected is taller
-                resizewidth  = (unsigned int)( (double)height / (double)image.rows() * (double)image.columns() + 1. );
+private:
+    struct cache_entry {
+        std::string key;
+        std::vector<Magick::Blob> blobs;
+        MagickCore::MagickSizeType size;
+    };
+
+    // called with the mutex held
+    void Evict() {
+        while ( bytes > limit && ! lru.empty() ) {
+            bytes -= lru.back().size;
+            index.erase(lru.back().key);
+            lru.pop_back();
+            evictions++;
+        }
+    }
+
+    // file of key in the cache directory, empty when there is no directory
+    std::string Path(const std::string &key) {
+        std::string directory = Dir();
+        if ( directory.empty() ) {
+            return directory;
+        }
+        return directory + "/" + Hash128(key.data(), key.size());
+    }
+
+    std::mutex mutex;
+    std::list<cache_entry> lru;
+    std::unordered_map<std::string, std::list<cache_entry>::iterator> index;
+
+    MagickCore::MagickSizeType limit;
+    std::string dir;
+    MagickCore::MagickSizeType bytes;
+    MagickCore::MagickSizeType hits;
+    MagickCore::MagickSizeType diskHits;
+    MagickCore::MagickSizeType misses;
+    MagickCore::MagickSizeType coalesced;
+    MagickCore::MagickSizeType evictions;
+    unsigned long files;
+};
+
+// never destroyed, like the worker pool
+static ResultCache& cache = *new ResultCache();
+
+// Calls counted by stats(), by the module function that made them
+enum CallOperation {
+    ConvertOperation,
+    ConvertStreamOperation,
+    CompositeOperation,
+    IdentifyOperation,
+    GetConstPixelsOperation,
+    QuantizeColorsOperation,
+    LoadOperation,
+    RegisterOverlayOperation,
+    FingerprintOperation,
+    OperationCount
+};
+
+static const char* const operationNames[ OperationCount ] = {
+    "convert",
+    "convertStream",
+    "composite",
+    "identify",
+    "getConstPixels",
+    "quantizeColors",
+    "load",
+    "registerOverlay",
+    "fingerprint",
+};
+
+// latency bucket i counts calls shorter than 2^i ms, the last one every longer call
+static const int LatencyBucketCount = 18;
+
+// Process wide counters of stats(), shared by every JS environment.
+// A finished call costs a few relaxed atomic increments, so they are always on. Only failures take the mutex.
+class CallStats
+{
+public:
+    CallStats() : warningsIgnored(0), cacheSpills(0) {
+        for (int i = 0; i < OperationCount; i++) {
+            operation_stats &op = operations[ i ];
+            op.calls    = 0;
+            op.errors   = 0;
+            op.bytesIn  = 0;
+            op.bytesOut = 0;
+            op.pixels   = 0;
+            op.latencyUs = 0;
+            for (int b = 0; b < LatencyBucketCount; b++) {
+                op.latency[ b ] = 0;
+            }
+        }
+    }
+
+    // Any thread, once per call. stage is the last stage the call completed, NULL when it failed before any.
+    void Finished(int operation, uint64_t ns, uint64_t bytesIn, uint64_t bytesOut, uint64_t pixels, bool failed, const char *stage) {
+        operation_stats &op = operations[ operation ];
+        op.calls.fetch_add(1, std::memory_order_relaxed);
+        op.bytesIn.fetch_add(bytesIn, std::memory_order_relaxed);
+        op.bytesOut.fetch_add(bytesOut, std::memory_order_relaxed);
+        op.pixels.fetch_add(pixels, std::memory_order_relaxed);
+        op.latencyUs.fetch_add(ns / 1000, std::memory_order_relaxed);
+
+        uint64_t ms = ns / 1000000;
+        int bucket = 0;
+        while ( bucket < LatencyBucketCount - 1 && ms >= ( (uint64_t) 1 << bucket ) ) {
+            bucket++;
+        }
+        op.latency[ bucket ].fetch_add(1, std::memory_order_relaxed);
+
+        if ( failed ) {
+            op.errors.fetch_add(1, std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(mutex);
+            errorsByStage[ stage ? stage : "none" ]++;
+        }
+    }
+
+    // a warning that failed no call because of "ignoreWarnings"
+    void WarningIgnored() {
+        warningsIgnored.fetch_add(1, std::memory_order_relaxed);
+    }
+    // a decoded image whose pixel cache didn't fit in memory and went to a disk or memory mapped file
+    void CacheSpilled() {
+        cacheSpills.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    struct operation_stats {
+        std::atomic<uint64_t> calls;
+        std::atomic<uint64_t> errors;
+        std::atomic<uint64_t> bytesIn;
+        std::atomic<uint64_t> bytesOut;
+        std::atomic<uint64_t> pixels;
+        std::atomic<uint64_t> latencyUs;
+        std::atomic<uint64_t> latency[ LatencyBucketCount ];
+    };
+
+    const operation_stats& Operation(int operation) const {
+        return operations[ operation ];
+    }
+    std::map<std::string, uint64_t> ErrorsByStage() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return errorsByStage;
+    }
+    uint64_t WarningsIgnored() const {
+        return warningsIgnored.load(std::memory_order_relaxed);
+    }
+    uint64_t CacheSpills() const {
+        return cacheSpills.load(std::memory_order_relaxed);
+    }
+
+private:
+    operation_stats operations[ OperationCount ];
+    std::atomic<uint64_t> warningsIgnored;
+    std::atomic<uint64_t> cacheSpills;
+
+    std::mutex mutex;
+    std::map<std::string, uint64_t> errorsByStage;
+};
+
+// never destroyed, like the worker pool
+static CallStats& stats = *new CallStats();
+
+// Number of threads ImageMagick may use for one job, 0 derives it from the number of cores.
+// Set by threads() on any environment's loop thread, read by the pool's workers.
+static std::atomic<unsigned int> threadsPerJob(0);
+
+unsigned int CpuCount() {
+    unsigned int cores = std::thread::hardware_concurrency();
+    return cores ? cores : 1;
+}
+
+// Threads one job may use. By default all workers busy at once use at most one thread per core.
+unsigned int ThreadBudget(unsigned int requested) {
+    unsigned int cores   = CpuCount();
+    unsigned int threads = requested ? requested : threadsPerJob.load();
+    if ( ! threads ) {
+        threads = cores / pool.Size();
+    }
+    if ( threads > cores ) {
+        threads = cores;
+    }
+    return threads ? threads : 1;
+}
+
+// ImageMagick's thread limit is process wide, there is no per job limit to set.
+// A per call "threads" is advisory: concurrent jobs asking for different budgets, or an animated job
+// splitting its budget among frame threads, overwrite each other's limit and all run with whichever was set last.
+// Only the module wide setting of threads() is a budget every job keeps to.
+void SetThreadBudget(unsigned int requested, int debug) {
+    unsigned int threads = ThreadBudget(requested);
+    if (debug) printf( "threads: %u\n", threads );
+    MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, threads);
+}
+
+// Results of a call split into one job per source (composite) or per page (convert), handed back together as an Array
+struct job_batch {
+    Nan::Callback *callback;
+    // the result of each job, as stored in the cache
+    std::vector< std::vector<Magick::Blob> > results;
+    bool multiOutput;
+    std::string error;
+    size_t pending;
+
+    job_batch() : callback(NULL), multiOutput(false), pending(0) {}
+    ~job_batch() {
+        delete callback;
+    }
+};
+
+// Base context for calls shared on sync and async code paths
+struct im_ctx_base {
+    Nan::Callback * callback;
+    std::string error;
+
+    char* srcData;
+    size_t length;
+    int debug;
+    int ignoreWarnings;
+    unsigned int threads;
+    int priority;
+    std::string srcFormat;
+    // set by "srcPath": the worker maps the file as srcData while the job runs
+    std::string srcPath;
+    // set by "dstPath": the worker writes dstBlob to the file instead of handing it back
+    std::string dstPath;
+    // the job's own work, while a job on files runs through FileWork
+    uv_work_cb fileWork;
+
+    // per request limits of the decoded image, 0 is unlimited
+    MagickCore::MagickSizeType maxMemory;
+    MagickCore::MagickSizeType maxPixels;
+
+    // generated blob by convert or composite
+    Magick::Blob dstBlob;
+    // generated blobs when convert was asked for several outputs
+    std::vector<Magick::Blob> dstBlobs;
+    bool multiOutput;
+
+    // opt-in per stage timings, reported to the "metrics" callback
+    Nan::Callback * metrics;
+    uint64_t createdAt;
+    uint64_t stageStart;
+    // ms spent in each stage, in the order the stages first ran
+    std::vector< std::pair<std::string, double> > timings;
+
+    // counted in stats() when the call finishes
+    int operation;
+    // the last stage that ended, kept whether or not the call has a metrics callback
+    const char *stage;
+    uint64_t decodedPixels;
+    // srcPath's size, and the bytes written to dstPath, once the job on files dropped them
+    size_t mappedLength;
+    size_t writtenLength;
+
+    // image of load() the job runs on instead of decoding srcData
+    std::shared_ptr<loaded_image> loaded;
+
+    // "timeoutMs", and the state of cancel() and the deadline when either was given
+    unsigned int timeoutMs;
+    std::shared_ptr<job_control> control;
+    // the job's own callbacks, while a controlled job runs through ControlledWork and ControlledAfter
+    uv_work_cb controlledWork;
+    void (*controlledAfter)(uv_work_t*);
+
+    // key of the result in the cache, empty when the call is not cached
+    std::string cacheKey;
+    // the job's own callbacks, while a cached job runs through CachedWork and CachedAfter
+    uv_work_cb cachedWork;
+    void (*cachedAfter)(uv_work_t*);
+
+    // set on the jobs of a batch
+    std::shared_ptr<job_batch> batch;
+    size_t batchIndex;
+
+    im_ctx_base() : callback(NULL), srcData(NULL), length(0), threads(0), priority(InteractivePriority), fileWork(NULL), maxMemory(0), maxPixels(0), multiOutput(false), metrics(NULL), createdAt(uv_hrtime()), stageStart(createdAt), operation(ConvertOperation), stage(NULL), decodedPixels(0), mappedLength(0), writtenLength(0), timeoutMs(0), controlledWork(NULL), controlledAfter(NULL), cachedWork(NULL), cachedAfter(NULL), batchIndex(0) {}
+    virtual ~im_ctx_base() {
+        delete metrics;
+    }
+
+    // The result as stored in the cache, the generated blobs unless overridden
+    virtual void CacheResult(std::vector<Magick::Blob> *blobs) {
+        if ( multiOutput ) {
+            *blobs = dstBlobs;
+        }
+        else {
+            blobs->push_back(dstBlob);
+        }
+    }
+    virtual void CacheRestore(const std::vector<Magick::Blob> &blobs) {
+        if ( multiOutput ) {
+            dstBlobs = blobs;
+        }
+        else if ( ! blobs.empty() ) {
+            dstBlob = blobs[ 0 ];
+        }
+    }
+
+    // The value handed back for the generated blobs, the blobs themselves unless overridden
+    virtual Local<Value> WrapResult(Local<Value> blobs) {
+        return blobs;
+    }
+
+    // Ends the current stage, the time since the previous stage ended is added to stage.
+    // The first stage of every job is "queueWait", from the call until a worker picked the job up.
+    void Time(const char *stage) {
+        this->stage = stage;
+        if ( ! metrics ) {
+            return;
+        }
+        uint64_t now = uv_hrtime();
+        double ms    = (now - stageStart) / 1e6;
+        stageStart   = now;
+        for (size_t i = 0; i < timings.size(); i++) {
+            if ( timings[ i ].first == stage ) {
+                timings[ i ].second += ms;
+                return;
+            }
+        }
+        timings.push_back(std::make_pair(std::string(stage), ms));
+    }
+};
+
+// Option names read on every call, created once as persistent strings by InitOptionKeys()
+enum OptionKey {
+    SrcDataKey,
+    DebugKey,
+    IgnoreWarningsKey,
+    ThreadsKey,
+    PriorityKey,
+    MaxMemoryKey,
+    MaxPixelsKey,
+    MetricsKey,
+    TrimKey,
+    TrimFuzzKey,
+    StripKey,
+    ShrinkOnLoadKey,
+    SrcFormatKey,
+    BackgroundKey,
+    OutputsKey,
+    WidthKey,
+    HeightKey,
+    XoffsetKey,
+    YoffsetKey,
+    QualityKey,
+    RotateKey,
+    FlipKey,
+    DensityKey,
+    AutoOrientKey,
+    BlurKey,
+    ResizeStyleKey,
+    GravityKey,
+    FormatKey,
+    FilterKey,
+    ColorspaceKey,
+    CacheKey,
+    ImageKey,
+    CompositeDataKey,
+    LayersKey,
+    OverlayKey,
+    XKey,
+    YKey,
+    OpacityKey,
+    ComposeKey,
+    TimeoutMsKey,
+    JobIdKey,
+    AnimatedKey,
+    PagesKey,
+    SrcRegionKey,
+    SrcPathKey,
+    DstPathKey,
+    FingerprintKey,
+    PingKey,
+    ColumnsKey,
+    RowsKey,
+    MapKey,
+    DepthKey,
+    ColorsKey,
+    OptionKeyCount
+};
+static const char* const optionKeyNames[ OptionKeyCount ] = {
+    "srcData",
+    "debug",
+    "ignoreWarnings",
+    "threads",
+    "priority",
+    "maxMemory",
+    "maxPixels",
+    "metrics",
+    "trim",
+    "trimFuzz",
+    "strip",
+    "shrinkOnLoad",
+    "srcFormat",
+    "background",
+    "outputs",
+    "width",
+    "height",
+    "xoffset",
+    "yoffset",
+    "quality",
+    "rotate",
+    "flip",
+    "density",
+    "autoOrient",
+    "blur",
+    "resizeStyle",
+    "gravity",
+    "format",
+    "filter",
+    "colorspace",
+    "cache",
+    "image",
+    "compositeData",
+    "layers",
+    "overlay",
+    "x",
+    "y",
+    "opacity",
+    "compose",
+    "timeoutMs",
+    "jobId",
+    "animated",
+    "pages",
+    "srcRegion",
+    "srcPath",
+    "dstPath",
+    "fingerprint",
+    "ping",
+    "columns",
+    "rows",
+    "map",
+    "depth",
+    "colors",
+};
+// Each JS environment has its own, created by init() on its thread
+static thread_local Nan::Persistent<String>* optionKeys = NULL;
+
+void InitOptionKeys() {
+    optionKeys = new Nan::Persistent<String>[ OptionKeyCount ];
+    for (int i = 0; i < OptionKeyCount; i++) {
+        optionKeys[ i ].Reset(Nan::New<String>(optionKeyNames[ i ]).ToLocalChecked());
+    }
+}
+
+Local<Value> GetOption(Local<Object> obj, OptionKey key) {
+    return Nan::Get( obj, Nan::New(optionKeys[ key ]) ).ToLocalChecked();
+}
+
+// Reads the "metrics" option, a function called with the per stage timings of the call
+void ParseMetrics(Local<Object> obj, im_ctx_base *context) {
+    Local<Value> metricsValue = GetOption( obj, MetricsKey );
+    if ( metricsValue->IsFunction() ) {
+        context->metrics    = new Nan::Callback(Local<Function>::Cast(metricsValue));
+    }
+}
+
+// Counts the finished call in stats(),
+// then calls the "metrics" callback with { stage: ms, ..., total: ms }, total runs until the result is handed back
+void ReportMetrics(im_ctx_base *context) {
+    // dstBlob repeats dstBlobs[ 0 ] when there are renditions, results from the cache only fill dstBlob
+    size_t bytesOut = context->writtenLength;
+    if ( context->dstBlobs.empty() ) {
+        bytesOut += context->dstBlob.length();
+    }
+    for (size_t i = 0; i < context->dstBlobs.size(); i++) {
+        bytesOut += context->dstBlobs[ i ].length();
+    }
+    stats.Finished(context->operation, uv_hrtime() - context->createdAt, context->length + context->mappedLength, bytesOut,
+        context->decodedPixels, ! context->error.empty(), context->stage);
+
+    if ( ! context->metrics ) {
+        return;
+    }
+    Nan::HandleScope scope;
+
+    Local<Object> out = Nan::New<Object>();
+    for (size_t i = 0; i < context->timings.size(); i++) {
+        Nan::Set(out, Nan::New<String>(context->timings[ i ].first.c_str()).ToLocalChecked(), Nan::New<Number>(context->timings[ i ].second));
+    }
+    Nan::Set(out, Nan::New<String>("total").ToLocalChecked(), Nan::New<Number>((uv_hrtime() - context->createdAt) / 1e6));
+
+    Local<Value> argv[1] = { out };
+    Nan::AsyncResource resource("ReportMetrics");
+    context->metrics->Call(1, argv, &resource);
+}
+// Reads the "cache" option, false opts the call out of an enabled cache.
+// Calls on an Image handle are never cached, their source is already decoded.
+bool UseCache(Local<Object> obj, im_ctx_base *context) {
+    if ( context->loaded ) {
+        return false;
+    }
+    Local<Value> cacheValue = GetOption( obj, CacheKey );
+    return ( cacheValue->IsUndefined() || Nan::To<Boolean>(cacheValue).ToLocalChecked()->IsTrue() ) && cache.Enabled();
+}
+
+// Key of a cached call: the operation, its normalized options, its limits and the hash of its source.
+// A call that must fail its maxMemory or maxPixels never gets the result of a call without them.
+std::string MakeCacheKey(const char *operation, const std::string &options, im_ctx_base *context) {
+    return std::string(operation) + "\n" + options + "\n" +
+        std::to_string(context->maxMemory) + " " + std::to_string(context->maxPixels) + "\n" +
+        Hash128(context->srcData, context->length);
+}
+
+// Async jobs with the same key as one in flight wait for its result, per JS environment on its loop thread
+struct cache_waiter {
+    uv_work_t* req;
+    void (*after)(uv_work_t*);
+};
+static thread_local std::unordered_map< std::string, std::vector<cache_waiter> > cacheInFlight;
+
+// Finds the file tier entry before running the job's work, and stores its result in both tiers
+void CachedWork(uv_work_t* req) {
+    im_ctx_base* context = static_cast<im_ctx_base*>(req->data);
+
+    std::vector<Magick::Blob> blobs;
+    if ( cache.Read(context->cacheKey, &blobs) ) {
+        context->Time("queueWait");
+        context->CacheRestore(blobs);
+        context->Time("cache");
+        return;
+    }
+    cache.CountMiss();
+
+    context->cachedWork(req);
+    if ( ! context->error.empty() ) {
+        return;
+    }
+    context->CacheResult(&blobs);
+    cache.Put(context->cacheKey, blobs);
+    cache.Write(context->cacheKey, blobs);
+}
+
+// Hands the result of a cached job to the calls that joined it while it ran
+void CachedAfter(uv_work_t* req) {
+    im_ctx_base* context = static_cast<im_ctx_base*>(req->data);
+
+    std::vector<cache_waiter> waiters;
+    std::unordered_map< std::string, std::vector<cache_waiter> >::iterator found = cacheInFlight.find(context->cacheKey);
+    // controlled jobs never lead, the calls waiting on the key belong to another job
+    if ( ! context->control && found != cacheInFlight.end() ) {
+        waiters.swap(found->second);
+        cacheInFlight.erase(found);
+    }
+
+    std::string error = context->error;
+    std::vector<Magick::Blob> blobs;
+    if ( error.empty() && ! waiters.empty() ) {
+        context->CacheResult(&blobs);
+    }
+    context->cachedAfter(req);
+
+    for (size_t i = 0; i < waiters.size(); i++) {
+        im_ctx_base* waiter = static_cast<im_ctx_base*>(waiters[ i ].req->data);
+        if ( error.empty() ) {
+            std::vector<Magick::Blob> copies;
+            CopyBlobs(blobs, &copies);
+            waiter->CacheRestore(copies);
+        }
+        else {
+            waiter->error = error;
+        }
+        waiters[ i ].after(waiters[ i ].req);
+    }
+}
+
+// Answers an async call from memory, or joins the identical call in flight.
+// Returns false when the job has to run, it then leads the calls that join it.
+bool CacheBegin(uv_work_t* req, void (*after)(uv_work_t*)) {
+    im_ctx_base* context = static_cast<im_ctx_base*>(req->data);
+
+    std::vector<Magick::Blob> blobs;
+    if ( cache.Get(context->cacheKey, &blobs) ) {
+        context->CacheRestore(blobs);
+        context->Time("cache");
+        pool.Complete(req, after);
+        return true;
+    }
+    // a call that may be cancelled or time out must not fail the calls joining it
+    if ( context->control ) {
+        return false;
+    }
+
+    std::unordered_map< std::string, std::vector<cache_waiter> >::iterator found = cacheInFlight.find(context->cacheKey);
+    if ( found != cacheInFlight.end() ) {
+        cache.CountCoalesced();
+        cache_waiter waiter = { req, after };
+        found->second.push_back(waiter);
+        return true;
+    }
+    cacheInFlight[ context->cacheKey ];
+    return false;
+}
+
+// A source file mapped read only while a job decodes it, so large sources never pass through the V8 heap.
+// Read whole on Windows.
+class MappedFile
+{
+public:
+    MappedFile() : data(NULL), length(0), mapped(false) {}
+    ~MappedFile() {
+#ifndef _WIN32
+        if ( mapped ) {
+            munmap(const_cast<char*>(data), length);
+        }
+#endif
+    }
+
+    bool Open(const std::string &path, std::string *error) {
+#ifndef _WIN32
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if ( fd < 0 || fstat(fd, &st) != 0 ) {
+            *error = std::string("unable to open srcPath: ") + strerror(errno);
+            if ( fd >= 0 ) {
+                close(fd);
+            }
+            return false;
+        }
+        length = st.st_size;
+        if ( length ) {
+            void *address = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if ( address == MAP_FAILED ) {
+                *error = std::string("unable to map srcPath: ") + strerror(errno);
+                close(fd);
+                return false;
+            }
+            // decoders read the source front to back
+            madvise(address, length, MADV_SEQUENTIAL);
+            data = static_cast<const char*>(address);
+            mapped = true;
+        }
+        else {
+            data = "";
+        }
+        close(fd);
+#else
+        FILE *file = fopen(path.c_str(), "rb");
+        if ( ! file ) {
+            *error = std::string("unable to open srcPath: ") + strerror(errno);
+            return false;
+        }
+        char chunk[ 65536 ];
+        size_t count;
+        while ( (count = fread(chunk, 1, sizeof(chunk), file)) > 0 ) {
+            contents.append(chunk, count);
+        }
+        fclose(file);
+        data = contents.data();
+        length = contents.size();
+#endif
+        return true;
+    }
+
+    const char *data;
+    size_t length;
+
+private:
+    bool mapped;
+#ifdef _WIN32
+    std::string contents;
+#endif
+};
+
+// Writes the result of a job to dstPath, it is not handed back to JS
+bool WriteDestination(im_ctx_base *context) {
+    FILE *file = fopen(context->dstPath.c_str(), "wb");
+    if ( ! file ) {
+        context->error = std::string("unable to open dstPath: ") + strerror(errno);
+        return false;
+    }
+    size_t written = fwrite(context->dstBlob.data(), 1, context->dstBlob.length(), file);
+    if ( fclose(file) != 0 || written != context->dstBlob.length() ) {
+        context->error = std::string("unable to write dstPath: ") + strerror(errno);
+        remove(context->dstPath.c_str());
+        return false;
+    }
+    context->writtenLength = written;
+    context->dstBlob = Magick::Blob();
+    context->dstBlobs.clear();
+    context->Time("write");
+    return true;
+}
+
+// Runs the work of a job on files: srcPath is mapped as its srcData, and its result is written to dstPath
+void FileWork(uv_work_t* req) {
+    im_ctx_base* context = static_cast<im_ctx_base*>(req->data);
+
+    MappedFile source;
+    if ( ! context->srcPath.empty() ) {
+        if ( ! source.Open(context->srcPath, &context->error) ) {
+            context->Time("queueWait");
+            return;
+        }
+        context->srcData = source.data;
+        context->length  = source.length;
+    }
+    context->fileWork(req);
+    // the mapping ends with this function
+    context->srcData = NULL;
+    context->length  = 0;
+    context->mappedLength = source.length;
+
+    if ( context->error.empty() && ! context->dstPath.empty() ) {
+        WriteDestination(context);
+    }
+}
+
+// Async jobs of calls with a "jobId" by id, for cancel(). Each JS environment has its own, on its loop thread
+static thread_local std::unordered_map< uint32_t, std::vector<uv_work_t*> > controlledJobs;
+// calls that failed because they were cancelled or timed out, reported by pool()
+static std::atomic<unsigned int> cancelledJobs(0);
+static std::atomic<unsigned int> timedOutJobs(0);
+
+// Runs the work of a job with a control, unless its call was cancelled or timed out while the job was queued
+void ControlledWork(uv_work_t* req) {
+    im_ctx_base* context = static_cast<im_ctx_base*>(req->data);
+    job_control* control = context->control.get();
+
+    if ( control->Stopped() ) {
+        context->Time("queueWait");
+        context->error = control->Reason();
+        return;
+    }
+    context->controlledWork(req);
+    // an interrupted operation returns an incomplete image, and a cancelled call never gets a result
+    if ( control->interrupted || control->aborted ) {
+        context->error = control->Reason();
+    }
+}
+
+void ControlledAfter(uv_work_t* req) {
+    im_ctx_base* context = static_cast<im_ctx_base*>(req->data);
+    job_control* control = context->control.get();
+
+    if ( control->id ) {
+        std::unordered_map< uint32_t, std::vector<uv_work_t*> >::iterator found = controlledJobs.find(control->id);
+        if ( found != controlledJobs.end() ) {
+            std::vector<uv_work_t*> &reqs = found->second;
+            reqs.erase(std::remove(reqs.begin(), reqs.end(), req), reqs.end());
+            if ( reqs.empty() ) {
+                controlledJobs.erase(found);
+            }
+        }
+    }
+    if ( context->error == "job cancelled" ) {
+        cancelledJobs++;
+    }
+    else if ( context->error == "job timed out" ) {
+        timedOutJobs++;
+    }
+    context->controlledAfter(req);
+}
+
+// Queues an async job on the worker pool, the job fails when its lane is full
+void QueueJob(uv_work_t* req, uv_work_cb work, void (*after)(uv_work_t*)) {
+    im_ctx_base* context = static_cast<im_ctx_base*>(req->data);
+    // files are neither hashed nor handed back, jobs on them bypass the cache
+    if ( ! context->srcPath.empty() || ! context->dstPath.empty() ) {
+        context->cacheKey.clear();
+        context->fileWork = work;
+        work = FileWork;
+    }
+    if ( context->control ) {
+        context->controlledWork  = work;
+        context->controlledAfter = after;
+        work  = ControlledWork;
+        after = ControlledAfter;
+        if ( context->control->id ) {
+            controlledJobs[ context->control->id ].push_back(req);
+        }
+    }
+    if ( ! context->cacheKey.empty() ) {
+        if ( CacheBegin(req, after) ) {
+            return;
+        }
+        context->cachedWork  = work;
+        context->cachedAfter = after;
+        work  = CachedWork;
+        after = CachedAfter;
+    }
+    if ( ! pool.Queue(req, work, after, context->priority) ) {
+        context->error = std::string("worker pool queue is full");
+    }
+}
+
+// Runs a sync job on the calling thread, answered from either tier of the cache when possible
+void RunJob(uv_work_t* req, uv_work_cb work) {
+    im_ctx_base* context = static_cast<im_ctx_base*>(req->data);
+    if ( ! context->srcPath.empty() || ! context->dstPath.empty() ) {
+        context->cacheKey.clear();
+        context->fileWork = work;
+        work = FileWork;
+    }
+    if ( context->control ) {
+        context->controlledWork = work;
+        work = ControlledWork;
+    }
+    if ( context->cacheKey.empty() ) {
+        work(req);
+        return;
+    }
+
+    std::vector<Magick::Blob> blobs;
+    if ( cache.Get(context->cacheKey, &blobs) ) {
+        context->CacheRestore(blobs);
+        context->Time("cache");
+        return;
+    }
+    context->cachedWork = work;
+    CachedWork(req);
+}
+
+// JS handle of an image decoded by load(), passed as the "image" option of the other calls
+class ImageHandle : public Nan::ObjectWrap {
+public:
+    static void Init() {
+        Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(New);
+        tpl->SetClassName(Nan::New<String>("Image").ToLocalChecked());
+        tpl->InstanceTemplate()->SetInternalFieldCount(1);
+        Nan::SetPrototypeMethod(tpl, "dispose", Dispose);
+        classTemplate().Reset(tpl);
+        constructor().Reset(Nan::GetFunction(tpl).ToLocalChecked());
+    }
+
+    static Local<Function> Constructor() {
+        return Nan::New(constructor());
+    }
+
+    static Local<Object> NewInstance(std::shared_ptr<loaded_image> loaded) {
+        Nan::EscapableHandleScope scope;
+        Local<Object> obj = Nan::NewInstance(Nan::New(constructor())).ToLocalChecked();
+        ImageHandle* handle = Nan::ObjectWrap::Unwrap<ImageHandle>(obj);
+        handle->loaded = loaded;
+        // lets V8 weigh the pixels held by an otherwise small object when scheduling GC
+        handle->external = loaded->bytes > INT_MAX ? INT_MAX : (int) loaded->bytes;
+        Nan::AdjustExternalMemory(handle->external);
+        return scope.Escape(obj);
+    }
+
+    static bool HasInstance(Local<Value> value) {
+        return Nan::New(classTemplate())->HasInstance(value);
+    }
+
+    // image of a handle, NULL once it was disposed
+    static std::shared_ptr<loaded_image> Loaded(Local<Value> value) {
+        return Nan::ObjectWrap::Unwrap<ImageHandle>(Local<Object>::Cast(value))->loaded;
+    }
+
+private:
+    ImageHandle() : external(0) {}
+    ~ImageHandle() {
+        Release();
+    }
+
+    // jobs already running keep the image until they are done
+    void Release() {
+        if ( ! loaded ) {
+            return;
+        }
+        loaded.reset();
+        Nan::AdjustExternalMemory(-external);
+        external = 0;
+    }
+
+    static Nan::Persistent<Function>& constructor() {
+        static thread_local Nan::Persistent<Function> ctor;
+        return ctor;
+    }
+
+    static Nan::Persistent<FunctionTemplate>& classTemplate() {
+        static thread_local Nan::Persistent<FunctionTemplate> tpl;
+        return tpl;
+    }
+
+    static NAN_METHOD(New) {
+        ImageHandle* handle = new ImageHandle();
+        handle->Wrap(info.This());
+        info.GetReturnValue().Set(info.This());
+    }
+
+    static NAN_METHOD(Dispose) {
+        Nan::ObjectWrap::Unwrap<ImageHandle>(info.Holder())->Release();
+    }
+
+    std::shared_ptr<loaded_image> loaded;
+    int external;
+};
+
+// Reads the source of a call: the "image" handle returned by load(), the "srcData" Buffer or the "srcPath" file.
+// Returns false when there is neither, a disposed handle sets an error in context.
+bool ParseSource(Local<Object> obj, im_ctx_base *context) {
+    Local<Value> imageValue = GetOption( obj, ImageKey );
+    if ( ImageHandle::HasInstance(imageValue) ) {
+        context->loaded = ImageHandle::Loaded(imageValue);
+        if ( ! context->loaded ) {
+            context->error = std::string("image is disposed");
+        }
+        return true;
+    }
+
+    Local<Value> srcData = GetOption( obj, SrcDataKey );
+    if ( ! Buffer::HasInstance(srcData) ) {
+        // the file is read by the worker
+        Local<Value> srcPath = GetOption( obj, SrcPathKey );
+        if ( ! srcPath->IsString() ) {
+            return false;
+        }
+        context->srcPath = *Nan::Utf8String(srcPath);
+        return true;
+    }
+    context->srcData = Buffer::Data(srcData);
+    context->length = Buffer::Length(srcData);
+    return true;
+}
+
+// Reads "dstPath", the file the result is written to instead of being handed back
+void ParseDestination(Local<Object> obj, im_ctx_base *context) {
+    Local<Value> dstPath = GetOption( obj, DstPathKey );
+    if ( dstPath->IsString() ) {
+        context->dstPath = *Nan::Utf8String(dstPath);
+    }
+}
+
+// ImageMagick's progress monitor of controlled jobs, stops the running operation once the call was cancelled or timed out
+MagickCore::MagickBooleanType ControlMonitor(const char *tag, const MagickCore::MagickOffsetType offset, const MagickCore::MagickSizeType span, void *data) {
+    job_control* control = static_cast<job_control*>(data);
+    if ( control->Stopped() ) {
+        control->interrupted = true;
+        return MagickCore::MagickFalse;
+    }
+    return MagickCore::MagickTrue;
+}
+
+// Lets control stop the decode, operations and encode of image, NULL removes the monitor.
+// Images outliving the job, like loaded images and overlays, must not keep pointing at its control.
+void WatchImage(Magick::Image *image, job_control *control) {
+    MagickCore::MagickProgressMonitor monitor = control ? ControlMonitor : NULL;
+    // image() detaches image from copies sharing it before the monitor is set
+    MagickCore::SetImageProgressMonitor(image->image(), monitor, control);
+    MagickCore::SetImageInfoProgressMonitor(image->imageInfo(), monitor, control);
+}
+
+// Source image of a job run on an Image handle, locked until lock is released.
+// Declare lock before image, so the copy is destroyed while the lock is still held.
+void UseLoadedImage(Magick::Image *image, std::unique_lock<std::mutex> *lock, im_ctx_base *context) {
+    *lock = std::unique_lock<std::mutex>(context->loaded->mutex);
+    *image = context->loaded->image;
+    if ( context->control ) {
+        WatchImage(image, context->control.get());
+    }
+}
+
+// Reads the "priority" option: "interactive" (default) or "batch"
+bool ParsePriority(Local<Object> obj, im_ctx_base *context) {
+    Local<Value> priorityValue = GetOption( obj, PriorityKey );
+    if ( priorityValue->IsUndefined() ) {
+        return true;
+    }
+    std::string priority = *Nan::Utf8String(priorityValue);
+    if ( priority == "interactive" ) {
+        context->priority = InteractivePriority;
+    }
+    else if ( priority == "batch" ) {
+        context->priority = BatchPriority;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// Reads a non-negative number option, 0 when it is missing
+MagickCore::MagickSizeType ToSize(Local<Value> value) {
+    if ( ! value->IsNumber() ) {
+        return 0;
+    }
+    double number = Nan::To<double>(value).FromJust();
+    return number > 0 ? (MagickCore::MagickSizeType) number : 0;
+}
+
+// Reads the per request limits "maxMemory" and "maxPixels"
+void ParseLimits(Local<Object> obj, im_ctx_base *context) {
+    context->maxMemory = ToSize(GetOption( obj, MaxMemoryKey ));
+    context->maxPixels = ToSize(GetOption( obj, MaxPixelsKey ));
+}
+
+// Starts the deadline of "timeoutMs" from now, and makes the call cancellable by id when it isn't 0
+void StartControl(im_ctx_base *context, uint32_t id) {
+    if ( ! context->timeoutMs && ! id ) {
+        context->control.reset();
+        return;
+    }
+    context->control = std::make_shared<job_control>();
+    context->control->id = id;
+    if ( context->timeoutMs ) {
+        context->control->deadline = uv_hrtime() + (uint64_t) context->timeoutMs * 1000000;
+    }
+}
+
+// Reads "timeoutMs" and "jobId", calls with either stop once cancel(jobId) is called or timeoutMs passed since the call
+void ParseControl(Local<Object> obj, im_ctx_base *context) {
+    Local<Value> timeoutValue = GetOption( obj, TimeoutMsKey );
+    context->timeoutMs = timeoutValue->IsNumber() ? Nan::To<uint32_t>(timeoutValue).FromJust() : 0;
+
+    Local<Value> jobIdValue = GetOption( obj, JobIdKey );
+    StartControl(context, jobIdValue->IsNumber() ? Nan::To<uint32_t>(jobIdValue).FromJust() : 0);
+}
+
+// Pinging the header to learn the decoded size is only worth it when something limits it
+bool NeedsAdmission(im_ctx_base *context) {
+    return context->maxMemory || context->maxPixels || budget.Limit();
+}
+
+// Checks a decoded size against the request's limits and reserves its pixel cache in the memory budget
+bool AdmitSize(size_t columns, size_t rows, MemoryReservation *reservation, im_ctx_base *context) {
+    MagickCore::MagickSizeType pixels = (MagickCore::MagickSizeType) columns * rows;
+    MagickCore::MagickSizeType bytes  = pixels * sizeof(Magick::PixelPacket);
+    if (context->debug) printf( "estimated pixel cache: %llu bytes\n", (unsigned long long) bytes );
+
+    if ( context->maxPixels && pixels > context->maxPixels ) {
+        context->error = std::string("image exceeds maxPixels");
+        return false;
+    }
+    if ( context->maxMemory && bytes > context->maxMemory ) {
+        context->error = std::string("image exceeds maxMemory");
+        return false;
+    }
+    // sync calls run on the loop thread and must not block it
+    std::string error = reservation->Reserve(bytes, context->callback != NULL, context->control.get());
+    if ( ! error.empty() ) {
+        context->error = error;
+        return false;
+    }
+    return true;
+}
+
+// Learns the decoded size of blob from its header, checks it against the request's limits
+// and reserves its pixel cache in the process wide memory budget.
+// header carries the read options (format, size hints); ping errors are left for the actual read to report.
+bool AdmitImage(Magick::Image *header, const Magick::Blob &blob, MemoryReservation *reservation, im_ctx_base *context) {
+    try {
+        header->ping( blob );
+    }
+    catch (Magick::Warning& warning) {
+        // the header was read
+    }
+    catch (std::exception& err) {
+        return true;
+    }
+    catch (...) {
+        return true;
+    }
+
+    return AdmitSize(header->columns(), header->rows(), reservation, context);
+}
+
+// Extra context for identify
+struct identify_im_ctx : im_ctx_base {
+    bool ping;
+
+    // read from the image by the worker, so the decoded pixels are freed before the result is built
+    unsigned int width;
+    unsigned int height;
+    unsigned int depth;
+    std::string format;
+    std::string colorspace;
+    unsigned int densityWidth;
+    unsigned int densityHeight;
+    int orientation;
+
+    identify_im_ctx() : width(0), height(0), depth(0), densityWidth(0), densityHeight(0), orientation(0) {
+        operation = IdentifyOperation;
+    }
+
+    // the result is cached as a single line of text
+    virtual void CacheResult(std::vector<Magick::Blob> *blobs) {
+        char line[ 256 ];
+        int length = snprintf(line, sizeof(line), "%u %u %u %.63s %.63s %u %u %d",
+            width, height, depth, format.c_str(), colorspace.c_str(), densityWidth, densityHeight, orientation);
+        blobs->push_back(Magick::Blob(line, length));
+    }
+    virtual void CacheRestore(const std::vector<Magick::Blob> &blobs) {
+        if ( blobs.empty() ) {
+            return;
+        }
+        std::string line((const char *) blobs[ 0 ].data(), blobs[ 0 ].length());
+        char formatValue[ 64 ] = "";
+        char colorspaceValue[ 64 ] = "";
+        sscanf(line.c_str(), "%u %u %u %63s %63s %u %u %d",
+            &width, &height, &depth, formatValue, colorspaceValue, &densityWidth, &densityHeight, &orientation);
+        format     = formatValue;
+        colorspace = colorspaceValue;
+    }
+};
+// Settings of one rendition produced by convert
+struct convert_output {
+    unsigned int width;
+    unsigned int height;
+    unsigned int xoffset;
+    unsigned int yoffset;
+    bool autoOrient;
+    std::string resizeStyle;
+    std::string gravity;
+    std::string format;
+    std::string filter;
+    bool hasBlur;
+    double blur;
+    Magick::ColorspaceType colorspace;
+    unsigned int quality;
+    int rotate;
+    int density;
+    int flip;
+
+    // resolved from the options above by ResolveConvertOutput()
+    ssize_t filterType;
+    const char* error;
+
+    convert_output()
+      : width(0),
+        height(0),
+        xoffset(0),
+        yoffset(0),
+        autoOrient(false),
+        resizeStyle("aspectfill"),
+        gravity("Center"),
+        hasBlur(false),
+        blur(0),
+        colorspace(Magick::UndefinedColorspace),
+        quality(0),
+        rotate(0),
+        density(0),
+        flip(0),
+        filterType(-1),
+        error(NULL) {
+    }
+};
+// Part of the source read by ReadRegion, an empty one reads the whole source
+struct source_region {
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+
+    source_region() : x(0), y(0), width(0), height(0) {}
+    source_region(size_t x, size_t y, size_t width, size_t height) : x(x), y(y), width(width), height(height) {}
+};
+
+// Extra context for convert
+struct convert_im_ctx : im_ctx_base {
+    // applied once to the decoded image, before any rendition
+    bool strip;
+    bool trim;
+    bool shrinkOnLoad;
+    double trimFuzz;
+    std::string background;
+    // keep every frame of animated sources
+    bool animated;
+    // pages of a multi-page source (PDF, TIFF, ...) converted one job each, in this order
+    std::vector<unsigned int> pages;
+    // set on the job of one page: the only page decoded, -1 reads the first image
+    ssize_t page;
+    // dpi vector pages are rasterized at, the "density" option of a call with "pages"
+    int pageDensity;
+    // set by "srcRegion": only this part of the source is decoded
+    source_region region;
+
+    // one entry per rendition, a single one unless the "outputs" option was used
+    std::vector<convert_output> outputs;
+
+    // set by streaming convert: the source is read from srcFile and the rendition written to dstFile
+    FILE* srcFile;
+    FILE* dstFile;
+
+    // set by "fingerprint": the perceptual hash of the decoded image and the digest of srcData come back with the result
+    bool fingerprint;
+    std::string hash;
+    std::string digest;
+
+    convert_im_ctx() : animated(false), page(-1), pageDensity(0), srcFile(NULL), dstFile(NULL), fingerprint(false) {}
+
+    // the fingerprint is cached after the blobs, as a single line of text
+    virtual void CacheResult(std::vector<Magick::Blob> *blobs) {
+        im_ctx_base::CacheResult(blobs);
+        if ( fingerprint ) {
+            std::string line = hash + " " + digest;
+            blobs->push_back(Magick::Blob(line.data(), line.size()));
+        }
+    }
+    virtual void CacheRestore(const std::vector<Magick::Blob> &blobs) {
+        if ( ! fingerprint || blobs.empty() ) {
+            im_ctx_base::CacheRestore(blobs);
+            return;
+        }
+        im_ctx_base::CacheRestore(std::vector<Magick::Blob>(blobs.begin(), blobs.end() - 1));
+        std::string line((const char *) blobs.back().data(), blobs.back().length());
+        size_t space = line.find(' ');
+        hash   = line.substr(0, space);
+        digest = space == std::string::npos ? "" : line.substr(space + 1);
+    }
+
+    // { data: result, fingerprint: { hash, digest } }
+    virtual Local<Value> WrapResult(Local<Value> blobs);
+};
+class Overlay;
+// One image stamped onto the source by composite
+struct composite_layer {
+    std::shared_ptr<Overlay> overlay;
+    Magick::GravityType gravity;
+    // offset from the edges the gravity points to, like -geometry +x+y
+    ssize_t x;
+    ssize_t y;
+    double opacity;
+    Magick::CompositeOperator compose;
+
+    composite_layer() : gravity(Magick::ForgetGravity), x(0), y(0), opacity(1), compose(Magick::OverCompositeOp) {}
+};
+// Extra context for composite
+struct composite_im_ctx : im_ctx_base {
+    // stamped in order, the first one right onto the source
+    std::vector<composite_layer> layers;
+
+    composite_im_ctx() {
+        operation = CompositeOperation;
+    }
+};
+
+#ifdef IMAGEMAGICK_NATIVE_STREAMS
+// Input of a streaming convert. Chunks written on the loop thread are read by the worker through a FILE*,
+// so the decoder starts while the upload is still arriving.
+// Chunks are dropped once read, except for a small window stdio seeks back into.
+class StreamSource
+{
+public:
+    StreamSource() : start(0), position(0), received(0), ended(false), aborted(false), control(NULL),
+        full(false), drained(false), collecting(false), drainReq(NULL), drainCallback(NULL) {}
+
+    // Bytes waiting to be read above which write() asks the writer to wait for the drain notification,
+    // so a slow decoder doesn't hold the whole upload. Above the header peeked for admission.
+    static const int64_t HighWaterMark = 256 * 1024;
+
+    // worker. cb is notified on the loop thread once a full source has been drained below half its high-water mark
+    void NotifyDrain(uv_work_t *req, void (*cb)(uv_work_t*)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        drainReq      = req;
+        drainCallback = cb;
+    }
+    // loop thread. whether the source was drained since the last call
+    bool TakeDrained() {
+        std::lock_guard<std::mutex> lock(mutex);
+        bool was = drained;
+        drained  = false;
+        return was;
+    }
+
+    // worker. waits for input give up once control's call is cancelled or times out
+    void Watch(job_control *watched) {
+        std::lock_guard<std::mutex> lock(mutex);
+        control = watched;
+    }
+
+    // loop thread. false once HighWaterMark bytes wait to be read, the writer should wait for the drain notification
+    bool Write(const char *data, size_t length) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if ( ended || aborted || ! length ) {
+            return true;
+        }
+        chunks.push_back(std::string(data, length));
+        received += length;
+        cond.notify_all();
+        if ( ! collecting && received - position >= HighWaterMark ) {
+            full = true;
+            return false;
+        }
+        return true;
+    }
+    // loop thread. abort makes the reader fail instead of seeing the end of the image
+    void End(bool abort) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ended = true;
+        if ( abort ) {
+            aborted = true;
+            chunks.clear();
+        }
+        cond.notify_all();
+    }
+
+    // Waits for the first length bytes (or the end of input) and returns them without consuming them
+    std::string Peek(size_t length) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while ( received < (int64_t) length && ! ended ) {
+            if ( ! Wait(lock) ) {
+                break;
+            }
+        }
+        std::string head;
+        for (size_t i = 0; i < chunks.size() && head.size() < length; i++) {
+            head.append(chunks[ i ], 0, length - head.size());
+        }
+        return head;
+    }
+
+    // Waits for the end of input and returns all of it, for sources that can't be decoded from the stream.
+    // Must be called before anything is read. Returns false when aborted.
+    bool ReadAll(std::string *data) {
+        std::unique_lock<std::mutex> lock(mutex);
+        // all of it has to be held anyway
+        collecting = true;
+        if ( full ) {
+            Drained(lock);
+        }
+        while ( ! ended ) {
+            if ( ! Wait(lock) ) {
+                return false;
+            }
+        }
+        if ( aborted ) {
+            return false;
+        }
+        data->reserve(received);
+        for (size_t i = 0; i < chunks.size(); i++) {
+            data->append(chunks[ i ]);
+        }
+        chunks.clear();
+        start = position = received;
+        return true;
+    }
+
+    FILE* Open() {
+#if defined(__GLIBC__)
+        cookie_io_functions_t functions = { ReadCookie, NULL, SeekCookie, NULL };
+        return fopencookie(this, "r", functions);
+#else
+        return funopen(this, ReadCookie, NULL, SeekCookie, NULL);
+#endif
+    }
+
+private:
+    static const int64_t SeekWindow = 64 * 1024;
+
+    // Waits for more input. A stalled upload must not hold a worker of the pool past its call's
+    // deadline or cancel(), so a watched wait wakes up to check them and marks the job interrupted.
+    bool Wait(std::unique_lock<std::mutex> &lock) {
+        if ( ! control ) {
+            cond.wait(lock);
+            return true;
+        }
+        cond.wait_for(lock, std::chrono::milliseconds(20));
+        if ( control->Stopped() ) {
+            control->interrupted = true;
+            return false;
+        }
+        return true;
+    }
+
+    // Blocks until data arrives. Returns 0 at the end of input, -1 when aborted.
+    ssize_t Read(char *data, size_t length) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while ( position >= received && ! ended ) {
+            if ( ! Wait(lock) ) {
+                return -1;
+            }
+        }
+        if ( aborted ) {
+            return -1;
+        }
+        size_t copied = 0;
+        int64_t offset = start;
+        for (size_t i = 0; i < chunks.size() && copied < length; i++) {
+            int64_t end = offset + chunks[ i ].size();
+            if ( position < end ) {
+                size_t from  = position - offset;
+                size_t count = std::min(length - copied, (size_t) (end - position));
+                memcpy(data + copied, chunks[ i ].data() + from, count);
+                copied   += count;
+                position += count;
+            }
+            offset = end;
+        }
+        while ( ! chunks.empty() && start + (int64_t) chunks.front().size() + SeekWindow <= position ) {
+            start += chunks.front().size();
+            chunks.pop_front();
+        }
+        if ( full && received - position < HighWaterMark / 2 ) {
+            Drained(lock);
+        }
+        return copied;
+    }
+
+    // Tells the loop thread the writer may go on, lock is held again when it returns
+    void Drained(std::unique_lock<std::mutex> &lock) {
+        full    = false;
+        drained = true;
+        uv_work_t *req = drainReq;
+        void (*cb)(uv_work_t*) = drainCallback;
+        lock.unlock();
+        if ( req ) {
+            pool.Notify(req, cb);
+        }
+        lock.lock();
+    }
+
+    bool Seek(int64_t *offset, int whence) {
+        std::unique_lock<std::mutex> lock(mutex);
+        int64_t target = *offset;
+        if ( whence == SEEK_CUR ) {
+            target += position;
+        }
+        else if ( whence == SEEK_END ) {
+            while ( ! ended ) {
+                if ( ! Wait(lock) ) {
+                    return false;
+                }
+            }
+            target += received;
+        }
+        while ( target > received && ! ended ) {
+            if ( ! Wait(lock) ) {
+                return false;
+            }
+        }
+        if ( aborted || target < start || target > received ) {
+            return false;
+        }
+        position = target;
+        *offset  = target;
+        return true;
+    }
+
+#if defined(__GLIBC__)
+    static ssize_t ReadCookie(void *cookie, char *data, size_t length) {
+        return static_cast<StreamSource*>(cookie)->Read(data, length);
+    }
+    static int SeekCookie(void *cookie, off64_t *offset, int whence) {
+        int64_t target = *offset;
+        if ( ! static_cast<StreamSource*>(cookie)->Seek(&target, whence) ) {
+            return -1;
+        }
+        *offset = target;
+        return 0;
+    }
+#else
+    static int ReadCookie(void *cookie, char *data, int length) {
+        return static_cast<StreamSource*>(cookie)->Read(data, length);
+    }
+    static fpos_t SeekCookie(void *cookie, fpos_t offset, int whence) {
+        int64_t target = offset;
+        if ( ! static_cast<StreamSource*>(cookie)->Seek(&target, whence) ) {
+            return -1;
+        }
+        return target;
+    }
+#endif
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    // chunks.front() starts at offset start of the input
+    std::deque<std::string> chunks;
+    int64_t start;
+    int64_t position;
+    int64_t received;
+    bool ended;
+    bool aborted;
+    job_control *control;
+    // backpressure: write() returned false, the loop thread has yet to be told, no limit while collecting
+    bool full;
+    bool drained;
+    bool collecting;
+    uv_work_t *drainReq;
+    void (*drainCallback)(uv_work_t*);
+};
+
+// Output of a streaming convert. The encoder writes through a FILE*,
+// full chunks are handed to the loop thread as they are produced.
+class StreamSink
+{
+public:
+    StreamSink() : req(NULL), callback(NULL), control(NULL), paused(false), stopped(false) {}
+
+    // cb is notified on the loop thread whenever chunks are ready to be taken
+    FILE* Open(uv_work_t *notifyReq, void (*cb)(uv_work_t*)) {
+        req      = notifyReq;
+        callback = cb;
+#if defined(__GLIBC__)
+        cookie_io_functions_t functions = { NULL, WriteCookie, NULL, CloseCookie };
+        return fopencookie(this, "w", functions);
+#else
+        return funopen(this, NULL, WriteCookie, NULL, CloseCookie);
+#endif
+    }
+
+    // worker. a paused encoder gives up once control's call is cancelled or times out
+    void Watch(job_control *watched) {
+        std::lock_guard<std::mutex> lock(mutex);
+        control = watched;
+    }
+
+    // loop thread
+    std::deque<std::string> Take() {
+        std::deque<std::string> ready;
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.swap(chunks);
+        cond.notify_all();
+        return ready;
+    }
+
+    // loop thread. the reader is behind, the encoder waits after its next chunk until Resume()
+    void Pause() {
+        std::lock_guard<std::mutex> lock(mutex);
+        paused = true;
+    }
+    void Resume() {
+        std::lock_guard<std::mutex> lock(mutex);
+        paused = false;
+        cond.notify_all();
+    }
+    // loop thread. nobody reads the output anymore, the encoder never waits again
+    void Stop() {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+        cond.notify_all();
+    }
+
+private:
+    static const size_t ChunkSize = 64 * 1024;
+    // chunks the loop thread hasn't taken yet after which the encoder waits for it
+    static const size_t QueuedChunks = 4;
+
+    // false when the encoder has to stop, its call was cancelled or timed out while paused
+    bool Write(const char *data, size_t length, bool last) {
+        chunk.append(data, length);
+        if ( chunk.empty() || ( chunk.size() < ChunkSize && ! last ) ) {
+            return true;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            chunks.push_back(std::string());
+            chunks.back().swap(chunk);
+        }
+        pool.Notify(req, callback);
+        if ( last ) {
+            return true;
+        }
+
+        // a slow reader or a busy loop thread holds at most a few chunks
+        std::unique_lock<std::mutex> lock(mutex);
+        while ( ( paused || chunks.size() >= QueuedChunks ) && ! stopped ) {
+            if ( ! control ) {
+                cond.wait(lock);
+                continue;
+            }
+            cond.wait_for(lock, std::chrono::milliseconds(20));
+            if ( control->Stopped() ) {
+                control->interrupted = true;
+                return false;
+            }
+        }
+        return true;
+    }
+
+#if defined(__GLIBC__)
+    static ssize_t WriteCookie(void *cookie, const char *data, size_t length) {
+        return static_cast<StreamSink*>(cookie)->Write(data, length, false) ? length : 0;
+    }
+#else
+    static int WriteCookie(void *cookie, const char *data, int length) {
+        return static_cast<StreamSink*>(cookie)->Write(data, length, false) ? length : -1;
+    }
+#endif
+    static int CloseCookie(void *cookie) {
+        static_cast<StreamSink*>(cookie)->Write(NULL, 0, true);
+        return 0;
+    }
+
+    uv_work_t *req;
+    void (*callback)(uv_work_t*);
+
+    // worker only
+    std::string chunk;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::string> chunks;
+    job_control *control;
+    bool paused;
+    bool stopped;
+};
+
+// Extra context for streaming convert
+struct convert_stream_im_ctx : convert_im_ctx {
+    // shared with the StreamInput object JS writes to, which may outlive the job
+    std::shared_ptr<StreamSource> source;
+    std::shared_ptr<StreamSink> sink;
+    Nan::Callback* onData;
+    // optional, called once a source that write() reported full has been drained
+    Nan::Callback* onDrain;
+    // the whole input, for formats that aren't decoded from the stream
+    std::string buffered;
+
+    convert_stream_im_ctx() : onData(NULL), onDrain(NULL) {
+        operation = ConvertStreamOperation;
+    }
+};
+#endif  // IMAGEMAGICK_NATIVE_STREAMS
+
+
+inline Local<Value> WrapPointer(char *ptr, size_t length) {
+    Nan::EscapableHandleScope scope;
+    return scope.Escape(Nan::CopyBuffer(ptr, length).ToLocalChecked());
+}
+inline Local<Value> WrapPointer(char *ptr) {
+    return WrapPointer(ptr, 0);
+}
+
+// Buffers below take ownership of the encoded bytes instead of copying them,
+// so large outputs cost no memcpy on the loop thread and no second copy in memory.
+void FreeBlob(char *data, void *hint) {
+    delete static_cast<Magick::Blob*>(hint);
+}
+void FreeString(char *data, void *hint) {
+    delete static_cast<std::string*>(hint);
+}
+
+// Buffer sharing blob's data, which is reference counted and kept alive until the Buffer is collected
+Local<Value> WrapBlob(const Magick::Blob &blob) {
+    Nan::EscapableHandleScope scope;
+    if ( ! blob.length() ) {
+        return scope.Escape(WrapPointer(NULL, 0));
+    }
+    Magick::Blob *owned = new Magick::Blob(blob);
+    return scope.Escape(Nan::NewBuffer((char *)owned->data(), owned->length(), FreeBlob, owned).ToLocalChecked());
+}
+
+// Buffer taking over the contents of data, which is left empty
+Local<Value> WrapString(std::string *data) {
+    Nan::EscapableHandleScope scope;
+    if ( data->empty() ) {
+        return scope.Escape(WrapPointer(NULL, 0));
+    }
+    std::string *owned = new std::string();
+    owned->swap(*data);
+    return scope.Escape(Nan::NewBuffer((char *)owned->data(), owned->size(), FreeString, owned).ToLocalChecked());
+}
+
+
+// Buffer of the generated blob, or an Array of Buffers when several outputs were requested
+Local<Value> WrapBlobs(im_ctx_base *context) {
+    Nan::EscapableHandleScope scope;
+    if ( ! context->dstPath.empty() ) {
+        // written to the file already
+        return scope.Escape(context->WrapResult(Nan::Undefined()));
+    }
+    if ( ! context->multiOutput ) {
+        return scope.Escape(context->WrapResult(WrapBlob(context->dstBlob)));
+    }
+    Local<Array> out = Nan::New<Array>(context->dstBlobs.size());
+    for (size_t i = 0; i < context->dstBlobs.size(); i++) {
+        Nan::Set(out, i, WrapBlob(context->dstBlobs[i]));
+    }
+    return scope.Escape(context->WrapResult(out));
+}
+
+// { hash, digest } of a fingerprint, digest is left out when there was no srcData to hash
+Local<Object> WrapFingerprint(const std::string &hash, const std::string &digest) {
+    Nan::EscapableHandleScope scope;
+    Local<Object> out = Nan::New<Object>();
+    Nan::Set(out, Nan::New<String>("hash").ToLocalChecked(), Nan::New<String>(hash).ToLocalChecked());
+    if ( ! digest.empty() ) {
+        Nan::Set(out, Nan::New<String>("digest").ToLocalChecked(), Nan::New<String>(digest).ToLocalChecked());
+    }
+    return scope.Escape(out);
+}
+
+Local<Value> convert_im_ctx::WrapResult(Local<Value> blobs) {
+    if ( ! fingerprint ) {
+        return blobs;
+    }
+    Nan::EscapableHandleScope scope;
+    Local<Object> out = Nan::New<Object>();
+    Nan::Set(out, Nan::New<String>("data").ToLocalChecked(), blobs);
+    Nan::Set(out, Nan::New<String>("fingerprint").ToLocalChecked(), WrapFingerprint(hash, digest));
+    return scope.Escape(out);
+}
+
+
+#define RETURN_BLOB_OR_ERROR(req) \
+    do { \
+        im_ctx_base* _context = static_cast<im_ctx_base*>(req->data); \
+        ReportMetrics(_context); \
+        if (!_context->error.empty()) { \
+            Nan::ThrowError(_context->error.c_str()); \
+        } else { \
+            const Local<Value> _retBuffer = WrapBlobs(_context); \
+            info.GetReturnValue().Set(_retBuffer); \
+        } \
+        delete _context; \
+        delete req; \
+    } while(0);
+
+
+// Counts a decoded image in stats(): its pixels, and whether its pixel cache had to leave memory
+void CountDecoded(const Magick::Image &image, im_ctx_base *context) {
+    context->decodedPixels += (uint64_t) image.columns() * image.rows();
+    MagickCore::CacheType type = MagickCore::GetPixelCacheType(image.constImage());
+    if ( type == MagickCore::DiskCache || type == MagickCore::MapCache ) {
+        stats.CacheSpilled();
+    }
+}
+
+bool ReadImageMagick(Magick::Image *image, Magick::Blob srcBlob, std::string srcFormat, im_ctx_base *context) {
+    if ( context->control ) {
+        WatchImage(image, context->control.get());
+    }
+    if( ! srcFormat.empty() ){
+        if (context->debug) printf( "reading with format: %s\n", srcFormat.c_str() );
+        image->magick( srcFormat.c_str() );
+    }
+
+    try {
+        image->read( srcBlob );
+    }
+    catch (Magick::Warning& warning) {
+        if (!context->ignoreWarnings) {
+            context->error = warning.what();
+            return false;
+        }
+        stats.WarningIgnored();
+        if (context->debug) {
+            printf("warning: %s\n", warning.what());
+        }
+    }
+    catch (std::exception& err) {
+        context->error = err.what();
+        return false;
+    }
+    catch (...) {
+        context->error = std::string("unhandled error");
+        return false;
+    }
+    CountDecoded(*image, context);
+    return true;
+}
+
+// State of a region read through ImageMagick's pixel stream, reached from the stream handler as the image's client data
+struct region_stream {
+    source_region region;
+    // the first image of the source, the region is copied out of it row by row
+    const MagickCore::Image *source;
+    MagickCore::Image *image;
+    ssize_t y;
+    // set once the last row of the region was copied, the decoder is stopped there
+    bool complete;
+    // the coder wrote something else than whole rows
+    bool unsupported;
+    MagickCore::ExceptionInfo *exception;
+
+    region_stream() : source(NULL), image(NULL), y(0), complete(false), unsupported(false), exception(NULL) {}
+};
+
+// Stream handler of ReadRegion, called with every row the coder decodes.
+// Like ImageMagick's own stream command, it relies on the coder writing rows top down one at a time.
+size_t StreamRegionRow(const MagickCore::Image *source, const void *pixels, const size_t columns) {
+    region_stream *stream = static_cast<region_stream*>(source->client_data);
+    if ( stream->source == NULL ) {
+        stream->source = source;
+        stream->image = MagickCore::CloneImage(source, stream->region.width, stream->region.height, MagickCore::MagickTrue, stream->exception);
+        if ( stream->image == NULL ) {
+            return 0;
+        }
+    }
+    if ( source != stream->source || columns != source->columns ) {
+        stream->unsupported = true;
+        return 0;
+    }
+
+    ssize_t row = stream->y++ - (ssize_t) stream->region.y;
+    if ( row < 0 ) {
+        return columns;
+    }
+    MagickCore::PixelPacket *q = MagickCore::QueueAuthenticPixels(stream->image, 0, row, stream->region.width, 1, stream->exception);
+    if ( q == NULL ) {
+        return 0;
+    }
+    memcpy(q, static_cast<const MagickCore::PixelPacket*>(pixels) + stream->region.x, stream->region.width * sizeof(MagickCore::PixelPacket));
+    // black of CMYK and colormap indexes of PseudoClass images
+    const MagickCore::IndexPacket *indexes = MagickCore::GetVirtualIndexQueue(source);
+    MagickCore::IndexPacket *regionIndexes = MagickCore::GetAuthenticIndexQueue(stream->image);
+    if ( indexes && regionIndexes ) {
+        memcpy(regionIndexes, indexes + stream->region.x, stream->region.width * sizeof(MagickCore::IndexPacket));
+    }
+    if ( ! MagickCore::SyncAuthenticPixels(stream->image, stream->exception) ) {
+        return 0;
+    }
+
+    if ( row + 1 == (ssize_t) stream->region.height ) {
+        // the rows below the region are never decoded
+        stream->complete = true;
+        return 0;
+    }
+    return columns;
+}
+
+// Coders known to write rows top down one at a time, the way StreamRegionRow reads them.
+// Tiled TIFFs write whole tiles, only stripped ones qualify.
+bool StreamsRows(Magick::Image *header) {
+    std::string magick = header->magick();
+    if ( magick == "TIFF" ) {
+        return ! header->attribute("tiff:rows-per-strip").empty();
+    }
+    return magick == "JPEG" || magick == "PNM" || magick == "PPM" || magick == "PGM" || magick == "PBM" || magick == "PAM";
+}
+
+// Reads region of srcBlob into image. Sources whose coder streams rows (JPEG, stripped TIFF, PNM)
+// are decoded through a single row of pixels, only the region is kept and the rows below it aren't decoded at all,
+// so the memory budget and maxMemory/maxPixels count the region instead of the source.
+// Other sources are decoded whole and cropped.
+// image carries the read options (page, density). beyondError is reported when the region doesn't fit the source.
+bool ReadRegion(Magick::Image *image, const Magick::Blob &srcBlob, const source_region &region, const char *beyondError, MemoryReservation *reservation, im_ctx_base *context) {
+    if ( context->control ) {
+        WatchImage(image, context->control.get());
+    }
+    if ( ! context->srcFormat.empty() ) {
+        image->magick( context->srcFormat.c_str() );
+    }
+
+    Magick::Image header = *image;
+    try {
+        header.ping( srcBlob );
+    }
+    catch (Magick::Warning& warning) {
+        // the header was read
+    }
+    catch (std::exception& err) {
+        context->error = err.what();
+        return false;
+    }
+    catch (...) {
+        context->error = std::string("unhandled error");
+        return false;
+    }
+    if ( region.x + region.width > header.columns() || region.y + region.height > header.rows() ) {
+        context->error = std::string(beyondError);
+        return false;
+    }
+    bool whole = region.width == header.columns() && region.height == header.rows();
+
+    if ( ! whole && StreamsRows(&header) ) {
+        if (context->debug) printf( "streaming region: %dx%d+%d+%d\n", (int) region.width, (int) region.height, (int) region.x, (int) region.y );
+        if ( NeedsAdmission(context) && !AdmitSize(region.width, region.height, reservation, context) )
+            return false;
+
+        region_stream stream;
+        stream.region = region;
+        stream.exception = MagickCore::AcquireExceptionInfo();
+        MagickCore::ImageInfo *imageInfo = MagickCore::CloneImageInfo(image->imageInfo());
+        MagickCore::SetImageInfoBlob(imageInfo, srcBlob.data(), srcBlob.length());
+        snprintf(imageInfo->filename, MaxTextExtent, "%s:", header.magick().c_str());
+        imageInfo->number_scenes = 1;
+        imageInfo->client_data = &stream;
+        MagickCore::Image *source = MagickCore::ReadStream(imageInfo, StreamRegionRow, stream.exception);
+        if ( source ) {
+            MagickCore::DestroyImageList(source);
+        }
+        MagickCore::DestroyImageInfo(imageInfo);
+
+        if ( stream.complete ) {
+            // the decoder complains about being stopped early
+            MagickCore::DestroyExceptionInfo(stream.exception);
+            stream.image->page.width  = stream.image->columns;
+            stream.image->page.height = stream.image->rows;
+            stream.image->page.x = 0;
+            stream.image->page.y = 0;
+            image->replaceImage(stream.image);
+            CountDecoded(*image, context);
+            return true;
+        }
+        if ( stream.image ) {
+            MagickCore::DestroyImage(stream.image);
+        }
+        if ( ! stream.unsupported ) {
+            try {
+                Magick::throwException(stream.exception);
+                context->error = std::string("image.read failed: the region was not decoded");
+            }
+            catch (std::exception& err) {
+                context->error = err.what();
+            }
+            MagickCore::DestroyExceptionInfo(stream.exception);
+            return false;
+        }
+        MagickCore::DestroyExceptionInfo(stream.exception);
+        if (context->debug) printf( "coder doesn't stream rows, decoding the whole source\n" );
+    }
+
+    if ( NeedsAdmission(context) && !AdmitSize(header.columns(), header.rows(), reservation, context) )
+        return false;
+    if ( !ReadImageMagick(image, srcBlob, context->srcFormat, context) )
+        return false;
+    if ( ! whole ) {
+        image->crop(Magick::Geometry(region.width, region.height, region.x, region.y));
+        image->page(Magick::Geometry(0, 0, 0, 0));
+    }
+    return true;
+}
+
+// Overlay of composite layers, decoded once by registerOverlay() or by the first job stamping it.
+// Concurrent reads of one pixel cache aren't safe on the pool's threads,
+// so each job stamps a private copy, kept for reuse by later jobs.
+class Overlay
+{
+public:
+    // copy keeps the bytes of a registered overlay, inline layers read the caller's Buffer like srcData
+    Overlay(const char *data, size_t length, bool copy) : data(data), length(length), decoded(false) {
+        if ( copy ) {
+            owned.assign(data, length);
+            this->data = owned.data();
+        }
+    }
+
+    // loop thread, while the overlay's Buffer is alive
+    const std::string& Hash() {
+        if ( hash.empty() ) {
+            hash = Hash128(data, length);
+        }
+        return hash;
+    }
+
+    // Reserves the pixel cache of an overlay that is not decoded yet
+    bool Admit(MemoryReservation *reservation, im_ctx_base *context) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if ( decoded ) {
+                return true;
+            }
+        }
+        Magick::Image header;
+        return AdmitImage(&header, Magick::Blob(data, length), reservation, context);
+    }
+
+    bool Decode(im_ctx_base *context) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return DecodeLocked(context);
+    }
+
+    // Decodes the overlay unless it already was, then hands out a copy only the calling job reads
+    bool Acquire(Magick::Image *copy, im_ctx_base *context) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if ( ! DecodeLocked(context) ) {
+            return false;
+        }
+        if ( ! spares.empty() ) {
+            *copy = spares.back();
+            spares.pop_back();
+            return true;
+        }
+        try {
+            // cropping to the full size copies the pixels into a pixel cache of the copy's own
+            *copy = image;
+            copy->crop(Magick::Geometry(image.columns(), image.rows(), 0, 0));
+            copy->page(Magick::Geometry(0, 0, 0, 0));
+        }
+        catch (std::exception& err) {
+            context->error = err.what();
+            return false;
+        }
+        return true;
+    }
+
+    void Release(const Magick::Image &copy) {
+        std::lock_guard<std::mutex> lock(mutex);
+        spares.push_back(copy);
+    }
+
+private:
+    // called with the mutex held, the first failure is reported to every job
+    bool DecodeLocked(im_ctx_base *context) {
+        if ( decoded ) {
+            return true;
+        }
+        if ( ! error.empty() ) {
+            context->error = error;
+            return false;
+        }
+        if ( !ReadImageMagick(&image, Magick::Blob(data, length), "", context) ) {
+            // a decode stopped by the job's control may succeed for the next job
+            if ( ! context->control || ! context->control->interrupted ) {
+                error = context->error;
+            }
+            return false;
+        }
+        if ( context->control ) {
+            if ( context->control->interrupted ) {
+                context->error = context->control->Reason();
+                return false;
+            }
+            WatchImage(&image, NULL);
+        }
+        decoded = true;
+        return true;
+    }
+
+    std::string owned;
+    const char *data;
+    size_t length;
+    std::string hash;
+
+    std::mutex mutex;
+    bool decoded;
+    std::string error;
+    Magick::Image image;
+    std::vector<Magick::Image> spares;
+};
+
+// Overlays of registerOverlay() by id, per JS environment on its loop thread
+static thread_local std::unordered_map< std::string, std::shared_ptr<Overlay> > overlays;
+
+// Extra context for registerOverlay
+struct overlay_im_ctx : im_ctx_base {
+    std::string id;
+    std::shared_ptr<Overlay> overlay;
+
+    overlay_im_ctx() {
+        operation = RegisterOverlayOperation;
+    }
+};
+
+// Reads image from a stdio stream, the decoder pulls data from file as it needs it.
+// Without a srcFormat ImageMagick has to copy the stream to a temporary file to detect the format.
+bool ReadImageFile(Magick::Image *image, FILE *file, std::string srcFormat, im_ctx_base *context) {
+    MagickCore::ImageInfo *imageInfo = MagickCore::CloneImageInfo(image->imageInfo());
+    MagickCore::SetImageInfoFile(imageInfo, file);
+    if( ! srcFormat.empty() ){
+        if (context->debug) printf( "reading with format: %s\n", srcFormat.c_str() );
+        snprintf( imageInfo->filename, MaxTextExtent, "%s:", srcFormat.c_str() );
+    }
+
+    MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
+    MagickCore::Image *decoded = MagickCore::ReadImage(imageInfo, exception);
+    MagickCore::DestroyImageInfo(imageInfo);
+
+    bool ok = true;
+    if ( decoded == NULL || exception->severity >= MagickCore::ErrorException ) {
+        context->error = std::string("image.read failed with error: ") +
+            ( exception->reason ? exception->reason : "unable to read image" );
+        ok = false;
+    }
+    else if ( exception->severity != MagickCore::UndefinedException ) {
+        if (!context->ignoreWarnings) {
+            context->error = std::string( exception->reason ? exception->reason : "warning" );
+            ok = false;
+        } else {
+            stats.WarningIgnored();
+            if (context->debug) printf("warning: %s\n", exception->reason ? exception->reason : "");
+        }
+    }
+    MagickCore::DestroyExceptionInfo(exception);
+
+    if ( decoded != NULL ) {
+        // like Magick::Image::read, keep the first frame only.
+        // unlinked first, DestroyImageList frees the whole list it is part of
+        if ( decoded->next != NULL ) {
+            MagickCore::Image *next = decoded->next;
+            decoded->next  = NULL;
+            next->previous = NULL;
+            MagickCore::DestroyImageList(next);
+        }
+        image->replaceImage(decoded);
+        CountDecoded(*image, context);
+    }
+    return ok;
+}
+
+// Encodes image to a stdio stream in the format set with image->magick()
+void WriteImageFile(Magick::Image *image, FILE *file) {
+    image->modifyImage();
+    MagickCore::Image *img = image->image();
+    snprintf( img->filename, MaxTextExtent, "%s:", image->magick().c_str() );
+
+    MagickCore::ImageInfo *imageInfo = MagickCore::CloneImageInfo(image->imageInfo());
+    MagickCore::SetImageInfoFile(imageInfo, file);
+    MagickCore::WriteImage(imageInfo, img);
+    MagickCore::DestroyImageInfo(imageInfo);
+
+    if ( img->exception.severity >= MagickCore::ErrorException ) {
+        throw std::runtime_error( img->exception.reason ? img->exception.reason : "unable to write image" );
+    }
+}
+
+// Lets the JPEG decoder downscale by DCT scaling (1/2, 1/4, 1/8) while reading.
+// libjpeg picks the largest scale that keeps both sides >= the hint,
+// and we ask for twice the requested size so the resize filter still has pixels to work with.
+void SetDecodeSizeHint(Magick::Image *image, unsigned int width, unsigned int height, int debug) {
+    char geometryString[ 32 ];
+    snprintf( geometryString, sizeof geometryString, "%ux%u", width * 2, height * 2 );
+    if (debug) printf( "jpeg:size: %s\n", geometryString );
+    image->defineValue( "jpeg", "size", geometryString );
+}
+
+// Decode size hints are safe only when every rendition is resized from the whole source image,
+// the hint covers the largest one
+bool DecodeSizeHint(convert_im_ctx *context, unsigned int *width, unsigned int *height) {
+    if ( ! context->shrinkOnLoad || context->trim ) {
+        return false;
+    }
+    *width  = 0;
+    *height = 0;
+    for (size_t i = 0; i < context->outputs.size(); i++) {
+        const convert_output& output = context->outputs[i];
+        if ( ! output.width || ! output.height ) {
+            return false;
+        }
+        const std::string& resizeStyle = output.resizeStyle;
+        if ( resizeStyle != "aspectfill" && resizeStyle != "aspectfit" && resizeStyle != "fill" ) {
+            return false;
+        }
+        if ( output.width  > *width  ) { *width  = output.width;  }
+        if ( output.height > *height ) { *height = output.height; }
+    }
+    return true;
+}
+
+// One of the eight ways to turn and mirror an image: mirrored left to right when mirror is set, then turned clockwise.
+// autoOrient, rotate and flip compose into one of them, so the pixels are moved in a single pass.
+struct dihedral {
+    int quarterTurns;
+    bool mirror;
+
+    dihedral(int quarterTurns = 0, bool mirror = false) : quarterTurns(( quarterTurns % 4 + 4 ) % 4), mirror(mirror) {}
+
+    // this transform applied to the result of first
+    dihedral After(const dihedral &first) const {
+        if ( ! mirror ) {
+            return dihedral(quarterTurns + first.quarterTurns, first.mirror);
+        }
+        // mirroring turns the other way the turns first made
+        return dihedral(quarterTurns - first.quarterTurns, ! first.mirror);
+    }
+};
+
+// The transform that makes an image upright, from its EXIF orientation
+dihedral OrientationTransform(Magick::OrientationType orientation) {
+    switch (orientation) {
+        case Magick::OrientationType::TopRightOrientation:    return dihedral(0, true);   // flop
+        case Magick::OrientationType::BottomRightOrientation: return dihedral(2, false);
+        case Magick::OrientationType::BottomLeftOrientation:  return dihedral(2, true);   // flip
+        case Magick::OrientationType::LeftTopOrientation:     return dihedral(3, true);   // transpose
+        case Magick::OrientationType::RightTopOrientation:    return dihedral(1, false);
+        case Magick::OrientationType::RightBottomOrientation: return dihedral(1, true);   // transverse
+        case Magick::OrientationType::LeftBottomOrientation:  return dihedral(3, false);
+        default:                                              return dihedral();          // no orientation info, or upright
+    }
+}
+
+// Moves the pixels once, each transform is a single ImageMagick operation
+void ApplyDihedral(Magick::Image *image, const dihedral &transform) {
+    if ( ! transform.mirror ) {
+        if ( transform.quarterTurns ) {
+            image->rotate( 90 * transform.quarterTurns );
+        }
+        return;
+    }
+    switch ( transform.quarterTurns ) {
+        case 0: image->flop(); break;
+        case 1: image->transverse(); break;
+        case 2: image->flip(); break;
+        case 3: image->transpose(); break;
+    }
+}
+
+// Applies autoOrient, rotate and flip of a rendition, in this order, as one transform.
+// A rotate that isn't a multiple of 90 can't be composed, the orientation is applied before it and the flip after.
+// Returns false when the rendition asked for none of them.
+bool OrientRendition(Magick::Image *image, const convert_output *output, int debug) {
+    if ( ! output->autoOrient && ! output->rotate && ! output->flip ) {
+        return false;
+    }
+    dihedral transform;
+    if ( output->autoOrient ) {
+        transform = OrientationTransform(image->orientation());
+    }
+    if ( output->rotate % 90 == 0 ) {
+        transform = dihedral(output->rotate / 90).After(transform);
+    }
+    else {
+        ApplyDihedral(image, transform);
+        if (debug) printf( "rotate: %d\n", output->rotate );
+        image->rotate( output->rotate );
+        transform = dihedral();
+    }
+    if ( output->flip ) {
+        transform = dihedral(2, true).After(transform);
+    }
+    if (debug) printf( "orient: %d quarter turns%s\n", transform.quarterTurns, transform.mirror ? ", mirrored" : "" );
+    ApplyDihedral(image, transform);
+
+    if ( output->autoOrient ) {
+        // Erase orientation metadata after rotating the image to avoid double-rotation
+        image->orientation(Magick::OrientationType::UndefinedOrientation);
+    }
+    return true;
+}
+
+// Applies the operations of one rendition to the decoded (and shared pre-processed) source image or frame
+bool TransformRendition(Magick::Image *image, const convert_output *output, convert_im_ctx *context) {
+
+    int debug = context->debug;
+
+    unsigned int width = output->width;
+    if (debug) printf( "width: %d\n", width );
+
+    unsigned int height = output->height;
+    if (debug) printf( "height: %d\n", height );
+
+    const char* resizeStyle = output->resizeStyle.c_str();
+    if (debug) printf( "resizeStyle: %s\n", resizeStyle );
+
+    // gravity and filter were validated while parsing the options
+    if ( output->error ) {
+        context->error = std::string(output->error);
+        return false;
+    }
+    const char* gravity = output->gravity.c_str();
+    if (debug) printf( "gravity: %s\n", gravity );
+
+    if ( output->filterType != -1 ) {
+        if (debug) printf( "filter: %s\n", output->filter.c_str() );
+        image->filterType( (Magick::FilterTypes)output->filterType );
+    }
+
+    if ( output->hasBlur ) {
+        if (debug) printf( "blur: %.1f\n", output->blur );
+        image->blur(0, output->blur);
+        context->Time("blur");
+    }
+
+    if ( width || height ) {
+        if ( ! width  ) { width  = image->columns(); }
+        if ( ! height ) { height = image->rows();    }
+
+        // do resize
+        if ( strcmp( resizeStyle, "aspectfill" ) == 0 ) {
+            // ^ : Fill Area Flag ('^' flag)
+            // is not implemented in Magick++
+            // and gravity: center, extent doesnt look like working as exptected
+            // so we do it ourselves
+
+            // keep aspect ratio, get the exact provided size, crop top/bottom or left/right if necessary
+            double aspectratioExpected = (double)height / (double)width;
+            double aspectratioOriginal = (double)image->rows() / (double)image->columns();
+            unsigned int xoffset = 0;
+            unsigned int yoffset = 0;
+            unsigned int resizewidth;
+            unsigned int resizeheight;
+
+            if ( aspectratioExpected > aspectratioOriginal ) {
+                // expected is taller
+                resizewidth  = (unsigned int)( (double)height / (double)image->rows() * (double)image->columns() + 1. );
                 resizeheight = height;
                 if ( strstr(gravity, "West") != NULL ) {
                     xoffset = 0;
@@ -343,204 +2992,2813 @@ void DoConvert(uv_work_t* req) {
                 else {
                     xoffset = (unsigned int)( (resizewidth - width) / 2. );
                 }
-                yoffset = 0;
+                yoffset = 0;
+            }
+            else {
+                // expected is wider
+                resizewidth  = width;
+                resizeheight = (unsigned int)( (double)width / (double)image->columns() * (double)image->rows() + 1. );
+                xoffset = 0;
+                if ( strstr(gravity, "North") != NULL ) {
+                    yoffset = 0;
+                }
+                else if ( strstr(gravity, "South") != NULL ) {
+                    yoffset = (unsigned int)( resizeheight - height );
+                }
+                else {
+                    yoffset = (unsigned int)( (resizeheight - height) / 2. );
+                }
+            }
+
+            if (debug) printf( "resize to: %d, %d\n", resizewidth, resizeheight );
+            Magick::Geometry resizeGeometry( resizewidth, resizeheight, 0, 0, 0, 0 );
+            try {
+                image->zoom( resizeGeometry );
+            }
+            catch (std::exception& err) {
+                std::string message = "image.resize failed with error: ";
+                message            += err.what();
+                context->error = message;
+                return false;
+            }
+            catch (...) {
+                context->error = std::string("unhandled error");
+                return false;
+            }
+            context->Time("zoom");
+
+            if ( strcmp ( gravity, "None" ) != 0 ) {
+                // limit canvas size to cropGeometry
+                if (debug) printf( "crop to: %d, %d, %d, %d\n", width, height, xoffset, yoffset );
+                Magick::Geometry cropGeometry( width, height, xoffset, yoffset, 0, 0 );
+
+                Magick::Color transparent( "transparent" );
+                if ( strcmp( output->format.c_str(), "PNG" ) == 0 ) {
+                    // make background transparent for PNG
+                    // JPEG background becomes black if set transparent here
+                    transparent.alpha( 1. );
+                }
+
+                #if MagickLibVersion > 0x654
+                    image->extent( cropGeometry, transparent );
+                #else
+                    image->extent( cropGeometry );
+                #endif
+                context->Time("extent");
+            }
+
+        }
+        else if ( strcmp ( resizeStyle, "aspectfit" ) == 0 ) {
+            // keep aspect ratio, get the maximum image which fits inside specified size
+            char geometryString[ 32 ];
+            sprintf( geometryString, "%dx%d", width, height );
+            if (debug) printf( "resize to: %s\n", geometryString );
+
+            try {
+                image->zoom( geometryString );
+            }
+            catch (std::exception& err) {
+                std::string message = "image.resize failed with error: ";
+                message            += err.what();
+                context->error = message;
+                return false;
+            }
+            catch (...) {
+                context->error = std::string("unhandled error");
+                return false;
+            }
+            context->Time("zoom");
+        }
+        else if ( strcmp ( resizeStyle, "fill" ) == 0 ) {
+            // change aspect ratio and fill specified size
+            char geometryString[ 32 ];
+            sprintf( geometryString, "%dx%d!", width, height );
+            if (debug) printf( "resize to: %s\n", geometryString );
+
+            try {
+                image->zoom( geometryString );
+            }
+            catch (std::exception& err) {
+                std::string message = "image.resize failed with error: ";
+                message            += err.what();
+                context->error = message;
+                return false;
+            }
+            catch (...) {
+                context->error = std::string("unhandled error");
+                return false;
+            }
+            context->Time("zoom");
+        }
+         else if ( strcmp ( resizeStyle, "crop" ) == 0 ) {
+             unsigned int xoffset = output->xoffset;
+             unsigned int yoffset = output->yoffset;
+
+             if ( ! xoffset ) { xoffset = 0; }
+             if ( ! yoffset ) { yoffset = 0; }
+
+             // limit canvas size to cropGeometry
+             if (debug) printf( "crop to: %d, %d, %d, %d\n", width, height, xoffset, yoffset );
+             Magick::Geometry cropGeometry( width, height, xoffset, yoffset, 0, 0 );
+
+             Magick::Color transparent( "transparent" );
+             if ( strcmp( output->format.c_str(), "PNG" ) == 0 ) {
+                 // make background transparent for PNG
+                 // JPEG background becomes black if set transparent here
+                 transparent.alpha( 1. );
+             }
+
+             #if MagickLibVersion > 0x654
+                 image->extent( cropGeometry, transparent );
+             #else
+                 image->extent( cropGeometry );
+             #endif
+             context->Time("extent");
+
+         }
+        else {
+            context->error = std::string("resizeStyle not supported");
+            return false;
+        }
+        if (debug) printf( "resized to: %d, %d\n", (int)image->columns(), (int)image->rows() );
+    }
+
+    // set after resizing, so the shared source image is not copied just to change its format
+    if( ! output->format.empty() ){
+        if (debug) printf( "format: %s\n", output->format.c_str() );
+        image->magick( output->format.c_str() );
+    }
+
+    if ( output->quality ) {
+        if (debug) printf( "quality: %d\n", output->quality );
+        image->quality( output->quality );
+    }
+
+    if ( OrientRendition(image, output, debug) ) {
+        context->Time("orient");
+    }
+
+    if (output->density) {
+        image->density(Magick::Geometry(output->density, output->density));
+    }
+
+    if( output->colorspace != Magick::UndefinedColorspace ){
+      if (debug) printf( "colorspace: %s\n", MagickCore::CommandOptionToMnemonic(MagickCore::MagickColorspaceOptions, static_cast<ssize_t>(output->colorspace)) );
+        image->colorSpace( output->colorspace );
+        context->Time("colorspace");
+    }
+    return true;
+}
+
+// Produces one rendition from the decoded (and shared pre-processed) source image
+bool ConvertRendition(Magick::Image *image, const convert_output *output, convert_im_ctx *context, Magick::Blob *dstBlob) {
+    if ( !TransformRendition(image, output, context) )
+        return false;
+
+    try {
+        if ( context->dstFile ) {
+            WriteImageFile( image, context->dstFile );
+        }
+        else {
+            image->write( dstBlob );
+        }
+        context->Time("encode");
+    }
+    catch (std::exception& err) {
+        std::string message = "image.write failed with error: ";
+        message            += err.what();
+        context->error = message;
+        return false;
+    }
+    catch (...) {
+        context->error = std::string("unhandled error");
+        return false;
+    }
+    return true;
+}
+
+// Flattens image onto the "background" color
+void ApplyBackground(Magick::Image *image, convert_im_ctx *context) {
+    try {
+        Magick::Color bg(context->background.c_str());
+        Magick::Image background(image->size(), bg);
+
+        if (context->debug) {
+            printf("background: %s\n", static_cast<std::string>(bg).c_str());
+        }
+
+        background.composite(*image, Magick::ForgetGravity, Magick::OverCompositeOp);
+        image->composite(background, Magick::ForgetGravity, Magick::CopyCompositeOp);
+    } catch ( Magick::WarningOption &warning ){
+        if (context->debug) printf("Warning: %s\n", warning.what());
+    }
+}
+
+// Decodes every frame of an animated source, coalesced into full canvases so each frame can be transformed on its own.
+// The limits apply to all frames together, admitted from the pinged frame list before any frame is decoded.
+bool ReadFrames(std::vector<Magick::Image> *frames, const Magick::Blob &srcBlob, MemoryReservation *reservation, convert_im_ctx *context) {
+    MagickCore::ImageInfo *imageInfo = MagickCore::CloneImageInfo(NULL);
+    if( ! context->srcFormat.empty() ){
+        if (context->debug) printf( "reading with format: %s\n", context->srcFormat.c_str() );
+        MagickCore::CopyMagickString(imageInfo->magick, context->srcFormat.c_str(), MaxTextExtent);
+    }
+    if ( context->control ) {
+        MagickCore::SetImageInfoProgressMonitor(imageInfo, ControlMonitor, context->control.get());
+    }
+
+    MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
+    if ( NeedsAdmission(context) ) {
+        // the header of every frame, coalesced frames take the size of the canvas.
+        // ping errors are left for the actual read to report
+        MagickCore::Image *pinged = MagickCore::PingBlob(imageInfo, srcBlob.data(), srcBlob.length(), exception);
+        MagickCore::ClearMagickException(exception);
+        if ( pinged != NULL ) {
+            size_t columns = pinged->page.width  ? pinged->page.width  : pinged->columns;
+            size_t rows    = pinged->page.height ? pinged->page.height : pinged->rows;
+            size_t count   = MagickCore::GetImageListLength(pinged);
+            MagickCore::DestroyImageList(pinged);
+            if ( !AdmitSize(columns, rows * count, reservation, context) ) {
+                MagickCore::DestroyImageInfo(imageInfo);
+                MagickCore::DestroyExceptionInfo(exception);
+                return false;
+            }
+        }
+        context->Time("admission");
+    }
+
+    MagickCore::Image *decoded = MagickCore::BlobToImage(imageInfo, srcBlob.data(), srcBlob.length(), exception);
+    MagickCore::DestroyImageInfo(imageInfo);
+
+    bool ok = true;
+    if ( decoded == NULL || exception->severity >= MagickCore::ErrorException ) {
+        context->error = std::string("image.read failed with error: ") +
+            ( exception->reason ? exception->reason : "unable to read image" );
+        ok = false;
+    }
+    else if ( exception->severity != MagickCore::UndefinedException ) {
+        if (!context->ignoreWarnings) {
+            context->error = std::string( exception->reason ? exception->reason : "warning" );
+            ok = false;
+        } else {
+            stats.WarningIgnored();
+            if (context->debug) printf("warning: %s\n", exception->reason ? exception->reason : "");
+        }
+    }
+
+    MagickCore::Image *coalesced = NULL;
+    if ( ok ) {
+        MagickCore::ClearMagickException(exception);
+        coalesced = decoded->next ? MagickCore::CoalesceImages(decoded, exception) : MagickCore::CloneImageList(decoded, exception);
+        if ( coalesced == NULL ) {
+            context->error = std::string("image.coalesce failed with error: ") +
+                ( exception->reason ? exception->reason : "unable to coalesce frames" );
+            ok = false;
+        }
+    }
+    if ( decoded != NULL ) {
+        MagickCore::DestroyImageList(decoded);
+    }
+    MagickCore::DestroyExceptionInfo(exception);
+
+    while ( coalesced != NULL ) {
+        frames->push_back(Magick::Image(MagickCore::RemoveFirstImageFromList(&coalesced)));
+        CountDecoded(frames->back(), context);
+    }
+    if ( ! ok ) {
+        return false;
+    }
+    if (context->debug) printf( "frames: %d\n", (int) frames->size() );
+    context->Time("decode");
+    return true;
+}
+
+// Encodes the frames of one rendition, with the deltas between frames optimized again.
+// Formats without animation get the first frame, like a convert without "animated".
+bool EncodeFrames(std::vector<Magick::Image> *frames, convert_im_ctx *context, Magick::Blob *dstBlob) {
+    try {
+        Magick::CoderInfo coder( frames->front().magick() );
+        if ( ! coder.isMultiFrame() ) {
+            frames->front().write( dstBlob );
+        }
+        else {
+            std::vector<Magick::Image> optimized;
+            Magick::optimizeImageLayers( &optimized, frames->begin(), frames->end() );
+            context->Time("optimize");
+            Magick::writeImages( optimized.begin(), optimized.end(), dstBlob, true );
+        }
+        context->Time("encode");
+    }
+    catch (std::exception& err) {
+        std::string message = "image.write failed with error: ";
+        message            += err.what();
+        context->error = message;
+        return false;
+    }
+    catch (...) {
+        context->error = std::string("unhandled error");
+        return false;
+    }
+    return true;
+}
+
+// Renditions of an animation. Every rendition transforms each frame,
+// with the frames spread over up to "threads" threads, as frames of one animation are independent images.
+void ConvertFrames(std::vector<Magick::Image> *frames, convert_im_ctx *context) {
+    int debug = context->debug;
+
+    for (size_t f = 0; f < frames->size(); f++) {
+        if (!context->background.empty()) {
+            ApplyBackground(&(*frames)[ f ], context);
+        }
+        if ( context->strip ) {
+            (*frames)[ f ].strip();
+        }
+    }
+    if ( context->trim ) {
+        // frames must keep sharing one canvas
+        if (debug) printf( "trim: ignored for animated sources\n" );
+    }
+    context->Time("frames");
+
+    unsigned int budget  = ThreadBudget(context->threads);
+    unsigned int workers = budget;
+    if ( workers > frames->size() ) {
+        workers = frames->size();
+    }
+    // the frame threads share the budget with ImageMagick's own threads,
+    // each one gets its part of it so the job stays within the budget.
+    // the limit is process wide, jobs running meanwhile get the same part, see SetThreadBudget()
+    unsigned int frameThreads = budget / workers;
+    if (debug) printf( "frame threads: %u, threads per frame: %u\n", workers, frameThreads );
+
+    context->dstBlobs.resize(context->outputs.size());
+    for (size_t i = 0; i < context->outputs.size(); i++) {
+        if (debug && context->multiOutput) printf( "output: %d\n", (int) i );
+        const convert_output *output = &context->outputs[ i ];
+
+        // copies share the decoded pixels until a rendition modifies them, each frame is only used by one thread
+        std::vector<Magick::Image> rendered(*frames);
+        std::vector<std::string> errors(workers);
+        std::atomic<size_t> next(0);
+
+        auto transform = [&rendered, &errors, &next, output, debug](unsigned int worker) {
+            convert_im_ctx frameContext;
+            frameContext.debug = debug;
+            try {
+                for (size_t f = next++; f < rendered.size(); f = next++) {
+                    if ( !TransformRendition(&rendered[ f ], output, &frameContext) ) {
+                        errors[ worker ] = frameContext.error;
+                        return;
+                    }
+                    // the canvas of a frame is the frame itself once resized
+                    rendered[ f ].page(Magick::Geometry(rendered[ f ].columns(), rendered[ f ].rows(), 0, 0));
+                }
+            }
+            catch (std::exception& err) {
+                errors[ worker ] = err.what();
+            }
+            catch (...) {
+                errors[ worker ] = std::string("unhandled error");
+            }
+        };
+        MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, frameThreads);
+        std::vector<std::thread> threads;
+        for (unsigned int w = 1; w < workers; w++) {
+            threads.push_back(std::thread(transform, w));
+        }
+        transform(0);
+        for (size_t t = 0; t < threads.size(); t++) {
+            threads[ t ].join();
+        }
+        // the whole budget again for encoding
+        MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, budget);
+        for (size_t w = 0; w < errors.size(); w++) {
+            if ( ! errors[ w ].empty() ) {
+                context->error = errors[ w ];
+                return;
+            }
+        }
+        context->Time("transform");
+
+        if ( !EncodeFrames(&rendered, context, &context->dstBlobs[ i ]) )
+            return;
+    }
+    context->dstBlob = context->dstBlobs[0];
+}
+
+// 16 hex digits of the difference hash (dHash) of image. The image is scaled to a 9x8 proxy,
+// each bit is set when a pixel's luma is above its right neighbour's.
+// Resized, recompressed or lightly edited copies differ in a few bits, compare hashes by their Hamming distance.
+bool DifferenceHash(const Magick::Image &image, std::string *hash, im_ctx_base *context) {
+    uint64_t bits = 0;
+    try {
+        Magick::Image proxy = image;
+        Magick::Geometry size(9, 8);
+        size.aspect(true);
+        // averages the pixels each proxy pixel covers, at the cost of a single pass
+        proxy.scale(size);
+        const Magick::PixelPacket *pixels = proxy.getConstPixels(0, 0, 9, 8);
+        for (int y = 0; y < 8; y++) {
+            for (int x = 0; x < 8; x++) {
+                const Magick::PixelPacket &left  = pixels[ y * 9 + x ];
+                const Magick::PixelPacket &right = pixels[ y * 9 + x + 1 ];
+                double leftLuma  = 0.299 * left.red + 0.587 * left.green + 0.114 * left.blue;
+                double rightLuma = 0.299 * right.red + 0.587 * right.green + 0.114 * right.blue;
+                bits = ( bits << 1 ) | ( leftLuma > rightLuma ? 1 : 0 );
+            }
+        }
+    }
+    catch (std::exception& err) {
+        context->error = err.what();
+        return false;
+    }
+    catch (...) {
+        context->error = std::string("unhandled error");
+        return false;
+    }
+    char hex[ 17 ];
+    snprintf(hex, sizeof hex, "%016llx", (unsigned long long) bits);
+    *hash = hex;
+    return true;
+}
+
+// Fingerprints the decoded source of a convert with "fingerprint", before any operation changes it
+bool FingerprintSource(const Magick::Image &image, convert_im_ctx *context) {
+    if ( !DifferenceHash(image, &context->hash, context) )
+        return false;
+    if ( context->srcData ) {
+        context->digest = Hash128(context->srcData, context->length);
+    }
+    context->Time("fingerprint");
+    return true;
+}
+
+// Makes the reader decode only the page of context, vector pages rasterized at its density
+void SelectPage(Magick::Image *image, convert_im_ctx *context) {
+    if (context->debug) printf( "page: %d\n", (int) context->page );
+    image->subImage(context->page);
+    image->subRange(1);
+    if ( context->pageDensity > 0 ) {
+        image->density(Magick::Geometry(context->pageDensity, context->pageDensity));
+    }
+}
+
+void DoConvert(uv_work_t* req) {
+
+    convert_im_ctx* context = static_cast<convert_im_ctx*>(req->data);
+    context->Time("queueWait");
+
+    int debug = context->debug;
+
+    if (debug) printf( "debug: on\n" );
+    if (debug) printf( "ignoreWarnings: %d\n", context->ignoreWarnings );
+
+    SetThreadBudget(context->threads, debug);
+
+    std::unique_lock<std::mutex> loadedLock;
+    Magick::Image image;
+
+    unsigned int hintWidth, hintHeight;
+    bool hinted = ! context->loaded && ! context->animated && context->page < 0 && ! context->region.width && DecodeSizeHint(context, &hintWidth, &hintHeight);
+    if ( hinted ) {
+        SetDecodeSizeHint(&image, hintWidth, hintHeight, debug);
+    }
+
+    MemoryReservation reservation;
+    if ( context->loaded ) {
+        UseLoadedImage(&image, &loadedLock, context);
+    }
+    else if ( context->srcFile ) {
+        // admitted by DoConvertStream from the header in the first bytes of the stream
+        if ( !ReadImageFile(&image, context->srcFile, context->srcFormat, context) )
+            return;
+        context->Time("decode");
+    }
+    else if ( context->region.width ) {
+        if ( context->page >= 0 ) {
+            SelectPage(&image, context);
+        }
+        if ( !ReadRegion(&image, Magick::Blob( context->srcData, context->length ), context->region, "srcRegion is beyond the image's dimensions", &reservation, context) )
+            return;
+        context->Time("decode");
+    }
+    else if ( context->animated && context->page < 0 ) {
+        std::vector<Magick::Image> frames;
+        if ( !ReadFrames(&frames, Magick::Blob( context->srcData, context->length ), &reservation, context) )
+            return;
+        if ( context->fingerprint && !FingerprintSource(frames.front(), context) )
+            return;
+        if ( frames.size() > 1 ) {
+            ConvertFrames(&frames, context);
+            return;
+        }
+        image = frames.front();
+    }
+    else {
+        Magick::Blob srcBlob( context->srcData, context->length );
+
+        if ( NeedsAdmission(context) ) {
+            Magick::Image header;
+            if ( ! context->srcFormat.empty() ) {
+                header.magick( context->srcFormat.c_str() );
+            }
+            if ( hinted ) {
+                SetDecodeSizeHint(&header, hintWidth, hintHeight, 0);
+            }
+            if ( context->page >= 0 ) {
+                SelectPage(&header, context);
+            }
+            if ( !AdmitImage(&header, srcBlob, &reservation, context) )
+                return;
+            context->Time("admission");
+        }
+
+        if ( context->page >= 0 ) {
+            SelectPage(&image, context);
+        }
+        if ( !ReadImageMagick(&image, srcBlob, context->srcFormat, context) )
+            return;
+        context->Time("decode");
+    }
+
+    // animated sources were fingerprinted on their first frame
+    if ( context->fingerprint && context->hash.empty() && !FingerprintSource(image, context) )
+        return;
+
+    if (!context->background.empty()) {
+        ApplyBackground(&image, context);
+        context->Time("background");
+    }
+
+    if (debug) printf("original width,height: %d, %d\n", (int) image.columns(), (int) image.rows());
+
+    if ( context->strip ) {
+        if (debug) printf( "strip: true\n" );
+        image.strip();
+        context->Time("strip");
+    }
+
+    if ( context->trim ) {
+        if (debug) printf( "trim: true\n" );
+        double trimFuzz = context->trimFuzz;
+        if ( trimFuzz != trimFuzz ) {
+            image.trim();
+        } else {
+            if (debug) printf( "fuzz: %lf\n", trimFuzz );
+            double fuzz = image.colorFuzz();
+            image.colorFuzz(trimFuzz);
+            image.trim();
+            image.colorFuzz(fuzz);
+            if (debug) printf( "restored fuzz: %lf\n", fuzz );
+        }
+        if (debug) printf( "trimmed width,height: %d, %d\n", (int) image.columns(), (int) image.rows() );
+        context->Time("trim");
+    }
+
+    context->dstBlobs.resize(context->outputs.size());
+    for (size_t i = 0; i < context->outputs.size(); i++) {
+        if (debug && context->multiOutput) printf( "output: %d\n", (int) i );
+
+        // copies share the decoded pixels until a rendition modifies them
+        Magick::Image rendition = image;
+        if ( !ConvertRendition(&rendition, &context->outputs[i], context, &context->dstBlobs[i]) )
+            return;
+    }
+    context->dstBlob = context->dstBlobs[0];
+}
+
+// Make callback from convert or composite
+void GeneratedBlobAfter(uv_work_t* req) {
+    Nan::HandleScope scope;
+
+    im_ctx_base* context = static_cast<im_ctx_base*>(req->data);
+    delete req;
+
+    Local<Value> argv[2];
+
+    if (!context->error.empty()) {
+        argv[0] = Exception::Error(Nan::New<String>(context->error.c_str()).ToLocalChecked());
+        argv[1] = Nan::Undefined();
+    }
+    else {
+        argv[0] = Nan::Undefined();
+        argv[1] = WrapBlobs(context);
+    }
+
+    Nan::TryCatch try_catch; // don't quite see the necessity of this
+
+    ReportMetrics(context);
+
+    Nan::AsyncResource resource("GeneratedBlobAfter");
+    context->callback->Call(2, argv, &resource);
+
+    delete context->callback;
+
+    delete context;
+
+    if (try_catch.HasCaught()) {
+#if NODE_VERSION_AT_LEAST(0, 12, 0)
+        Nan::FatalException(try_catch);
+#else
+        FatalException(try_catch);
+#endif
+    }
+}
+
+// One result of a batch: a Buffer, or an Array of Buffers when the job produced several outputs
+Local<Value> WrapBatchResult(const std::vector<Magick::Blob> &blobs, bool multiOutput) {
+    Nan::EscapableHandleScope scope;
+    if ( ! multiOutput ) {
+        return scope.Escape(WrapBlob(blobs[ 0 ]));
+    }
+    Local<Array> out = Nan::New<Array>(blobs.size());
+    for (size_t i = 0; i < blobs.size(); i++) {
+        Nan::Set(out, i, WrapBlob(blobs[ i ]));
+    }
+    return scope.Escape(out);
+}
+
+// Collects the result of one job of a batch, calls back with all of them once the last one finished
+void BatchAfter(uv_work_t* req) {
+    Nan::HandleScope scope;
+
+    im_ctx_base* context = static_cast<im_ctx_base*>(req->data);
+    delete req;
+
+    ReportMetrics(context);
+
+    std::shared_ptr<job_batch> batch = context->batch;
+    if ( ! context->error.empty() ) {
+        if ( batch->error.empty() ) {
+            batch->error = context->error;
+        }
+    }
+    else {
+        context->CacheResult(&batch->results[ context->batchIndex ]);
+    }
+    delete context;
+
+    if ( --batch->pending > 0 ) {
+        return;
+    }
+
+    Local<Value> argv[2];
+    if (!batch->error.empty()) {
+        argv[0] = Exception::Error(Nan::New<String>(batch->error.c_str()).ToLocalChecked());
+        argv[1] = Nan::Undefined();
+    }
+    else {
+        Local<Array> results = Nan::New<Array>(batch->results.size());
+        for (size_t i = 0; i < batch->results.size(); i++) {
+            Nan::Set(results, i, WrapBatchResult(batch->results[ i ], batch->multiOutput));
+        }
+        argv[0] = Nan::Undefined();
+        argv[1] = results;
+    }
+
+    Nan::TryCatch try_catch;
+
+    Nan::AsyncResource resource("BatchAfter");
+    batch->callback->Call(2, argv, &resource);
+
+    if (try_catch.HasCaught()) {
+#if NODE_VERSION_AT_LEAST(0, 12, 0)
+        Nan::FatalException(try_catch);
+#else
+        FatalException(try_catch);
+#endif
+    }
+}
+
+// Runs the jobs of a call split into a batch, each on a worker of the pool (async) or one after the other (sync).
+// The result is an Array in the order of contexts, the first error fails the call. Takes ownership of contexts.
+void RunBatch(const Nan::FunctionCallbackInfo<Value>& info, bool isSync, const std::vector<im_ctx_base*> &contexts, uv_work_cb work) {
+    std::shared_ptr<job_batch> batch = std::make_shared<job_batch>();
+    batch->results.resize(contexts.size());
+    batch->multiOutput = contexts[ 0 ]->multiOutput;
+    for (size_t i = 0; i < contexts.size(); i++) {
+        contexts[ i ]->batch = batch;
+        contexts[ i ]->batchIndex = i;
+    }
+
+    if ( ! isSync ) {
+        batch->callback = new Nan::Callback(Local<Function>::Cast(info[1]));
+        batch->pending = contexts.size();
+        for (size_t i = 0; i < contexts.size(); i++) {
+            // the batch owns the callback, the jobs only point at it so admission can wait for memory
+            contexts[ i ]->callback = batch->callback;
+            uv_work_t* req = new uv_work_t();
+            req->data = contexts[ i ];
+            QueueJob(req, work, BatchAfter);
+        }
+        return;
+    }
+
+    Local<Array> results = Nan::New<Array>(contexts.size());
+    std::string error;
+    for (size_t i = 0; i < contexts.size(); i++) {
+        uv_work_t* req = new uv_work_t();
+        req->data = contexts[ i ];
+        if ( error.empty() ) {
+            RunJob(req, work);
+            ReportMetrics(contexts[ i ]);
+            if ( ! contexts[ i ]->error.empty() ) {
+                error = contexts[ i ]->error;
+            }
+            else {
+                std::vector<Magick::Blob> blobs;
+                contexts[ i ]->CacheResult(&blobs);
+                Nan::Set(results, i, WrapBatchResult(blobs, batch->multiOutput));
+            }
+        }
+        delete contexts[ i ];
+        delete req;
+    }
+    if ( ! error.empty() ) {
+        return Nan::ThrowError(error.c_str());
+    }
+    info.GetReturnValue().Set(results);
+}
+
+// Reads the per rendition options of convert from obj.
+// Missing keys keep the values already in output, so renditions inherit the top level options.
+void ParseConvertOutput(Local<Object> obj, convert_output *output, int debug) {
+    Local<Value> widthValue = GetOption( obj, WidthKey );
+    if ( ! widthValue->IsUndefined() ) output->width = Nan::To<Uint32>(widthValue).ToLocalChecked()->Value();
+
+    Local<Value> heightValue = GetOption( obj, HeightKey );
+    if ( ! heightValue->IsUndefined() ) output->height = Nan::To<Uint32>(heightValue).ToLocalChecked()->Value();
+
+    Local<Value> xoffsetValue = GetOption( obj, XoffsetKey );
+    if ( ! xoffsetValue->IsUndefined() ) output->xoffset = Nan::To<Uint32>(xoffsetValue).ToLocalChecked()->Value();
+
+    Local<Value> yoffsetValue = GetOption( obj, YoffsetKey );
+    if ( ! yoffsetValue->IsUndefined() ) output->yoffset = Nan::To<Uint32>(yoffsetValue).ToLocalChecked()->Value();
+
+    Local<Value> qualityValue = GetOption( obj, QualityKey );
+    if ( ! qualityValue->IsUndefined() ) output->quality = Nan::To<Uint32>(qualityValue).ToLocalChecked()->Value();
+
+    Local<Value> rotateValue = GetOption( obj, RotateKey );
+    if ( ! rotateValue->IsUndefined() ) output->rotate = Nan::To<Int32>(rotateValue).ToLocalChecked()->Value();
+
+    Local<Value> flipValue = GetOption( obj, FlipKey );
+    if ( ! flipValue->IsUndefined() ) output->flip = Nan::To<Uint32>(flipValue).ToLocalChecked()->Value();
+
+    Local<Value> densityValue = GetOption( obj, DensityKey );
+    if ( ! densityValue->IsUndefined() ) output->density = Nan::To<Int32>(densityValue).ToLocalChecked()->Value();
+
+    Local<Value> autoOrientValue = GetOption( obj, AutoOrientKey );
+    if ( ! autoOrientValue->IsUndefined() ) output->autoOrient = Nan::To<Boolean>(autoOrientValue).ToLocalChecked()->IsTrue();
+
+    Local<Value> blurValue = GetOption( obj, BlurKey );
+    if ( ! blurValue->IsUndefined() ) {
+        output->hasBlur = true;
+        output->blur = Nan::To<Number>(blurValue).ToLocalChecked()->Value();
+    }
+
+    Local<Value> resizeStyleValue = GetOption( obj, ResizeStyleKey );
+    if ( ! resizeStyleValue->IsUndefined() ) output->resizeStyle = *Nan::Utf8String(resizeStyleValue);
+
+    Local<Value> gravityValue = GetOption( obj, GravityKey );
+    if ( ! gravityValue->IsUndefined() ) output->gravity = *Nan::Utf8String(gravityValue);
+
+    Local<Value> formatValue = GetOption( obj, FormatKey );
+    if ( ! formatValue->IsUndefined() ) output->format = *Nan::Utf8String(formatValue);
+
+    Local<Value> filterValue = GetOption( obj, FilterKey );
+    if ( ! filterValue->IsUndefined() ) output->filter = *Nan::Utf8String(filterValue);
+
+    Local<Value> colorspaceValue = GetOption( obj, ColorspaceKey );
+    if ( ! colorspaceValue->IsUndefined() ) {
+      ssize_t colorspace = MagickCore::ParseCommandOption(MagickCore::MagickColorspaceOptions, MagickCore::MagickFalse, *Nan::Utf8String(colorspaceValue));
+      if (debug) printf("Parsing colorspace option \"%s\" to %ld\n", *Nan::Utf8String(colorspaceValue), colorspace);
+      output->colorspace = colorspace != (-1) ? (Magick::ColorspaceType) colorspace : Magick::UndefinedColorspace;
+    }
+}
+
+// Validates gravity and resolves filter once per rendition, instead of in the worker on every run.
+// Errors are kept in output->error and reported by ConvertRendition, where they used to be detected.
+void ResolveConvertOutput(convert_output *output) {
+    static const char* const gravities[] = {
+        "Center", "East", "West", "North", "South", "NorthEast", "NorthWest", "SouthEast", "SouthWest", "None"
+    };
+    bool gravityFound = false;
+    for (size_t i = 0; i < sizeof(gravities) / sizeof(gravities[ 0 ]); i++) {
+        if ( output->gravity == gravities[ i ] ) {
+            gravityFound = true;
+            break;
+        }
+    }
+    if ( ! gravityFound ) {
+        output->error = "gravity not supported";
+        return;
+    }
+
+    if ( ! output->filter.empty() ) {
+        output->filterType = MagickCore::ParseCommandOption(MagickCore::MagickFilterOptions, Magick::MagickFalse, output->filter.c_str());
+        if ( output->filterType == -1 ) {
+            output->error = "filter not supported";
+        }
+    }
+}
+
+// The options of convert that affect its result, in a fixed order so the cache key doesn't depend on how they were given
+std::string ConvertCacheOptions(convert_im_ctx *context) {
+    char line[ 512 ];
+    snprintf(line, sizeof(line), "%d %d %d %d %.17g %d %d %d %d %d %d",
+        context->ignoreWarnings, context->strip, context->trim, context->shrinkOnLoad, context->trimFuzz,
+        context->multiOutput, (int) context->outputs.size(), context->animated, (int) context->page, context->pageDensity,
+        context->fingerprint);
+    std::string options = context->srcFormat + "\n" + context->background + "\n" + line;
+    snprintf(line, sizeof(line), " %zu %zu %zu %zu",
+        context->region.x, context->region.y, context->region.width, context->region.height);
+    options += line;
+
+    for (size_t i = 0; i < context->outputs.size(); i++) {
+        const convert_output &output = context->outputs[ i ];
+        snprintf(line, sizeof(line), "\n%u %u %u %u %d %d %.17g %d %u %d %d %d",
+            output.width, output.height, output.xoffset, output.yoffset, output.autoOrient,
+            output.hasBlur, output.blur, (int) output.colorspace, output.quality, output.rotate, output.density, output.flip);
+        options += line + ( "\n" + output.resizeStyle + "\n" + output.gravity + "\n" + output.format + "\n" + output.filter );
+    }
+    return options;
+}
+
+// Reads "srcRegion", an object with the x, y, width and height of the part of the source to read
+bool ParseRegion(Local<Value> value, source_region *region) {
+    if ( ! value->IsObject() ) {
+        return false;
+    }
+    Local<Object> obj = Local<Object>::Cast(value);
+    Local<Value> x      = GetOption( obj, XKey );
+    Local<Value> y      = GetOption( obj, YKey );
+    Local<Value> width  = GetOption( obj, WidthKey );
+    Local<Value> height = GetOption( obj, HeightKey );
+    if ( ! x->IsUint32() || ! y->IsUint32() || ! width->IsUint32() || ! height->IsUint32() ) {
+        return false;
+    }
+    *region = source_region(Nan::To<uint32_t>(x).FromJust(), Nan::To<uint32_t>(y).FromJust(),
+        Nan::To<uint32_t>(width).FromJust(), Nan::To<uint32_t>(height).FromJust());
+    return region->width && region->height;
+}
+
+// Reads one page index of a "pages" string, and the spaces around it
+bool ParsePageIndex(const char **cursor, unsigned int *page) {
+    while ( **cursor == ' ' ) (*cursor)++;
+    if ( ! isdigit(**cursor) ) {
+        return false;
+    }
+    char *end;
+    unsigned long value = strtoul(*cursor, &end, 10);
+    if ( value > UINT_MAX ) {
+        return false;
+    }
+    *page = value;
+    *cursor = end;
+    while ( **cursor == ' ' ) (*cursor)++;
+    return true;
+}
+
+// Reads "pages", an array of page indexes or a string of indexes and ranges like "0,2-4"
+bool ParsePages(Local<Value> value, std::vector<unsigned int> *pages) {
+    // so a typo like "0-99999999" can't queue millions of jobs
+    static const unsigned int maxPages = 10000;
+
+    if ( value->IsArray() ) {
+        Local<Array> array = Local<Array>::Cast(value);
+        for (uint32_t i = 0; i < array->Length(); i++) {
+            Local<Value> pageValue = Nan::Get( array, i ).ToLocalChecked();
+            if ( ! pageValue->IsUint32() || pages->size() >= maxPages ) {
+                return false;
+            }
+            pages->push_back(Nan::To<uint32_t>(pageValue).FromJust());
+        }
+        return ! pages->empty();
+    }
+    if ( ! value->IsString() ) {
+        return false;
+    }
+
+    std::string ranges = *Nan::Utf8String(value);
+    size_t start = 0;
+    while ( start <= ranges.size() ) {
+        size_t end = ranges.find(',', start);
+        if ( end == std::string::npos ) {
+            end = ranges.size();
+        }
+        std::string range = ranges.substr(start, end - start);
+        const char *cursor = range.c_str();
+        unsigned int first, last;
+        if ( ! ParsePageIndex(&cursor, &first) ) {
+            return false;
+        }
+        last = first;
+        if ( *cursor == '-' ) {
+            cursor++;
+            if ( ! ParsePageIndex(&cursor, &last) ) {
+                return false;
+            }
+        }
+        if ( *cursor || last < first ) {
+            return false;
+        }
+        if ( last - first >= maxPages - pages->size() ) {
+            return false;
+        }
+        for (unsigned int page = first; page <= last; page++) {
+            pages->push_back(page);
+        }
+        start = end + 1;
+    }
+    return ! pages->empty();
+}
+
+// Reads the options of convert other than srcData into context, returns an error message or NULL
+const char* ParseConvertOptions(Local<Object> obj, convert_im_ctx *context) {
+    context->debug = Nan::To<Uint32>(GetOption( obj, DebugKey )).ToLocalChecked()->Value();
+    context->ignoreWarnings = Nan::To<Uint32>(GetOption( obj, IgnoreWarningsKey )).ToLocalChecked()->Value();
+    ParseLimits(obj, context);
+    ParseControl(obj, context);
+    ParseMetrics(obj, context);
+    context->threads = Nan::To<Uint32>(GetOption( obj, ThreadsKey )).ToLocalChecked()->Value();
+    if ( ! ParsePriority(obj, context) ) {
+        return "priority not supported";
+    }
+
+    Local<Value> trimValue = GetOption( obj, TrimKey );
+    if ( (context->trim = ! trimValue->IsUndefined() && Nan::To<Boolean>(trimValue).ToLocalChecked()->IsTrue()) ) {
+        context->trimFuzz = Nan::To<Number>(GetOption( obj, TrimFuzzKey )).ToLocalChecked()->Value() * (double) (1L << MAGICKCORE_QUANTUM_DEPTH);
+    }
+
+    Local<Value> stripValue = GetOption( obj, StripKey );
+    context->strip = ! stripValue->IsUndefined() && Nan::To<Boolean>(stripValue).ToLocalChecked()->IsTrue();
+
+    Local<Value> shrinkOnLoadValue = GetOption( obj, ShrinkOnLoadKey );
+    context->shrinkOnLoad = shrinkOnLoadValue->IsUndefined() || Nan::To<Boolean>(shrinkOnLoadValue).ToLocalChecked()->IsTrue();
+
+    Local<Value> animatedValue = GetOption( obj, AnimatedKey );
+    context->animated = ! animatedValue->IsUndefined() && Nan::To<Boolean>(animatedValue).ToLocalChecked()->IsTrue();
+
+    Local<Value> fingerprintValue = GetOption( obj, FingerprintKey );
+    context->fingerprint = ! fingerprintValue->IsUndefined() && Nan::To<Boolean>(fingerprintValue).ToLocalChecked()->IsTrue();
+
+    Local<Value> srcFormatValue = GetOption( obj, SrcFormatKey );
+    context->srcFormat = !srcFormatValue->IsUndefined() ?
+        *Nan::Utf8String(srcFormatValue) : "";
+
+    Local<Value> backgroundValue = GetOption( obj, BackgroundKey );
+    context->background = !backgroundValue->IsUndefined() ?
+        *Nan::Utf8String(backgroundValue) : "";
+
+    convert_output defaults;
+    ParseConvertOutput(obj, &defaults, context->debug);
+
+    Local<Value> srcRegionValue = GetOption( obj, SrcRegionKey );
+    if ( ! srcRegionValue->IsUndefined() ) {
+        if ( ! ParseRegion(srcRegionValue, &context->region) ) {
+            return "convert()'s \"srcRegion\" should be an object with x, y, width and height, width and height larger than 0";
+        }
+    }
+
+    Local<Value> pagesValue = GetOption( obj, PagesKey );
+    if ( ! pagesValue->IsUndefined() ) {
+        if ( ! ParsePages(pagesValue, &context->pages) ) {
+            return "convert()'s \"pages\" should be an array of page indexes or a string like \"0,2-4\"";
+        }
+        if ( context->fingerprint ) {
+            return "convert()'s \"fingerprint\" can't be combined with \"pages\"";
+        }
+        context->pageDensity = defaults.density;
+    }
+
+    Local<Value> outputsValue = GetOption( obj, OutputsKey );
+    if ( outputsValue->IsUndefined() ) {
+        ResolveConvertOutput(&defaults);
+        context->outputs.push_back(defaults);
+    }
+    else {
+        if ( ! outputsValue->IsArray() || Local<Array>::Cast(outputsValue)->Length() == 0 ) {
+            return "convert()'s \"outputs\" should be a non-empty array of objects";
+        }
+        Local<Array> outputs = Local<Array>::Cast(outputsValue);
+        for (uint32_t i = 0; i < outputs->Length(); i++) {
+            Local<Value> outputValue = Nan::Get( outputs, i ).ToLocalChecked();
+            if ( ! outputValue->IsObject() ) {
+                return "convert()'s \"outputs\" should be a non-empty array of objects";
+            }
+            convert_output output = defaults;
+            ParseConvertOutput(Local<Object>::Cast(outputValue), &output, context->debug);
+            ResolveConvertOutput(&output);
+            context->outputs.push_back(output);
+        }
+        context->multiOutput = true;
+    }
+
+    return NULL;
+}
+
+// Converts every page of settings->pages with the options of settings, one job per page
+void ConvertPages(const Nan::FunctionCallbackInfo<Value>& info, convert_im_ctx *settings, bool cached) {
+    bool isSync = (info.Length() == 1);
+
+    std::vector<im_ctx_base*> contexts;
+    for (size_t i = 0; i < settings->pages.size(); i++) {
+        convert_im_ctx* context = new convert_im_ctx(*settings);
+        context->pages.clear();
+        context->page = settings->pages[ i ];
+        // every page reports its own timings
+        if ( settings->metrics ) {
+            context->metrics = new Nan::Callback(settings->metrics->GetFunction());
+        }
+        if ( cached ) {
+            context->cacheKey = MakeCacheKey("convert", ConvertCacheOptions(context), context);
+        }
+        contexts.push_back(context);
+    }
+
+    RunBatch(info, isSync, contexts, DoConvert);
+}
+
+// input
+//   info[ 0 ]: options. required, object with following key,values
+//              {
+//                  srcData:     required. Buffer with binary image data
+//                  srcPath:     optional. path of the image file instead of srcData, mapped and decoded by the worker.
+//                  dstPath:     optional. path the result is written to by the worker, nothing is returned.
+//                  fingerprint: optional. default: false. also return { hash, digest } of the decoded source, see fingerprint().
+//                               the result is { data, fingerprint }, data being what convert() returns otherwise.
+//                  quality:     optional. 0-100 integer, default 75. JPEG/MIFF/PNG compression level.
+//                  trim:        optional. default: false. trims edges that are the background color.
+//                  trimFuzz:    optional. [0-1) float, default 0. trimmed color distance to edge color, 0 is exact.
+//                  width:       optional. px.
+//                  height:      optional. px.
+//                  resizeStyle: optional. default: "aspectfill". can be "aspectfit", "fill"
+//                  gravity:     optional. default: "Center". used when resizeStyle is "aspectfill"
+//                                         can be "NorthWest", "North", "NorthEast", "West",
+//                                         "Center", "East", "SouthWest", "South", "SouthEast", "None"
+//                  format:      optional. one of http://www.imagemagick.org/script/formats.php ex: "JPEG"
+//                  filter:      optional. ex: "Lagrange", "Lanczos". see ImageMagick's magick/option.c for candidates
+//                  blur:        optional. ex: 0.8
+//                  strip:       optional. default: false. strips comments out from image.
+//                  shrinkOnLoad: optional. default: true. let the JPEG decoder downscale while reading when resizing.
+//                  animated:    optional. default: false. keep every frame of animated GIF/WebP sources, coalesced,
+//                               transformed on up to "threads" threads and optimized again. trim is ignored.
+//                  srcRegion:   optional. { x, y, width, height } px. only this part of the source is decoded and converted,
+//                               JPEG, stripped TIFF and PNM sources never hold more than the region in memory. animated is ignored.
+//                  pages:       optional. pages of a multi-page PDF/TIFF source, 0 based, ex: [0, 2] or "0,2-4".
+//                               each page is decoded on its own and converted by its own job of the pool,
+//                               an array with one result per page is returned. "density" sets the dpi PDF pages are rasterized at.
+//                  maxMemory:   optional. bytes. fail when the decoded image's pixel cache, estimated from its header, would be larger.
+//                  maxPixels:   optional. fail when the decoded image would have more than width * height pixels.
+//                  timeoutMs:   optional. fail with "job timed out" when the call takes longer, counted from the call.
+//                  jobId:       optional. number. async calls can be stopped with cancel(jobId), failing with "job cancelled".
+//                  threads:     optional. threads ImageMagick may use for this call, 0 (default) uses the module wide setting.
+//                  priority:    optional. default: "interactive". worker pool lane of async calls, "interactive" or "batch".
+//                  metrics:     optional. function called with { stage: ms, ..., total: ms } before the result is returned.
+//                  cache:       optional. default: true. false skips the result cache enabled by cache().
+//                  outputs:     optional. array of objects with the per rendition keys above (width, height, resizeStyle, format, quality, ...).
+//                               the source is decoded once and an array of Buffers is returned, one per entry.
+//                  debug:       optional. 1 or 0
+//              }
+//   info[ 1 ]: callback. optional, if present runs async and returns result with callback(error, buffer)
+NAN_METHOD(Convert) {
+    Nan::HandleScope();
+
+    bool isSync = (info.Length() == 1);
+
+    if ( info.Length() < 1 ) {
+        return Nan::ThrowError("convert() requires 1 (option) argument!");
+    }
+
+    if ( ! info[ 0 ]->IsObject() ) {
+        return Nan::ThrowError("convert()'s 1st argument should be an object");
+    }
+
+    if( ! isSync && ! info[ 1 ]->IsFunction() ) {
+        return Nan::ThrowError("convert()'s 2nd argument should be a function");
+    }
+
+    Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
+
+    convert_im_ctx* context = new convert_im_ctx();
+    if ( ! ParseSource(obj, context) ) {
+        delete context;
+        return Nan::ThrowError("convert()'s 1st argument should have \"srcData\" key with a Buffer instance");
+    }
+
+    if ( ! context->error.empty() ) {
+        std::string error = context->error;
+        delete context;
+        return Nan::ThrowError(error.c_str());
+    }
+
+    const char* error = ParseConvertOptions(obj, context);
+    if ( error ) {
+        delete context;
+        return Nan::ThrowError(error);
+    }
+    ParseDestination(obj, context);
+    if ( ! context->dstPath.empty() && ( context->multiOutput || ! context->pages.empty() ) ) {
+        delete context;
+        return Nan::ThrowError("convert()'s \"dstPath\" takes a single result, not \"outputs\" or \"pages\"");
+    }
+    if ( context->loaded && context->region.width ) {
+        delete context;
+        return Nan::ThrowError("convert()'s \"srcRegion\" needs \"srcData\", a loaded image is decoded already");
+    }
+    if ( ! context->pages.empty() ) {
+        if ( context->loaded ) {
+            delete context;
+            return Nan::ThrowError("convert()'s \"pages\" needs \"srcData\", a loaded image has a single page");
+        }
+        ConvertPages(info, context, UseCache(obj, context));
+        delete context;
+        return;
+    }
+    if ( UseCache(obj, context) ) {
+        context->cacheKey = MakeCacheKey("convert", ConvertCacheOptions(context), context);
+    }
+
+    uv_work_t* req = new uv_work_t();
+    req->data = context;
+    if(!isSync) {
+        context->callback = new Nan::Callback(Local<Function>::Cast(info[1]));
+
+        QueueJob(req, DoConvert, GeneratedBlobAfter);
+
+        return;
+    } else {
+        RunJob(req, DoConvert);
+        RETURN_BLOB_OR_ERROR(req)
+    }
+}
+
+// Convert options parsed and validated once by createConverter(), run against many sources
+class Converter : public Nan::ObjectWrap {
+public:
+    static void Init() {
+        Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(New);
+        tpl->SetClassName(Nan::New<String>("Converter").ToLocalChecked());
+        tpl->InstanceTemplate()->SetInternalFieldCount(1);
+        Nan::SetPrototypeMethod(tpl, "run", Run);
+        constructor().Reset(Nan::GetFunction(tpl).ToLocalChecked());
+    }
+
+    // takes ownership of settings
+    static Local<Object> NewInstance(convert_im_ctx *settings, bool cached) {
+        Nan::EscapableHandleScope scope;
+        Local<Object> obj = Nan::NewInstance(Nan::New(constructor())).ToLocalChecked();
+        Converter* converter = Nan::ObjectWrap::Unwrap<Converter>(obj);
+        // every run gets its own metrics callback, the copies of settings must not share one
+        converter->metrics  = settings->metrics;
+        settings->metrics   = NULL;
+        // every run starts its own deadline, runs can't be cancelled by id
+        settings->control.reset();
+        converter->settings = settings;
+        converter->cached   = cached;
+        return scope.Escape(obj);
+    }
+
+private:
+    Converter() : settings(NULL), metrics(NULL), cached(true) {}
+    ~Converter() {
+        delete settings;
+        delete metrics;
+    }
+
+    static Nan::Persistent<Function>& constructor() {
+        static thread_local Nan::Persistent<Function> ctor;
+        return ctor;
+    }
+
+    static NAN_METHOD(New) {
+        Converter* converter = new Converter();
+        converter->Wrap(info.This());
+        info.GetReturnValue().Set(info.This());
+    }
+
+    // input
+    //   info[ 0 ]: srcData. required, Buffer with binary image data
+    //   info[ 1 ]: callback. optional, if present runs async and returns result with callback(error, buffer)
+    static NAN_METHOD(Run) {
+        Converter* converter = Nan::ObjectWrap::Unwrap<Converter>(info.Holder());
+
+        bool isSync = (info.Length() < 2);
+
+        if ( info.Length() < 1 || ! Buffer::HasInstance(info[ 0 ]) ) {
+            return Nan::ThrowError("run()'s 1st argument should be a Buffer");
+        }
+
+        if ( ! isSync && ! info[ 1 ]->IsFunction() ) {
+            return Nan::ThrowError("run()'s 2nd argument should be a function");
+        }
+
+        convert_im_ctx* context = new convert_im_ctx(*converter->settings);
+        context->srcData = Buffer::Data(info[ 0 ]);
+        context->length = Buffer::Length(info[ 0 ]);
+        if ( converter->cached && cache.Enabled() ) {
+            if ( converter->cacheOptions.empty() ) {
+                converter->cacheOptions = ConvertCacheOptions(converter->settings);
+            }
+            context->cacheKey = MakeCacheKey("convert", converter->cacheOptions, context);
+        }
+        // the copy of settings starts its clock now
+        context->createdAt  = uv_hrtime();
+        context->stageStart = context->createdAt;
+        if ( converter->metrics ) {
+            context->metrics    = new Nan::Callback(converter->metrics->GetFunction());
+        }
+        StartControl(context, 0);
+
+        uv_work_t* req = new uv_work_t();
+        req->data = context;
+        if(!isSync) {
+            context->callback = new Nan::Callback(Local<Function>::Cast(info[1]));
+
+            QueueJob(req, DoConvert, GeneratedBlobAfter);
+
+            return;
+        } else {
+            RunJob(req, DoConvert);
+            RETURN_BLOB_OR_ERROR(req)
+        }
+    }
+
+    convert_im_ctx* settings;
+    Nan::Callback* metrics;
+    // whether runs use the cache, and the normalized options of its keys once one was made
+    bool cached;
+    std::string cacheOptions;
+};
+
+// input
+//   info[ 0 ]: options. required, the options of convert() without srcData
+// output
+//   a converter whose run(srcData[, callback]) behaves like convert() with these options
+NAN_METHOD(CreateConverter) {
+    Nan::HandleScope();
+
+    if ( info.Length() < 1 || ! info[ 0 ]->IsObject() ) {
+        return Nan::ThrowError("createConverter()'s 1st argument should be an object");
+    }
+
+    Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
+    convert_im_ctx* settings = new convert_im_ctx();
+    const char* error = ParseConvertOptions(obj, settings);
+    for (size_t i = 0; ! error && i < settings->outputs.size(); i++) {
+        error = settings->outputs[ i ].error;
+    }
+    if ( ! error && ! settings->pages.empty() ) {
+        error = "createConverter() doesn't support \"pages\"";
+    }
+    if ( error ) {
+        delete settings;
+        return Nan::ThrowError(error);
+    }
+
+    Local<Value> cacheValue = GetOption( obj, CacheKey );
+    bool cached = cacheValue->IsUndefined() || Nan::To<Boolean>(cacheValue).ToLocalChecked()->IsTrue();
+    info.GetReturnValue().Set(Converter::NewInstance(settings, cached));
+}
+
+#ifdef IMAGEMAGICK_NATIVE_STREAMS
+// JS handle writing the source image of a streaming convert
+class StreamInput : public Nan::ObjectWrap {
+public:
+    static void Init() {
+        Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(New);
+        tpl->SetClassName(Nan::New<String>("StreamInput").ToLocalChecked());
+        tpl->InstanceTemplate()->SetInternalFieldCount(1);
+        Nan::SetPrototypeMethod(tpl, "write", Write);
+        Nan::SetPrototypeMethod(tpl, "end", End);
+        Nan::SetPrototypeMethod(tpl, "abort", Abort);
+        Nan::SetPrototypeMethod(tpl, "resume", Resume);
+        constructor().Reset(Nan::GetFunction(tpl).ToLocalChecked());
+    }
+
+    static Local<Object> NewInstance(std::shared_ptr<StreamSource> source, std::shared_ptr<StreamSink> sink) {
+        Nan::EscapableHandleScope scope;
+        Local<Object> obj = Nan::NewInstance(Nan::New(constructor())).ToLocalChecked();
+        StreamInput* input = Nan::ObjectWrap::Unwrap<StreamInput>(obj);
+        input->source = source;
+        input->sink   = sink;
+        return scope.Escape(obj);
+    }
+
+private:
+    static Nan::Persistent<Function>& constructor() {
+        static thread_local Nan::Persistent<Function> ctor;
+        return ctor;
+    }
+
+    static NAN_METHOD(New) {
+        StreamInput* input = new StreamInput();
+        input->Wrap(info.This());
+        info.GetReturnValue().Set(info.This());
+    }
+
+    static NAN_METHOD(Write) {
+        StreamInput* input = Nan::ObjectWrap::Unwrap<StreamInput>(info.Holder());
+        if ( info.Length() < 1 || ! Buffer::HasInstance(info[ 0 ]) ) {
+            return Nan::ThrowError("write()'s 1st argument should be a Buffer");
+        }
+        bool more = input->source->Write(Buffer::Data(info[ 0 ]), Buffer::Length(info[ 0 ]));
+        info.GetReturnValue().Set(Nan::New<Boolean>(more));
+    }
+
+    static NAN_METHOD(End) {
+        Nan::ObjectWrap::Unwrap<StreamInput>(info.Holder())->source->End(false);
+    }
+
+    static NAN_METHOD(Abort) {
+        StreamInput* input = Nan::ObjectWrap::Unwrap<StreamInput>(info.Holder());
+        input->source->End(true);
+        input->sink->Stop();
+    }
+
+    // the reader wants more output
+    static NAN_METHOD(Resume) {
+        Nan::ObjectWrap::Unwrap<StreamInput>(info.Holder())->sink->Resume();
+    }
+
+    std::shared_ptr<StreamSource> source;
+    std::shared_ptr<StreamSink> sink;
+};
+
+// Hands the encoded chunks produced so far to onData, and tells onDrain the source can take more input
+void ConvertStreamData(uv_work_t* req) {
+    Nan::HandleScope scope;
+
+    convert_stream_im_ctx* context = static_cast<convert_stream_im_ctx*>(req->data);
+    std::deque<std::string> chunks = context->sink->Take();
+
+    Nan::TryCatch try_catch;
+
+    Nan::AsyncResource resource("ConvertStreamData");
+    bool pause = false;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        Local<Value> argv[1] = { WrapString(&chunks[ i ]) };
+        Local<Value> more;
+        // like stream.push(), false asks for no more output until resume()
+        if ( context->onData->Call(1, argv, &resource).ToLocal(&more) && more->IsFalse() ) {
+            pause = true;
+        }
+    }
+    if ( pause ) {
+        context->sink->Pause();
+    }
+    if ( context->onDrain && context->source->TakeDrained() ) {
+        context->onDrain->Call(0, NULL, &resource);
+    }
+
+    if (try_catch.HasCaught()) {
+#if NODE_VERSION_AT_LEAST(0, 12, 0)
+        Nan::FatalException(try_catch);
+#else
+        FatalException(try_catch);
+#endif
+    }
+}
+
+// Bytes of a stream pinged for its header, when it is checked against the limits before it is decoded
+static const size_t StreamHeaderLength = 64 * 1024;
+
+// Formats whose decoders read the stream front to back. StreamSource only keeps a small window behind
+// the read position, and ImageMagick takes the FILE* for seekable, so decoders seeking further back
+// (TIFF's directories at the end, PSD, ...) must get the whole input instead.
+bool StreamsSequentially(const std::string &format) {
+    static const char* formats[] = { "JPEG", "JPG", "PNG", "GIF", "PNM", "PBM", "PGM", "PPM", "PAM" };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[ 0 ]); i++) {
+        if ( MagickCore::LocaleCompare( format.c_str(), formats[ i ] ) == 0 ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DoConvertStream(uv_work_t* req) {
+
+    convert_stream_im_ctx* context = static_cast<convert_stream_im_ctx*>(req->data);
+    context->Time("queueWait");
+
+    // controlled jobs stop waiting for the upload, or for the reader, once their call is cancelled or times out
+    context->source->Watch(context->control.get());
+    context->sink->Watch(context->control.get());
+    context->source->NotifyDrain(req, ConvertStreamData);
+
+    bool admission = NeedsAdmission(context);
+
+    // sniff the format from the first bytes, so the decoder reads the stream itself
+    // instead of ImageMagick copying it all to a temporary file to detect it.
+    // with limits, the header in the first bytes is pinged before the decoder starts
+    std::string head;
+    if ( context->srcFormat.empty() || admission ) {
+        head = context->source->Peek( admission ? StreamHeaderLength : 8192 );
+    }
+    if ( context->srcFormat.empty() ) {
+        if ( ! head.empty() ) {
+            MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
+            const MagickCore::MagicInfo *magicInfo = MagickCore::GetMagicInfo((const unsigned char *)head.data(), head.size(), exception);
+            if ( magicInfo != NULL ) {
+                context->srcFormat = MagickCore::GetMagicName(magicInfo);
+            }
+            MagickCore::DestroyExceptionInfo(exception);
+        }
+        if (context->debug) printf( "detected format: %s\n", context->srcFormat.c_str() );
+    }
+    // waiting for the first bytes of the upload
+    context->Time("input");
+    if ( context->control && context->control->interrupted ) {
+        return;
+    }
+
+    // lives until the image is converted
+    MemoryReservation reservation;
+    bool sequential = StreamsSequentially(context->srcFormat);
+    if ( sequential && admission ) {
+        bool pinged = false;
+        Magick::Image header;
+        header.magick( context->srcFormat.c_str() );
+        unsigned int hintWidth, hintHeight;
+        if ( DecodeSizeHint(context, &hintWidth, &hintHeight) ) {
+            SetDecodeSizeHint(&header, hintWidth, hintHeight, 0);
+        }
+        try {
+            header.ping( Magick::Blob( head.data(), head.size() ) );
+            pinged = true;
+        }
+        catch (Magick::Warning& warning) {
+            // the header was read
+            pinged = true;
+        }
+        catch (...) {
+        }
+        if ( pinged && header.columns() && header.rows() ) {
+            if ( !AdmitSize(header.columns(), header.rows(), &reservation, context) )
+                return;
+            context->Time("admission");
+        }
+        else {
+            // the header isn't in the first bytes, the whole input is admitted by DoConvert instead
+            sequential = false;
+        }
+    }
+
+    if ( ! sequential ) {
+        // the decoder would seek back further than the stream keeps, the format is unknown
+        // or its header couldn't be checked against the limits
+        if (context->debug) printf( "buffering the input\n" );
+        if ( ! context->source->ReadAll(&context->buffered) ) {
+            context->error = std::string("stream aborted");
+            return;
+        }
+        context->srcData = &context->buffered[ 0 ];
+        context->length  = context->buffered.size();
+        context->Time("input");
+    }
+    else {
+        context->srcFile = context->source->Open();
+    }
+
+    context->dstFile = context->sink->Open(req, ConvertStreamData);
+    if ( ( context->srcFile || context->srcData ) && context->dstFile ) {
+        DoConvert(req);
+    }
+    else {
+        context->error = std::string("unable to open stream");
+    }
+    if ( context->srcFile ) {
+        fclose( context->srcFile );
+    }
+    if ( context->dstFile ) {
+        // flushes the last chunk
+        fclose( context->dstFile );
+    }
+}
+
+void ConvertStreamAfter(uv_work_t* req) {
+    Nan::HandleScope scope;
+
+    convert_stream_im_ctx* context = static_cast<convert_stream_im_ctx*>(req->data);
+    delete req;
+
+    // the decoder may stop before the end of the input, drop whatever is still written
+    context->source->End(true);
+    context->source->Watch(NULL);
+    context->source->NotifyDrain(NULL, NULL);
+
+    Local<Value> argv[1];
+    if (!context->error.empty()) {
+        argv[0] = Exception::Error(Nan::New<String>(context->error.c_str()).ToLocalChecked());
+    }
+    else {
+        argv[0] = Nan::Undefined();
+    }
+
+    Nan::TryCatch try_catch;
+
+    ReportMetrics(context);
+
+    Nan::AsyncResource resource("ConvertStreamAfter");
+    context->callback->Call(1, argv, &resource);
+
+    delete context->callback;
+    delete context->onData;
+    delete context->onDrain;
+
+    delete context;
+
+    if (try_catch.HasCaught()) {
+#if NODE_VERSION_AT_LEAST(0, 12, 0)
+        Nan::FatalException(try_catch);
+#else
+        FatalException(try_catch);
+#endif
+    }
+}
+
+// input
+//   info[ 0 ]: options. required, the options of convert() except srcData and outputs
+//   info[ 1 ]: onData. required, called with each Buffer chunk of the encoded image as soon as it is produced
+//   info[ 2 ]: callback. required, called with (error) once the image is complete
+//   info[ 3 ]: onDrain. optional, called once the source took in what was written after write() returned false
+// returns an object to feed the source image with: write(buffer), end(), abort() and resume().
+// write() returns false once enough input waits to be decoded, onData returning false pauses the output until resume().
+// the job starts right away and decodes the source as it is written.
+NAN_METHOD(ConvertStream) {
+    Nan::HandleScope();
+
+    if ( info.Length() < 3 ) {
+        return Nan::ThrowError("convertStream() requires 3 (options, onData, callback) arguments!");
+    }
+    if ( ! info[ 0 ]->IsObject() ) {
+        return Nan::ThrowError("convertStream()'s 1st argument should be an object");
+    }
+    if ( ! info[ 1 ]->IsFunction() || ! info[ 2 ]->IsFunction() ) {
+        return Nan::ThrowError("convertStream()'s 2nd and 3rd arguments should be functions");
+    }
+
+    Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
+
+    convert_stream_im_ctx* context = new convert_stream_im_ctx();
+    const char* error = ParseConvertOptions(obj, context);
+    if ( ! error && context->multiOutput ) {
+        error = "convertStream() doesn't support \"outputs\"";
+    }
+    if ( ! error && ! context->pages.empty() ) {
+        error = "convertStream() doesn't support \"pages\"";
+    }
+    if ( ! error && context->region.width ) {
+        error = "convertStream() doesn't support \"srcRegion\"";
+    }
+    if ( ! error && context->fingerprint ) {
+        error = "convertStream() doesn't support \"fingerprint\"";
+    }
+    if ( ! error && context->animated ) {
+        error = "convertStream() doesn't support \"animated\"";
+    }
+    if ( error ) {
+        delete context;
+        return Nan::ThrowError(error);
+    }
+
+    context->source   = std::make_shared<StreamSource>();
+    context->sink     = std::make_shared<StreamSink>();
+    context->onData   = new Nan::Callback(Local<Function>::Cast(info[1]));
+    context->callback = new Nan::Callback(Local<Function>::Cast(info[2]));
+    if ( info.Length() > 3 && info[ 3 ]->IsFunction() ) {
+        context->onDrain = new Nan::Callback(Local<Function>::Cast(info[3]));
+    }
+
+    Local<Object> input = StreamInput::NewInstance(context->source, context->sink);
+
+    uv_work_t* req = new uv_work_t();
+    req->data = context;
+    QueueJob(req, DoConvertStream, ConvertStreamAfter);
+
+    info.GetReturnValue().Set(input);
+}
+#endif  // IMAGEMAGICK_NATIVE_STREAMS
+
+void IdentifyImage(Magick::Image *image, identify_im_ctx *context);
+
+void DoIdentify(uv_work_t* req) {
+
+    identify_im_ctx* context = static_cast<identify_im_ctx*>(req->data);
+    context->Time("queueWait");
+
+    SetThreadBudget(context->threads, context->debug);
+
+    std::unique_lock<std::mutex> loadedLock;
+    Magick::Image image;
+    if ( context->loaded ) {
+        UseLoadedImage(&image, &loadedLock, context);
+        IdentifyImage(&image, context);
+        return;
+    }
+
+    Magick::Blob srcBlob( context->srcData, context->length );
+
+    if( ! context->srcFormat.empty() ){
+        if (context->debug) printf( "reading with format: %s\n", context->srcFormat.c_str() );
+        image.magick( context->srcFormat.c_str() );
+    }
+
+    MemoryReservation reservation;
+    if ( ! context->ping && NeedsAdmission(context) ) {
+        Magick::Image header;
+        if ( ! context->srcFormat.empty() ) {
+            header.magick( context->srcFormat.c_str() );
+        }
+        if ( !AdmitImage(&header, srcBlob, &reservation, context) )
+            return;
+        context->Time("admission");
+    }
+
+    if ( context->control ) {
+        WatchImage(&image, context->control.get());
+    }
+    try {
+        if ( context->ping ) {
+            // only read the header, pixels are never decoded
+            if (context->debug) printf( "ping: true\n" );
+            image.ping( srcBlob );
+        }
+        else {
+            image.read( srcBlob );
+        }
+    }
+    catch (std::exception& err) {
+        std::string what (err.what());
+        std::string message = std::string("image.read failed with error: ") + what;
+        std::size_t found   = what.find( "warn" );
+        if (context->ignoreWarnings && (found != std::string::npos)) {
+            stats.WarningIgnored();
+            if (context->debug) printf("warning: %s\n", message.c_str());
+        }
+        else {
+            context->error = message;
+        }
+    }
+    catch (...) {
+        context->error = std::string("unhandled error");
+    }
+    if(!context->error.empty()) {
+        return;
+    }
+    if ( ! context->ping ) {
+        CountDecoded(image, context);
+    }
+    context->Time(context->ping ? "ping" : "decode");
+
+    IdentifyImage(&image, context);
+}
+
+// Reads the result of identify from image
+void IdentifyImage(Magick::Image *image, identify_im_ctx *context) {
+    if (context->debug) printf("original width,height: %d, %d\n", (int) image->columns(), (int) image->rows());
+
+    context->width      = image->columns();
+    context->height     = image->rows();
+    context->depth      = image->depth();
+    context->format     = image->magick();
+    context->colorspace = MagickCore::CommandOptionToMnemonic(MagickCore::MagickColorspaceOptions, static_cast<ssize_t>(image->colorSpace()));
+    Magick::Geometry density = image->density();
+    context->densityWidth  = density.width();
+    context->densityHeight = density.height();
+    context->orientation   = atoi(image->attribute("EXIF:Orientation").c_str());
+}
+
+void BuildIdentifyResult(uv_work_t *req, Local<Value> *argv) {
+    identify_im_ctx* context = static_cast<identify_im_ctx*>(req->data);
+
+    if (!context->error.empty()) {
+        argv[0] = Exception::Error(Nan::New<String>(context->error.c_str()).ToLocalChecked());
+        argv[1] = Nan::Undefined();
+    }
+    else {
+        argv[0] = Nan::Undefined();
+        Local<Object> out = Nan::New<Object>();
+
+        Nan::Set(out, Nan::New<String>("width").ToLocalChecked(), Nan::New<Integer>(static_cast<int>(context->width)));
+        Nan::Set(out, Nan::New<String>("height").ToLocalChecked(), Nan::New<Integer>(static_cast<int>(context->height)));
+        Nan::Set(out, Nan::New<String>("depth").ToLocalChecked(), Nan::New<Integer>(static_cast<int>(context->depth)));
+        Nan::Set(out, Nan::New<String>("format").ToLocalChecked(), Nan::New<String>(context->format.c_str()).ToLocalChecked());
+        Nan::Set(out, Nan::New<String>("colorspace").ToLocalChecked(), Nan::New<String>(context->colorspace.c_str()).ToLocalChecked());
+
+        Local<Object> out_density = Nan::New<Object>();
+        Nan::Set(out_density, Nan::New<String>("width").ToLocalChecked(), Nan::New<Integer>(static_cast<int>(context->densityWidth)));
+        Nan::Set(out_density, Nan::New<String>("height").ToLocalChecked(), Nan::New<Integer>(static_cast<int>(context->densityHeight)));
+        Nan::Set(out, Nan::New<String>("density").ToLocalChecked(), out_density);
+
+        Local<Object> out_exif = Nan::New<Object>();
+        Nan::Set(out_exif, Nan::New<String>("orientation").ToLocalChecked(), Nan::New<Integer>(context->orientation));
+        Nan::Set(out, Nan::New<String>("exif").ToLocalChecked(), out_exif);
+
+        argv[1] = out;
+    }
+}
+
+void IdentifyAfter(uv_work_t* req) {
+    Nan::HandleScope scope;
+
+    Local<Value> argv[2];
+    BuildIdentifyResult(req,argv);
+
+    identify_im_ctx* context = static_cast<identify_im_ctx*>(req->data);
+
+    Nan::TryCatch try_catch; // don't quite see the necessity of this
+
+    ReportMetrics(context);
+
+    Nan::AsyncResource resource("GeneratedBlobAfter");
+    context->callback->Call(2, argv, &resource);
+
+    delete context->callback;
+    delete context;
+    delete req;
+
+    if (try_catch.HasCaught()) {
+#if NODE_VERSION_AT_LEAST(0, 12, 0)
+        Nan::FatalException(try_catch);
+#else
+        FatalException(try_catch);
+#endif
+    }
+}
+
+// input
+//   info[ 0 ]: options. required, object with following key,values
+//              {
+//                  srcData:        required. Buffer with binary image data
+//                  srcPath:        optional. path of the image file instead of srcData, mapped and decoded by the worker
+//                  ping:           optional. default: false. read only the header, don't decode pixels
+//                  maxMemory:      optional. bytes. fail when the decoded image's pixel cache would be larger
+//                  maxPixels:      optional. fail when the decoded image would have more pixels
+//                  timeoutMs:      optional. fail with "job timed out" when the call takes longer, counted from the call
+//                  jobId:          optional. number. async calls can be stopped with cancel(jobId), failing with "job cancelled"
+//                  threads:        optional. threads ImageMagick may use for this call
+//                  priority:       optional. default: "interactive". worker pool lane of async calls, "interactive" or "batch"
+//                  metrics:        optional. function called with { stage: ms, ..., total: ms } before the result is returned
+//                  cache:          optional. default: true. false skips the result cache enabled by cache()
+//                  debug:          optional. 1 or 0
+//              }
+//   info[ 1 ]: callback. optional, if present runs async and returns result with callback(error, info)
+NAN_METHOD(Identify) {
+    Nan::HandleScope scope;
+
+    bool isSync = info.Length() == 1;
+
+    if ( info.Length() < 1 ) {
+        return Nan::ThrowError("identify() requires 1 (option) argument!");
+    }
+    Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
+
+    identify_im_ctx* context = new identify_im_ctx();
+    if ( ! ParseSource(obj, context) ) {
+        delete context;
+        return Nan::ThrowError("identify()'s 1st argument should have \"srcData\" key with a Buffer instance");
+    }
+
+    if( ! isSync && ! info[ 1 ]->IsFunction() ) {
+        delete context;
+        return Nan::ThrowError("identify()'s 2nd argument should be a function");
+    }
+
+    if ( ! context->error.empty() ) {
+        std::string error = context->error;
+        delete context;
+        return Nan::ThrowError(error.c_str());
+    }
+
+    context->debug = Nan::To<Uint32>(GetOption( obj, DebugKey )).ToLocalChecked()->Value();
+    context->ignoreWarnings = Nan::To<Uint32>(GetOption( obj, IgnoreWarningsKey )).ToLocalChecked()->Value();
+
+    Local<Value> srcFormatValue = GetOption( obj, SrcFormatKey );
+    context->srcFormat = !srcFormatValue->IsUndefined() ?
+        *Nan::Utf8String(srcFormatValue) : "";
+
+    Local<Value> pingValue = GetOption( obj, PingKey );
+    context->ping = ! pingValue->IsUndefined() && Nan::To<Boolean>(pingValue).ToLocalChecked()->IsTrue();
+
+    context->threads = Nan::To<Uint32>(GetOption( obj, ThreadsKey )).ToLocalChecked()->Value();
+    if ( ! ParsePriority(obj, context) ) {
+        delete context;
+        return Nan::ThrowError("priority not supported");
+    }
+    ParseLimits(obj, context);
+    ParseControl(obj, context);
+    ParseMetrics(obj, context);
+
+    if (context->debug) printf( "debug: on\n" );
+    if (context->debug) printf( "ignoreWarnings: %d\n", context->ignoreWarnings );
+
+    if ( UseCache(obj, context) ) {
+        std::string options = context->srcFormat + "\n" + std::to_string(context->ping) + std::to_string(context->ignoreWarnings);
+        context->cacheKey = MakeCacheKey("identify", options, context);
+    }
+
+    uv_work_t* req = new uv_work_t();
+    req->data = context;
+    if(!isSync) {
+        context->callback = new Nan::Callback(Local<Function>::Cast(info[1]));
+
+        QueueJob(req, DoIdentify, IdentifyAfter);
+
+        return;
+    } else {
+        RunJob(req, DoIdentify);
+        Local<Value> argv[2];
+        BuildIdentifyResult(req, argv);
+        ReportMetrics(context);
+        delete static_cast<identify_im_ctx*>(req->data);
+        delete req;
+        if(argv[0]->IsUndefined()){
+            info.GetReturnValue().Set(argv[1]);
+        } else {
+            return Nan::ThrowError(argv[0]);
+        }
+    }
+}
+
+// Extra context for getConstPixels' raw mode
+struct pixels_im_ctx : im_ctx_base {
+    unsigned int x;
+    unsigned int y;
+    unsigned int columns;
+    unsigned int rows;
+    std::string map;
+    unsigned int depth;
+    // filled in one pass by Magick::Image::write, handed to JS without copying
+    std::string pixels;
+
+    pixels_im_ctx() : x(0), y(0), columns(0), rows(0), depth(8) {
+        operation = GetConstPixelsOperation;
+    }
+};
+
+void DoGetPixels(uv_work_t* req) {
+
+    pixels_im_ctx* context = static_cast<pixels_im_ctx*>(req->data);
+
+    SetThreadBudget(context->threads, context->debug);
+
+    std::unique_lock<std::mutex> loadedLock;
+    Magick::Image image;
+    MemoryReservation reservation;
+    if ( context->loaded ) {
+        UseLoadedImage(&image, &loadedLock, context);
+    }
+    else if ( context->columns && context->rows ) {
+        // only the requested area is decoded
+        source_region region(context->x, context->y, context->columns, context->rows);
+        if ( !ReadRegion(&image, Magick::Blob( context->srcData, context->length ), region, "x/y/columns/rows values are beyond the image\'s dimensions", &reservation, context) )
+            return;
+        context->x = 0;
+        context->y = 0;
+    }
+    else {
+        Magick::Blob srcBlob( context->srcData, context->length );
+
+        if ( NeedsAdmission(context) ) {
+            Magick::Image header;
+            if ( ! context->srcFormat.empty() ) {
+                header.magick( context->srcFormat.c_str() );
+            }
+            if ( !AdmitImage(&header, srcBlob, &reservation, context) )
+                return;
+        }
+
+        if ( !ReadImageMagick(&image, srcBlob, context->srcFormat, context) )
+            return;
+    }
+
+    if (context->x + context->columns > image.columns() || context->y + context->rows > image.rows()) {
+        context->error = std::string("x/y/columns/rows values are beyond the image\'s dimensions");
+        return;
+    }
+
+    MagickCore::StorageType storage;
+    size_t bytesPerSample;
+    switch ( context->depth ) {
+        case 16: storage = MagickCore::ShortPixel; bytesPerSample = 2; break;
+        case 32: storage = MagickCore::FloatPixel; bytesPerSample = 4; break;
+        default: storage = MagickCore::CharPixel;  bytesPerSample = 1; break;
+    }
+    context->pixels.resize( (size_t) context->columns * context->rows * context->map.size() * bytesPerSample );
+    if ( context->pixels.empty() ) {
+        return;
+    }
+
+    try {
+        image.write( context->x, context->y, context->columns, context->rows, context->map, storage, &context->pixels[ 0 ] );
+    }
+    catch (std::exception& err) {
+        context->error = std::string("image.write failed with error: ") + err.what();
+    }
+    catch (...) {
+        context->error = std::string("unhandled error");
+    }
+}
+
+void BuildPixelsResult(uv_work_t *req, Local<Value> *argv) {
+    pixels_im_ctx* context = static_cast<pixels_im_ctx*>(req->data);
+
+    if (!context->error.empty()) {
+        argv[0] = Exception::Error(Nan::New<String>(context->error.c_str()).ToLocalChecked());
+        argv[1] = Nan::Undefined();
+        return;
+    }
+    argv[0] = Nan::Undefined();
+
+    size_t length = context->pixels.size();
+    Local<ArrayBuffer> arrayBuffer = Local<Uint8Array>::Cast(WrapString(&context->pixels))->Buffer();
+    switch ( context->depth ) {
+        case 16: argv[1] = Uint16Array::New(arrayBuffer, 0, length / 2); break;
+        case 32: argv[1] = Float32Array::New(arrayBuffer, 0, length / 4); break;
+        default: argv[1] = Uint8Array::New(arrayBuffer, 0, length); break;
+    }
+}
+
+void PixelsAfter(uv_work_t* req) {
+    Nan::HandleScope scope;
+
+    Local<Value> argv[2];
+    BuildPixelsResult(req, argv);
+
+    pixels_im_ctx* context = static_cast<pixels_im_ctx*>(req->data);
+
+    Nan::TryCatch try_catch;
+
+    ReportMetrics(context);
+
+    Nan::AsyncResource resource("PixelsAfter");
+    context->callback->Call(2, argv, &resource);
+
+    delete context->callback;
+    delete context;
+    delete req;
+
+    if (try_catch.HasCaught()) {
+#if NODE_VERSION_AT_LEAST(0, 12, 0)
+        Nan::FatalException(try_catch);
+#else
+        FatalException(try_catch);
+#endif
+    }
+}
+
+// input
+//   info[ 0 ]: options. required, object with following key,values
+//              {
+//                  srcData:        required. Buffer with binary image data
+//                  srcPath:        optional. path of the image file instead of srcData, mapped and decoded by the worker
+//                  x:              required. x,y,columns,rows provide the area of interest, the only part of
+//                                  JPEG, stripped TIFF and PNM sources that is decoded.
+//                  y:              required.
+//                  columns:        required.
+//                  rows:           required.
+//                  map:            optional. channel order of raw mode, ex: "RGB", "RGBA", "I" (or "Gray")
+//                  depth:          optional. default: 8. raw mode sample type, 8: Uint8Array, 16: Uint16Array, 32: Float32Array of 0-1 floats
+//                  threads:        optional. threads ImageMagick may use for this call
+//                  priority:       optional. default: "interactive". worker pool lane of async calls, "interactive" or "batch"
+//                  maxMemory:      optional. bytes. fail when the decoded image's pixel cache would be larger
+//                  maxPixels:      optional. fail when the decoded image would have more pixels
+//                  timeoutMs:      optional. fail with "job timed out" when the call takes longer, counted from the call
+//                  jobId:          optional. number. async calls can be stopped with cancel(jobId), failing with "job cancelled"
+//              }
+//   info[ 1 ]: callback. optional, raw mode only. if present runs async and returns result with callback(error, pixels)
+// without "map" returns an Array of { red, green, blue, opacity } objects,
+// with "map" returns a typed array of the region's samples in map order, filled in one pass
+NAN_METHOD(GetConstPixels) {
+    Nan::HandleScope();
+
+    if ( info.Length() < 1 ) {
+        return Nan::ThrowError("getConstPixels() requires 1 (option) argument!");
+    }
+    bool isSync = info.Length() == 1;
+    if ( ! isSync && ! info[ 1 ]->IsFunction() ) {
+        return Nan::ThrowError("getConstPixels()'s 2nd argument should be a function");
+    }
+    Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
+
+    im_ctx_base source;
+    source.operation = GetConstPixelsOperation;
+    if ( ! ParseSource(obj, &source) ) {
+        return Nan::ThrowError("getConstPixels()'s 1st argument should have \"srcData\" key with a Buffer instance");
+    }
+    if ( ! source.error.empty() ) {
+        return Nan::ThrowError(source.error.c_str());
+    }
+
+    unsigned int xValue       = Nan::To<Uint32>(GetOption( obj, XKey )).ToLocalChecked()->Value();
+    unsigned int yValue       = Nan::To<Uint32>(GetOption( obj, YKey )).ToLocalChecked()->Value();
+    unsigned int columnsValue = Nan::To<Uint32>(GetOption( obj, ColumnsKey )).ToLocalChecked()->Value();
+    unsigned int rowsValue    = Nan::To<Uint32>(GetOption( obj, RowsKey )).ToLocalChecked()->Value();
+
+    int debug          = Nan::To<Uint32>(GetOption( obj, DebugKey )).ToLocalChecked()->Value();
+    int ignoreWarnings = Nan::To<Uint32>(GetOption( obj, IgnoreWarningsKey )).ToLocalChecked()->Value();
+    if (debug) printf( "debug: on\n" );
+    if (debug) printf( "ignoreWarnings: %d\n", ignoreWarnings );
+
+    Local<Value> mapValue = GetOption( obj, MapKey );
+    if ( ! mapValue->IsUndefined() ) {
+        pixels_im_ctx* context = new pixels_im_ctx();
+        context->srcData        = source.srcData;
+        context->length         = source.length;
+        context->srcPath        = source.srcPath;
+        context->loaded         = source.loaded;
+        context->debug          = debug;
+        context->ignoreWarnings = ignoreWarnings;
+        context->x              = xValue;
+        context->y              = yValue;
+        context->columns        = columnsValue;
+        context->rows           = rowsValue;
+
+        context->map = *Nan::Utf8String(mapValue);
+        if ( context->map == "Gray" || context->map == "gray" ) {
+            context->map = "I";
+        }
+        if ( context->map.empty() || context->map.find_first_not_of("RGBAOCMYKIP") != std::string::npos ) {
+            delete context;
+            return Nan::ThrowError("map not supported");
+        }
+
+        Local<Value> depthValue = GetOption( obj, DepthKey );
+        if ( ! depthValue->IsUndefined() ) {
+            context->depth = Nan::To<Uint32>(depthValue).ToLocalChecked()->Value();
+        }
+        if ( context->depth != 8 && context->depth != 16 && context->depth != 32 ) {
+            delete context;
+            return Nan::ThrowError("depth not supported");
+        }
+
+        context->threads = Nan::To<Uint32>(GetOption( obj, ThreadsKey )).ToLocalChecked()->Value();
+        if ( ! ParsePriority(obj, context) ) {
+            delete context;
+            return Nan::ThrowError("priority not supported");
+        }
+        ParseLimits(obj, context);
+        ParseControl(obj, context);
+
+        uv_work_t* req = new uv_work_t();
+        req->data = context;
+        if ( ! isSync ) {
+            context->callback = new Nan::Callback(Local<Function>::Cast(info[1]));
+
+            QueueJob(req, DoGetPixels, PixelsAfter);
+
+            return;
+        }
+        RunJob(req, DoGetPixels);
+        Local<Value> argv[2];
+        BuildPixelsResult(req, argv);
+        ReportMetrics(context);
+        delete context;
+        delete req;
+        if ( argv[0]->IsUndefined() ) {
+            info.GetReturnValue().Set(argv[1]);
+        } else {
+            return Nan::ThrowError(argv[0]);
+        }
+        return;
+    }
+    if ( ! isSync ) {
+        return Nan::ThrowError("getConstPixels() runs async only with \"map\"");
+    }
+
+    SetThreadBudget(Nan::To<Uint32>(GetOption( obj, ThreadsKey )).ToLocalChecked()->Value(), debug);
+
+    MappedFile srcFile;
+    if ( ! source.srcPath.empty() ) {
+        if ( ! srcFile.Open(source.srcPath, &source.error) ) {
+            ReportMetrics(&source);
+            return Nan::ThrowError(source.error.c_str());
+        }
+        source.srcData = srcFile.data;
+        source.length  = srcFile.length;
+    }
+
+    std::unique_lock<std::mutex> loadedLock;
+    Magick::Image image;
+    MemoryReservation reservation;
+    if ( source.loaded ) {
+        UseLoadedImage(&image, &loadedLock, &source);
+    }
+    else if ( columnsValue && rowsValue ) {
+        // only the requested area is decoded
+        source.debug = debug;
+        source.ignoreWarnings = ignoreWarnings;
+        ParseLimits(obj, &source);
+        source_region region(xValue, yValue, columnsValue, rowsValue);
+        if ( !ReadRegion(&image, Magick::Blob( source.srcData, source.length ), region, "x/y/columns/rows values are beyond the image\'s dimensions", &reservation, &source) ) {
+            ReportMetrics(&source);
+            return Nan::ThrowError(source.error.c_str());
+        }
+        xValue = 0;
+        yValue = 0;
+    }
+    else {
+        Magick::Blob srcBlob( source.srcData, source.length );
+
+        source.debug = debug;
+        ParseLimits(obj, &source);
+        if ( NeedsAdmission(&source) ) {
+            Magick::Image header;
+            if ( !AdmitImage(&header, srcBlob, &reservation, &source) ) {
+                ReportMetrics(&source);
+                return Nan::ThrowError(source.error.c_str());
+            }
+        }
+
+        try {
+            image.read( srcBlob );
+        }
+        catch (std::exception& err) {
+            std::string what (err.what());
+            std::string message = std::string("image.read failed with error: ") + what;
+            std::size_t found   = what.find( "warn" );
+            if (ignoreWarnings && (found != std::string::npos)) {
+                stats.WarningIgnored();
+                if (debug) printf("warning: %s\n", message.c_str());
             }
             else {
-                // expected is wider
-                resizewidth  = width;
-                resizeheight = (unsigned int)( (double)width / (double)image.columns() * (double)image.rows() + 1. );
-                xoffset = 0;
-                if ( strstr(gravity, "North") != NULL ) {
-                    yoffset = 0;
-                }
-                else if ( strstr(gravity, "South") != NULL ) {
-                    yoffset = (unsigned int)( resizeheight - height );
-                }
-                else {
-                    yoffset = (unsigned int)( (resizeheight - height) / 2. );
-                }
+                source.error = message;
             }
+        }
+        catch (...) {
+            source.error = std::string("unhandled error");
+        }
+        if ( ! source.error.empty() ) {
+            ReportMetrics(&source);
+            return Nan::ThrowError(source.error.c_str());
+        }
+        CountDecoded(image, &source);
+    }
+
+    size_t w = image.columns();
+    size_t h = image.rows();
+
+    if (xValue+columnsValue > w || yValue+rowsValue > h) {
+        source.error = std::string("x/y/columns/rows values are beyond the image\'s dimensions");
+        ReportMetrics(&source);
+        return Nan::ThrowError(source.error.c_str());
+    }
+
+    const Magick::PixelPacket *pixels = image.getConstPixels(xValue, yValue, columnsValue, rowsValue);
+
+    Local<Object> out = Nan::New<Array>();
+    for (unsigned int i=0; i<columnsValue * rowsValue; i++) {
+        Magick::PixelPacket pixel = pixels[ i ];
+        Local<Object> color = Nan::New<Object>();
+
+        Nan::Set(color, Nan::New<String>("red").ToLocalChecked(),     Nan::New<Integer>(pixel.red));
+        Nan::Set(color, Nan::New<String>("green").ToLocalChecked(),   Nan::New<Integer>(pixel.green));
+        Nan::Set(color, Nan::New<String>("blue").ToLocalChecked(),    Nan::New<Integer>(pixel.blue));
+        Nan::Set(color, Nan::New<String>("opacity").ToLocalChecked(), Nan::New<Integer>(pixel.opacity));
+
+        Nan::Set(out, i, color);
+    }
+
+    ReportMetrics(&source);
+    info.GetReturnValue().Set(out);
+}
+
+// One color of a quantized palette and how many pixels use it
+struct quantized_color {
+    Magick::PixelPacket pixel;
+    size_t count;
+};
+
+// Extra context for quantizeColors
+struct quantize_im_ctx : im_ctx_base {
+    unsigned int colorsCount;
+    bool shrinkOnLoad;
+    // in order of first appearance, scanning rows top to bottom
+    std::vector<quantized_color> colors;
+    size_t totalPixels;
+
+    quantize_im_ctx() : colorsCount(5), shrinkOnLoad(true), totalPixels(0) {
+        operation = QuantizeColorsOperation;
+    }
+};
+
+void DoQuantizeColors(uv_work_t* req) {
+
+    quantize_im_ctx* context = static_cast<quantize_im_ctx*>(req->data);
+
+    int debug = context->debug;
 
-            if (debug) printf( "resize to: %d, %d\n", resizewidth, resizeheight );
-            Magick::Geometry resizeGeometry( resizewidth, resizeheight, 0, 0, 0, 0 );
-            try {
-                image.zoom( resizeGeometry );
-            }
-            catch (std::exception& err) {
-                std::string message = "image.resize failed with error: ";
-                message            += err.what();
-                context->error = message;
-                return;
+    SetThreadBudget(context->threads, debug);
+
+    // the palette is computed on a 196x196 thumbnail, the decoder doesn't need to produce more
+    const unsigned int size = 196;
+
+    std::unique_lock<std::mutex> loadedLock;
+    Magick::Image image;
+    MemoryReservation reservation;
+    if ( context->loaded ) {
+        UseLoadedImage(&image, &loadedLock, context);
+    }
+    else {
+        Magick::Blob srcBlob( context->srcData, context->length );
+
+        if ( context->shrinkOnLoad ) {
+            SetDecodeSizeHint(&image, size, size, debug);
+        }
+
+        if ( NeedsAdmission(context) ) {
+            Magick::Image header;
+            if ( context->shrinkOnLoad ) {
+                SetDecodeSizeHint(&header, size, size, 0);
             }
-            catch (...) {
-                context->error = std::string("unhandled error");
+            if ( !AdmitImage(&header, srcBlob, &reservation, context) )
                 return;
-            }
+        }
 
-            if ( strcmp ( gravity, "None" ) != 0 ) {
-                // limit canvas size to cropGeometry
-                if (debug) printf( "crop to: %d, %d, %d, %d\n", width, height, xoffset, yoffset );
-                Magick::Geometry cropGeometry( width, height, xoffset, yoffset, 0, 0 );
+        if ( !ReadImageMagick(&image, srcBlob, context->srcFormat, context) )
+            return;
+    }
 
-                Magick::Color transparent( "transparent" );
-                if ( strcmp( context->format.c_str(), "PNG" ) == 0 ) {
-                    // make background transparent for PNG
-                    // JPEG background becomes black if set transparent here
-                    transparent.alpha( 1. );
-                }
+    try {
+        if (debug) printf( "resize to: %d, %d\n", (int) size, (int) size );
+        Magick::Geometry resizeGeometry( size, size, 0, 0, 0, 0 );
+        image.zoom( resizeGeometry );
 
-                #if MagickLibVersion > 0x654
-                    image.extent( cropGeometry, transparent );
-                #else
-                    image.extent( cropGeometry );
-                #endif
-            }
+        if (debug) printf("totalColors before: %d\n", (int) image.totalColors());
+
+        image.quantizeColors(context->colorsCount + 1);
+        image.quantize();
+
+        if (debug) printf("totalColors after: %d\n", (int) image.totalColors());
+    }
+    catch (std::exception& err) {
+        context->error = err.what();
+        return;
+    }
+    catch (...) {
+        context->error = std::string("unhandled error");
+        return;
+    }
 
+    // zoom keeps the aspect ratio, walk the image's actual dimensions
+    size_t columns = image.columns();
+    size_t rows    = image.rows();
+    const Magick::PixelPacket* pixels = image.getConstPixels(0, 0, columns, rows);
+    context->totalPixels = columns * rows;
+
+    // histogram of the quantized colors, hashed on the rgb triple
+    std::unordered_map<uint64_t, size_t> indexes;
+    for ( size_t i = 0; i < context->totalPixels; i++ ) {
+        const Magick::PixelPacket& pixel = pixels[ i ];
+        uint64_t key = ( (uint64_t) (unsigned int) pixel.red << 32 ) |
+                       ( (uint64_t) (unsigned int) pixel.green << 16 ) |
+                         (uint64_t) (unsigned int) pixel.blue;
+        std::unordered_map<uint64_t, size_t>::iterator found = indexes.find(key);
+        if ( found != indexes.end() ) {
+            context->colors[ found->second ].count++;
+            continue;
         }
-        else if ( strcmp ( resizeStyle, "aspectfit" ) == 0 ) {
-            // keep aspect ratio, get the maximum image which fits inside specified size
-            char geometryString[ 32 ];
-            sprintf( geometryString, "%dx%d", width, height );
-            if (debug) printf( "resize to: %s\n", geometryString );
+        indexes[ key ] = context->colors.size();
+        quantized_color color = { pixel, 1 };
+        context->colors.push_back(color);
+    }
 
-            try {
-                image.zoom( geometryString );
-            }
-            catch (std::exception& err) {
-                std::string message = "image.resize failed with error: ";
-                message            += err.what();
-                context->error = message;
+    if ( context->colors.size() > context->colorsCount ) {
+        context->colors.resize(context->colorsCount);
+    }
+}
+
+void BuildQuantizeResult(uv_work_t *req, Local<Value> *argv) {
+    quantize_im_ctx* context = static_cast<quantize_im_ctx*>(req->data);
+
+    if (!context->error.empty()) {
+        argv[0] = Exception::Error(Nan::New<String>(context->error.c_str()).ToLocalChecked());
+        argv[1] = Nan::Undefined();
+        return;
+    }
+    argv[0] = Nan::Undefined();
+
+    Local<Object> out = Nan::New<Array>();
+
+    for(size_t x = 0; x < context->colors.size(); x++) {
+        const quantized_color& found = context->colors[ x ];
+        Local<Object> color = Nan::New<Object>();
+
+        int r = ((int) found.pixel.red) / 255;
+        if (r > 255) r = 255;
+
+        int g = ((int) found.pixel.green) / 255;
+        if (g > 255) g = 255;
+
+        int b = ((int) found.pixel.blue) / 255;
+        if (b > 255) b = 255;
+
+        if (context->debug) printf("found rgb : %d %d %d\n", r, g, b);
+
+        Nan::Set(color, Nan::New<String>("r").ToLocalChecked(), Nan::New<Integer>(r));
+        Nan::Set(color, Nan::New<String>("g").ToLocalChecked(), Nan::New<Integer>(g));
+        Nan::Set(color, Nan::New<String>("b").ToLocalChecked(), Nan::New<Integer>(b));
+
+        char hexcol[16];
+        snprintf(hexcol, sizeof hexcol, "%02x%02x%02x", r, g, b);
+        Nan::Set(color, Nan::New<String>("hex").ToLocalChecked(), Nan::New<String>(hexcol).ToLocalChecked());
+
+        Nan::Set(color, Nan::New<String>("count").ToLocalChecked(), Nan::New<Number>((double) found.count));
+        Nan::Set(color, Nan::New<String>("percent").ToLocalChecked(), Nan::New<Number>(100.0 * found.count / context->totalPixels));
+
+        Nan::Set(out, x, color);
+    }
+
+    argv[1] = out;
+}
+
+void QuantizeColorsAfter(uv_work_t* req) {
+    Nan::HandleScope scope;
+
+    Local<Value> argv[2];
+    BuildQuantizeResult(req, argv);
+
+    quantize_im_ctx* context = static_cast<quantize_im_ctx*>(req->data);
+
+    Nan::TryCatch try_catch;
+
+    ReportMetrics(context);
+
+    Nan::AsyncResource resource("QuantizeColorsAfter");
+    context->callback->Call(2, argv, &resource);
+
+    delete context->callback;
+    delete context;
+    delete req;
+
+    if (try_catch.HasCaught()) {
+#if NODE_VERSION_AT_LEAST(0, 12, 0)
+        Nan::FatalException(try_catch);
+#else
+        FatalException(try_catch);
+#endif
+    }
+}
+
+// input
+//   info[ 0 ]: options. required, object with following key,values
+//              {
+//                  srcData:        required. Buffer with binary image data
+//                  srcPath:        optional. path of the image file instead of srcData, mapped and decoded by the worker
+//                  colors:         optional. 5 by default
+//                  shrinkOnLoad:   optional. default: true. let the JPEG decoder downscale while reading
+//                  threads:        optional. threads ImageMagick may use for this call
+//                  priority:       optional. default: "interactive". worker pool lane of async calls, "interactive" or "batch"
+//                  maxMemory:      optional. bytes. fail when the decoded image's pixel cache would be larger
+//                  maxPixels:      optional. fail when the decoded image would have more pixels
+//                  timeoutMs:      optional. fail with "job timed out" when the call takes longer, counted from the call
+//                  jobId:          optional. number. async calls can be stopped with cancel(jobId), failing with "job cancelled"
+//                  debug:          optional. 1 or 0
+//              }
+//   info[ 1 ]: callback. optional, if present runs async and returns result with callback(error, colors)
+NAN_METHOD(QuantizeColors) {
+    Nan::HandleScope();
+
+    bool isSync = info.Length() == 1;
+
+    if ( info.Length() < 1 ) {
+        return Nan::ThrowError("quantizeColors() requires 1 (option) argument!");
+    }
+    Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
+
+    quantize_im_ctx* context = new quantize_im_ctx();
+    if ( ! ParseSource(obj, context) ) {
+        delete context;
+        return Nan::ThrowError("quantizeColors()'s 1st argument should have \"srcData\" key with a Buffer instance");
+    }
+
+    if( ! isSync && ! info[ 1 ]->IsFunction() ) {
+        delete context;
+        return Nan::ThrowError("quantizeColors()'s 2nd argument should be a function");
+    }
+
+    if ( ! context->error.empty() ) {
+        std::string error = context->error;
+        delete context;
+        return Nan::ThrowError(error.c_str());
+    }
+
+    context->colorsCount = Nan::To<Uint32>(GetOption( obj, ColorsKey )).ToLocalChecked()->Value();
+    if (!context->colorsCount) context->colorsCount = 5;
+
+    context->debug = Nan::To<Uint32>(GetOption( obj, DebugKey )).ToLocalChecked()->Value();
+    context->ignoreWarnings = Nan::To<Uint32>(GetOption( obj, IgnoreWarningsKey )).ToLocalChecked()->Value();
+    if (context->debug) printf( "debug: on\n" );
+    if (context->debug) printf( "ignoreWarnings: %d\n", context->ignoreWarnings );
+
+    Local<Value> shrinkOnLoadValue = GetOption( obj, ShrinkOnLoadKey );
+    context->shrinkOnLoad = shrinkOnLoadValue->IsUndefined() || Nan::To<Boolean>(shrinkOnLoadValue).ToLocalChecked()->IsTrue();
+
+    context->threads = Nan::To<Uint32>(GetOption( obj, ThreadsKey )).ToLocalChecked()->Value();
+    if ( ! ParsePriority(obj, context) ) {
+        delete context;
+        return Nan::ThrowError("priority not supported");
+    }
+    ParseLimits(obj, context);
+    ParseControl(obj, context);
+
+    uv_work_t* req = new uv_work_t();
+    req->data = context;
+    if(!isSync) {
+        context->callback = new Nan::Callback(Local<Function>::Cast(info[1]));
+
+        QueueJob(req, DoQuantizeColors, QuantizeColorsAfter);
+
+        return;
+    } else {
+        RunJob(req, DoQuantizeColors);
+        Local<Value> argv[2];
+        BuildQuantizeResult(req, argv);
+        ReportMetrics(context);
+        delete context;
+        delete req;
+        if(argv[0]->IsUndefined()){
+            info.GetReturnValue().Set(argv[1]);
+        } else {
+            return Nan::ThrowError(argv[0]);
+        }
+    }
+}
+
+void DoComposite(uv_work_t* req) {
+
+    composite_im_ctx* context = static_cast<composite_im_ctx*>(req->data);
+    context->Time("queueWait");
+
+    if (context->debug) printf( "debug: on\n" );
+    if (context->debug) printf( "ignoreWarnings: %d\n", context->ignoreWarnings );
+
+    SetThreadBudget(context->threads, context->debug);
+
+    std::unique_lock<std::mutex> loadedLock;
+    Magick::Image image;
+    MemoryReservation reservation;
+    if ( context->loaded ) {
+        UseLoadedImage(&image, &loadedLock, context);
+    }
+    else {
+        Magick::Blob srcBlob( context->srcData, context->length );
+
+        if ( NeedsAdmission(context) ) {
+            Magick::Image header;
+            if ( !AdmitImage(&header, srcBlob, &reservation, context) )
                 return;
-            }
-            catch (...) {
-                context->error = std::string("unhandled error");
+        }
+
+        if ( !ReadImageMagick(&image, srcBlob, "", context) )
+            return;
+    }
+    if ( NeedsAdmission(context) ) {
+        for (size_t i = 0; i < context->layers.size(); i++) {
+            if ( !context->layers[ i ].overlay->Admit(&reservation, context) )
                 return;
+        }
+        context->Time("admission");
+    }
+    context->Time("decode");
+
+    for (size_t i = 0; i < context->layers.size(); i++) {
+        const composite_layer &layer = context->layers[ i ];
+
+        Magick::Image overlay;
+        if ( !layer.overlay->Acquire(&overlay, context) )
+            return;
+        context->Time("overlay");
+
+        try {
+            Magick::Image stamp = overlay;
+            if ( layer.opacity < 1 ) {
+                // scales the alpha of a copy, the overlay's copy is shared with later jobs
+                stamp.matte(true);
+                stamp.evaluate(Magick::AlphaChannel, Magick::MultiplyEvaluateOperator, layer.opacity);
             }
+
+            MagickCore::RectangleInfo geometry;
+            MagickCore::SetGeometry(stamp.constImage(), &geometry);
+            geometry.x = layer.x;
+            geometry.y = layer.y;
+            MagickCore::GravityAdjustGeometry(image.columns(), image.rows(), layer.gravity, &geometry);
+            if (context->debug) printf( "layer %d: gravity %d at %ld,%ld\n", (int) i, (int) layer.gravity, (long) geometry.x, (long) geometry.y );
+
+            image.composite(stamp, geometry.x, geometry.y, layer.compose);
         }
-        else if ( strcmp ( resizeStyle, "fill" ) == 0 ) {
-            // change aspect ratio and fill specified size
-            char geometryString[ 32 ];
-            sprintf( geometryString, "%dx%d!", width, height );
-            if (debug) printf( "resize to: %s\n", geometryString );
+        catch (std::exception& err) {
+            context->error = err.what();
+        }
+        catch (...) {
+            context->error = std::string("unhandled error");
+        }
+        layer.overlay->Release(overlay);
+        if ( ! context->error.empty() )
+            return;
+        context->Time("composite");
+    }
 
-            try {
-                image.zoom( geometryString );
+    Magick::Blob dstBlob;
+    image.write( &dstBlob );
+    context->Time("encode");
+
+    context->dstBlob = dstBlob;
+}
+
+// Reads a gravity of composite, "SouthEast" or "SouthEastGravity"
+bool ParseCompositeGravity(const std::string &name, Magick::GravityType *gravity) {
+    static const std::string suffix = "Gravity";
+    std::string option = name;
+    if ( option.size() > suffix.size() && option.compare(option.size() - suffix.size(), suffix.size(), suffix) == 0 ) {
+        option.erase(option.size() - suffix.size());
+    }
+    ssize_t type = MagickCore::ParseCommandOption(MagickCore::MagickGravityOptions, MagickCore::MagickFalse, option.c_str());
+    if ( type == -1 ) {
+        return false;
+    }
+    *gravity = (Magick::GravityType) type;
+    return true;
+}
+
+// Reads one entry of the "layers" option, returns an error message or NULL
+const char* ParseCompositeLayer(Local<Object> obj, composite_layer *layer) {
+    Local<Value> overlayValue = GetOption( obj, OverlayKey );
+    if ( ! overlayValue->IsUndefined() ) {
+        std::unordered_map< std::string, std::shared_ptr<Overlay> >::iterator found = overlays.find(*Nan::Utf8String(overlayValue));
+        if ( found == overlays.end() ) {
+            return "overlay not registered";
+        }
+        layer->overlay = found->second;
+    }
+    else {
+        Local<Value> compositeData = GetOption( obj, CompositeDataKey );
+        if ( ! Buffer::HasInstance(compositeData) ) {
+            return "composite()'s layers should have an \"overlay\" id or a \"compositeData\" Buffer";
+        }
+        layer->overlay = std::make_shared<Overlay>(Buffer::Data(compositeData), Buffer::Length(compositeData), false);
+    }
+
+    Local<Value> gravityValue = GetOption( obj, GravityKey );
+    if ( ! gravityValue->IsUndefined() && ! ParseCompositeGravity(*Nan::Utf8String(gravityValue), &layer->gravity) ) {
+        return "gravity not supported";
+    }
+
+    Local<Value> xValue = GetOption( obj, XKey );
+    if ( ! xValue->IsUndefined() ) layer->x = Nan::To<int32_t>(xValue).FromJust();
+
+    Local<Value> yValue = GetOption( obj, YKey );
+    if ( ! yValue->IsUndefined() ) layer->y = Nan::To<int32_t>(yValue).FromJust();
+
+    Local<Value> opacityValue = GetOption( obj, OpacityKey );
+    if ( ! opacityValue->IsUndefined() ) {
+        layer->opacity = Nan::To<double>(opacityValue).FromJust();
+        if ( ! ( layer->opacity >= 0 && layer->opacity <= 1 ) ) {
+            return "opacity should be between 0 and 1";
+        }
+    }
+
+    Local<Value> composeValue = GetOption( obj, ComposeKey );
+    if ( ! composeValue->IsUndefined() ) {
+        ssize_t compose = MagickCore::ParseCommandOption(MagickCore::MagickComposeOptions, MagickCore::MagickFalse, *Nan::Utf8String(composeValue));
+        if ( compose == -1 ) {
+            return "compose not supported";
+        }
+        layer->compose = (Magick::CompositeOperator) compose;
+    }
+    return NULL;
+}
+
+// Reads the "layers" option, or the single layer of the top level "compositeData" and "gravity".
+// Returns an error message or NULL.
+const char* ParseCompositeLayers(Local<Object> obj, composite_im_ctx *context) {
+    Local<Value> layersValue = GetOption( obj, LayersKey );
+    if ( layersValue->IsArray() ) {
+        Local<Array> layers = Local<Array>::Cast(layersValue);
+        if ( layers->Length() == 0 ) {
+            return "composite()'s \"layers\" should not be empty";
+        }
+        for (uint32_t i = 0; i < layers->Length(); i++) {
+            Local<Value> layerValue = Nan::Get(layers, i).ToLocalChecked();
+            if ( ! layerValue->IsObject() ) {
+                return "composite()'s layers should be objects";
             }
-            catch (std::exception& err) {
-                std::string message = "image.resize failed with error: ";
-                message            += err.what();
-                context->error = message;
-                return;
+            composite_layer layer;
+            const char* error = ParseCompositeLayer(Local<Object>::Cast(layerValue), &layer);
+            if ( error ) {
+                return error;
             }
-            catch (...) {
-                context->error = std::string("unhandled error");
-                return;
+            context->layers.push_back(layer);
+        }
+        return NULL;
+    }
+
+    Local<Value> compositeData = GetOption( obj, CompositeDataKey );
+    if ( ! Buffer::HasInstance(compositeData) ) {
+        return "composite()'s 1st argument should have \"compositeData\" key with a Buffer instance";
+    }
+    composite_layer layer;
+    layer.overlay = std::make_shared<Overlay>(Buffer::Data(compositeData), Buffer::Length(compositeData), false);
+    // an unknown top level gravity composites at the top left corner, as it always did
+    Local<Value> gravityValue = GetOption( obj, GravityKey );
+    if ( ! gravityValue->IsUndefined() && ! ParseCompositeGravity(*Nan::Utf8String(gravityValue), &layer.gravity) ) {
+        if (context->debug) printf( "invalid gravity: '%s' fell through to ForgetGravity\n", *Nan::Utf8String(gravityValue) );
+    }
+    context->layers.push_back(layer);
+    return NULL;
+}
+
+// The options of composite that affect its result, overlays by the hash of their encoded bytes
+std::string CompositeCacheOptions(composite_im_ctx *context) {
+    char line[ 128 ];
+    std::string options = std::to_string(context->ignoreWarnings);
+    for (size_t i = 0; i < context->layers.size(); i++) {
+        const composite_layer &layer = context->layers[ i ];
+        snprintf(line, sizeof(line), " %d %ld %ld %.17g %d",
+            (int) layer.gravity, (long) layer.x, (long) layer.y, layer.opacity, (int) layer.compose);
+        options += "\n" + layer.overlay->Hash() + line;
+    }
+    return options;
+}
+
+// Composites the layers of settings onto every Buffer of sources, one job per source
+void CompositeBatch(const Nan::FunctionCallbackInfo<Value>& info, Local<Array> sources, composite_im_ctx *settings, bool cached) {
+    bool isSync = (info.Length() == 1);
+
+    if ( sources->Length() == 0 ) {
+        return Nan::ThrowError("composite()'s \"srcData\" array should not be empty");
+    }
+
+    std::vector<im_ctx_base*> contexts;
+    for (uint32_t i = 0; i < sources->Length(); i++) {
+        Local<Value> srcData = Nan::Get(sources, i).ToLocalChecked();
+        if ( ! Buffer::HasInstance(srcData) ) {
+            for (size_t j = 0; j < contexts.size(); j++) {
+                delete contexts[ j ];
             }
+            return Nan::ThrowError("composite()'s \"srcData\" array should only have Buffer instances");
         }
-         else if ( strcmp ( resizeStyle, "crop" ) == 0 ) {
-             unsigned int xoffset = context->xoffset;
-             unsigned int yoffset = context->yoffset;
+        composite_im_ctx* context = new composite_im_ctx(*settings);
+        context->srcData = Buffer::Data(srcData);
+        context->length = Buffer::Length(srcData);
+        // every source reports its own timings
+        if ( settings->metrics ) {
+            context->metrics = new Nan::Callback(settings->metrics->GetFunction());
+        }
+        if ( cached ) {
+            context->cacheKey = MakeCacheKey("composite", CompositeCacheOptions(context), context);
+        }
+        contexts.push_back(context);
+    }
 
-             if ( ! xoffset ) { xoffset = 0; }
-             if ( ! yoffset ) { yoffset = 0; }
+    RunBatch(info, isSync, contexts, DoComposite);
+}
 
-             // limit canvas size to cropGeometry
-             if (debug) printf( "crop to: %d, %d, %d, %d\n", width, height, xoffset, yoffset );
-             Magick::Geometry cropGeometry( width, height, xoffset, yoffset, 0, 0 );
+// input
+//   info[ 0 ]: options. required, object with following key,values
+//              {
+//                  srcData:        required. Buffer with binary image data,
+//                                  or an array of Buffers to stamp the same layers onto each of them
+//                  srcPath:        optional. path of the image file instead of srcData, mapped and decoded by the worker
+//                  dstPath:        optional. path the result is written to by the worker, instead of being returned
+//                  compositeData:  required without layers. Buffer with image to composite
+//                  gravity:        optional. One of CenterGravity EastGravity
+//                                  ForgetGravity NorthEastGravity NorthGravity
+//                                  NorthWestGravity SouthEastGravity SouthGravity
+//                                  SouthWestGravity WestGravity
+//                  layers:         optional. array of layers stamped in order, each an object with following key,values
+//                                  {
+//                                      overlay:       id of an overlay registered by registerOverlay(), or
+//                                      compositeData: Buffer with image to composite
+//                                      gravity:       optional. default: "Forget" (top left). "SouthEast" or "SouthEastGravity", ...
+//                                      x, y:          optional. default: 0. px offset from the edges gravity points to
+//                                      opacity:       optional. default: 1. 0-1, scales the overlay's alpha
+//                                      compose:       optional. default: "Over". ex: "Multiply", "Screen". see ImageMagick's -compose
+//                                  }
+//                  threads:        optional. threads ImageMagick may use for this call
+//                  priority:       optional. default: "interactive". worker pool lane of async calls, "interactive" or "batch"
+//                  metrics:        optional. function called with { stage: ms, ..., total: ms } before the result is returned, once per source
+//                  cache:          optional. default: true. false skips the result cache enabled by cache()
+//                  maxMemory:      optional. bytes. fail when either decoded image's pixel cache would be larger
+//                  maxPixels:      optional. fail when either decoded image would have more pixels
+//                  timeoutMs:      optional. fail with "job timed out" when the call takes longer, counted from the call
+//                  jobId:          optional. number. async calls can be stopped with cancel(jobId), failing with "job cancelled"
+//                  debug:          optional. 1 or 0
+//              }
+//   info[ 1 ]: callback. optional, if present runs async and returns result with callback(error, buffer)
+//              or callback(error, buffers) for an array of sources
+NAN_METHOD(Composite) {
+    Nan::HandleScope();
 
-             Magick::Color transparent( "transparent" );
-             if ( strcmp( context->format.c_str(), "PNG" ) == 0 ) {
-                 // make background transparent for PNG
-                 // JPEG background becomes black if set transparent here
-                 transparent.alpha( 1. );
-             }
+    bool isSync = (info.Length() == 1);
 
-             #if MagickLibVersion > 0x654
-                 image.extent( cropGeometry, transparent );
-             #else
-                 image.extent( cropGeometry );
-             #endif
+    if ( info.Length() < 1 ) {
+        return Nan::ThrowError("composite() requires 1 (option) argument!");
+    }
+    Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
 
-         }
-        else {
-            context->error = std::string("resizeStyle not supported");
-            return;
-        }
-        if (debug) printf( "resized to: %d, %d\n", (int)image.columns(), (int)image.rows() );
+    Local<Value> srcDataValue = GetOption( obj, SrcDataKey );
+    bool isBatch = srcDataValue->IsArray() && GetOption( obj, ImageKey )->IsUndefined();
+
+    composite_im_ctx* context = new composite_im_ctx();
+    if ( ! isBatch && ! ParseSource(obj, context) ) {
+        delete context;
+        return Nan::ThrowError("composite()'s 1st argument should have \"srcData\" key with a Buffer instance");
     }
 
-    if ( context->quality ) {
-        if (debug) printf( "quality: %d\n", context->quality );
-        image.quality( context->quality );
+    if( ! isSync && ! info[ 1 ]->IsFunction() ) {
+        delete context;
+        return Nan::ThrowError("composite()'s 2nd argument should be a function");
     }
 
-    if ( context->autoOrient ) {
-        if ( debug ) printf( "autoOrient\n" );
-        AutoOrient(&image);
+    if ( ! context->error.empty() ) {
+        std::string error = context->error;
+        delete context;
+        return Nan::ThrowError(error.c_str());
+    }
+    context->debug = Nan::To<Uint32>(GetOption( obj, DebugKey )).ToLocalChecked()->Value();
+    context->ignoreWarnings = Nan::To<Uint32>(GetOption( obj, IgnoreWarningsKey )).ToLocalChecked()->Value();
+    context->threads = Nan::To<Uint32>(GetOption( obj, ThreadsKey )).ToLocalChecked()->Value();
+    if ( ! ParsePriority(obj, context) ) {
+        delete context;
+        return Nan::ThrowError("priority not supported");
+    }
+    ParseLimits(obj, context);
+    ParseControl(obj, context);
+    ParseMetrics(obj, context);
+    ParseDestination(obj, context);
+
+    const char* error = ParseCompositeLayers(obj, context);
+    if ( error ) {
+        delete context;
+        return Nan::ThrowError(error);
     }
-    else {
-        if ( context->rotate ) {
-            if (debug) printf( "rotate: %d\n", context->rotate );
-            image.rotate( context->rotate );
-        }
 
-        if ( context->flip ) {
-            if ( debug ) printf( "flip\n" );
-            image.flip();
+    if ( isBatch ) {
+        if ( ! context->dstPath.empty() ) {
+            delete context;
+            return Nan::ThrowError("composite()'s \"dstPath\" takes a single result, not an array of sources");
         }
+        CompositeBatch(info, Local<Array>::Cast(srcDataValue), context, UseCache(obj, context));
+        delete context;
+        return;
     }
 
-    if (context->density) {
-        image.density(Magick::Geometry(context->density, context->density));
+    if ( UseCache(obj, context) ) {
+        context->cacheKey = MakeCacheKey("composite", CompositeCacheOptions(context), context);
     }
 
-    if( context->colorspace != Magick::UndefinedColorspace ){
-      if (debug) printf( "colorspace: %s\n", MagickCore::CommandOptionToMnemonic(MagickCore::MagickColorspaceOptions, static_cast<ssize_t>(context->colorspace)) );
-        image.colorSpace( context->colorspace );
-    }
+    uv_work_t* req = new uv_work_t();
+    req->data = context;
+    if(!isSync) {
+        context->callback = new Nan::Callback(Local<Function>::Cast(info[1]));
+
+        QueueJob(req, DoComposite, GeneratedBlobAfter);
 
-    Magick::Blob dstBlob;
-    try {
-        image.write( &dstBlob );
-    }
-    catch (std::exception& err) {
-        std::string message = "image.write failed with error: ";
-        message            += err.what();
-        context->error = message;
         return;
+    } else {
+        RunJob(req, DoComposite);
+        RETURN_BLOB_OR_ERROR(req)
     }
-    catch (...) {
-        context->error = std::string("unhandled error");
+}
+
+void DoRegisterOverlay(uv_work_t* req) {
+
+    overlay_im_ctx* context = static_cast<overlay_im_ctx*>(req->data);
+    context->Time("queueWait");
+
+    SetThreadBudget(context->threads, context->debug);
+
+    if ( !context->overlay->Decode(context) )
         return;
-    }
-    context->dstBlob = dstBlob;
+    context->Time("decode");
 }
 
-// Make callback from convert or composite
-void GeneratedBlobAfter(uv_work_t* req) {
+// Adds the decoded overlay to the registry, unless it failed to decode
+void RegisterOverlayAfter(uv_work_t* req) {
     Nan::HandleScope scope;
 
-    im_ctx_base* context = static_cast<im_ctx_base*>(req->data);
+    overlay_im_ctx* context = static_cast<overlay_im_ctx*>(req->data);
     delete req;
 
-    Local<Value> argv[2];
-
+    Local<Value> argv[1];
     if (!context->error.empty()) {
         argv[0] = Exception::Error(Nan::New<String>(context->error.c_str()).ToLocalChecked());
-        argv[1] = Nan::Undefined();
     }
     else {
+        overlays[ context->id ] = context->overlay;
         argv[0] = Nan::Undefined();
-        argv[1] = WrapPointer((char *)context->dstBlob.data(), context->dstBlob.length());
     }
 
-    Nan::TryCatch try_catch; // don't quite see the necessity of this
+    Nan::TryCatch try_catch;
 
-    Nan::AsyncResource resource("GeneratedBlobAfter");
-    context->callback->Call(2, argv, &resource);
+    ReportMetrics(context);
 
-    delete context->callback;
+    Nan::AsyncResource resource("RegisterOverlayAfter");
+    context->callback->Call(1, argv, &resource);
 
+    delete context->callback;
     delete context;
 
     if (try_catch.HasCaught()) {
@@ -553,216 +5811,320 @@ void GeneratedBlobAfter(uv_work_t* req) {
 }
 
 // input
-//   info[ 0 ]: options. required, object with following key,values
+//   info[ 0 ]: id. required, string the "overlay" key of composite()'s layers refers to
+//   info[ 1 ]: srcData Buffer, or options. object with following key,values
 //              {
-//                  srcData:     required. Buffer with binary image data
-//                  quality:     optional. 0-100 integer, default 75. JPEG/MIFF/PNG compression level.
-//                  trim:        optional. default: false. trims edges that are the background color.
-//                  trimFuzz:    optional. [0-1) float, default 0. trimmed color distance to edge color, 0 is exact.
-//                  width:       optional. px.
-//                  height:      optional. px.
-//                  resizeStyle: optional. default: "aspectfill". can be "aspectfit", "fill"
-//                  gravity:     optional. default: "Center". used when resizeStyle is "aspectfill"
-//                                         can be "NorthWest", "North", "NorthEast", "West",
-//                                         "Center", "East", "SouthWest", "South", "SouthEast", "None"
-//                  format:      optional. one of http://www.imagemagick.org/script/formats.php ex: "JPEG"
-//                  filter:      optional. ex: "Lagrange", "Lanczos". see ImageMagick's magick/option.c for candidates
-//                  blur:        optional. ex: 0.8
-//                  strip:       optional. default: false. strips comments out from image.
-//                  maxMemory:   optional. set the maximum width * height of an image that can reside in the pixel cache memory.
-//                  debug:       optional. 1 or 0
+//                  srcData:        required. Buffer with binary image data, copied
+//                  threads:        optional. threads ImageMagick may use to decode
+//                  priority:       optional. default: "interactive". worker pool lane of async calls, "interactive" or "batch"
+//                  metrics:        optional. function called with { stage: ms, ..., total: ms } before the result is returned
+//                  debug:          optional. 1 or 0
+//                  ignoreWarnings: optional. 1 or 0
 //              }
-//   info[ 1 ]: callback. optional, if present runs async and returns result with callback(error, buffer)
-NAN_METHOD(Convert) {
+//   info[ 2 ]: callback. optional, if present decodes async and calls callback(error) once the overlay can be used
+// The overlay is decoded once and replaces a previous overlay of the same id, jobs already queued keep the old one.
+NAN_METHOD(RegisterOverlay) {
     Nan::HandleScope();
 
-    bool isSync = (info.Length() == 1);
+    bool isSync = (info.Length() == 2);
 
-    if ( info.Length() < 1 ) {
-        return Nan::ThrowError("convert() requires 1 (option) argument!");
+    if ( info.Length() < 2 ) {
+        return Nan::ThrowError("registerOverlay() requires 2 (id, srcData) arguments!");
     }
 
-    if ( ! info[ 0 ]->IsObject() ) {
-        return Nan::ThrowError("convert()'s 1st argument should be an object");
+    if ( ! info[ 0 ]->IsString() ) {
+        return Nan::ThrowError("registerOverlay()'s 1st argument should be a string");
     }
 
-    if( ! isSync && ! info[ 1 ]->IsFunction() ) {
-        return Nan::ThrowError("convert()'s 2nd argument should be a function");
+    if( ! isSync && ! info[ 2 ]->IsFunction() ) {
+        return Nan::ThrowError("registerOverlay()'s 3rd argument should be a function");
     }
 
-    Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
-
-    Local<Object> srcData = Local<Object>::Cast( Nan::Get( obj, Nan::New<String>("srcData").ToLocalChecked() ).ToLocalChecked() );
-    if ( srcData->IsUndefined() || ! Buffer::HasInstance(srcData) ) {
-        return Nan::ThrowError("convert()'s 1st argument should have \"srcData\" key with a Buffer instance");
+    Local<Object> obj = Nan::New<Object>();
+    if ( Buffer::HasInstance(info[ 1 ]) ) {
+        Nan::Set(obj, Nan::New(optionKeys[ SrcDataKey ]), info[ 1 ]);
+    }
+    else if ( info[ 1 ]->IsObject() ) {
+        obj = Local<Object>::Cast( info[ 1 ] );
     }
 
-    convert_im_ctx* context = new convert_im_ctx();
-    context->srcData = Buffer::Data(srcData);
-    context->length = Buffer::Length(srcData);
+    Local<Value> srcData = GetOption( obj, SrcDataKey );
+    if ( ! Buffer::HasInstance(srcData) ) {
+        return Nan::ThrowError("registerOverlay()'s 2nd argument should be a Buffer or have \"srcData\" key with a Buffer instance");
+    }
 
-    context->debug = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("debug").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    context->ignoreWarnings = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("ignoreWarnings").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    context->maxMemory = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("maxMemory").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    context->width = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("width").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    context->height = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("height").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    context->xoffset = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("xoffset").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    context->yoffset = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("yoffset").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    context->quality = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("quality").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    context->rotate = Nan::To<Int32>(Nan::Get( obj, Nan::New<String>("rotate").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    context->flip = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("flip").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    context->density = Nan::To<Int32>(Nan::Get( obj, Nan::New<String>("density").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-
-    Local<Value> trimValue = Nan::Get( obj, Nan::New<String>("trim").ToLocalChecked() ).ToLocalChecked();
-    if ( (context->trim = ! trimValue->IsUndefined() && Nan::To<Boolean>(trimValue).ToLocalChecked()->IsTrue()) ) {
-        context->trimFuzz = Nan::To<Number>(Nan::Get( obj, Nan::New<String>("trimFuzz").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value() * (double) (1L << MAGICKCORE_QUANTUM_DEPTH);
+    overlay_im_ctx* context = new overlay_im_ctx();
+    context->id = *Nan::Utf8String(info[ 0 ]);
+    context->overlay = std::make_shared<Overlay>(Buffer::Data(srcData), Buffer::Length(srcData), true);
+    // hashed once here, for the cache keys of every composite using it
+    context->overlay->Hash();
+    context->debug = Nan::To<Uint32>(GetOption( obj, DebugKey )).ToLocalChecked()->Value();
+    context->ignoreWarnings = Nan::To<Uint32>(GetOption( obj, IgnoreWarningsKey )).ToLocalChecked()->Value();
+    context->threads = Nan::To<Uint32>(GetOption( obj, ThreadsKey )).ToLocalChecked()->Value();
+    if ( ! ParsePriority(obj, context) ) {
+        delete context;
+        return Nan::ThrowError("priority not supported");
     }
+    ParseMetrics(obj, context);
 
-    Local<Value> stripValue = Nan::Get( obj, Nan::New<String>("strip").ToLocalChecked() ).ToLocalChecked();
-    context->strip = ! stripValue->IsUndefined() && Nan::To<Boolean>(stripValue).ToLocalChecked()->IsTrue();
+    uv_work_t* req = new uv_work_t();
+    req->data = context;
+    if(!isSync) {
+        context->callback = new Nan::Callback(Local<Function>::Cast(info[2]));
 
-    Local<Value> autoOrientValue = Nan::Get( obj, Nan::New<String>("autoOrient").ToLocalChecked() ).ToLocalChecked();
-    context->autoOrient = ! autoOrientValue->IsUndefined() && Nan::To<Boolean>(autoOrientValue).ToLocalChecked()->IsTrue();
+        QueueJob(req, DoRegisterOverlay, RegisterOverlayAfter);
 
-    // manage blur as string for detect is empty
-    Local<Value> blurValue = Nan::Get( obj, Nan::New<String>("blur").ToLocalChecked() ).ToLocalChecked();
-    context->blur = "";
-    if ( ! blurValue->IsUndefined() ) {
-        double blurD = Nan::To<Number>(blurValue).ToLocalChecked()->Value();
-        std::ostringstream strs;
-        strs << blurD;
-        context->blur = strs.str();
+        return;
     }
+    DoRegisterOverlay(req);
+    ReportMetrics(context);
+    delete req;
+    if (!context->error.empty()) {
+        std::string error = context->error;
+        delete context;
+        return Nan::ThrowError(error.c_str());
+    }
+    overlays[ context->id ] = context->overlay;
+    delete context;
+}
 
-    Local<Value> resizeStyleValue = Nan::Get( obj, Nan::New<String>("resizeStyle").ToLocalChecked() ).ToLocalChecked();
-    context->resizeStyle = !resizeStyleValue->IsUndefined() ?
-        *Nan::Utf8String(resizeStyleValue) : "aspectfill";
+// input
+//   info[ 0 ]: id. required, string of an overlay registered by registerOverlay()
+// returns whether there was an overlay of that id. Jobs already queued keep using it.
+NAN_METHOD(UnregisterOverlay) {
+    Nan::HandleScope();
 
-    Local<Value> gravityValue = Nan::Get( obj, Nan::New<String>("gravity").ToLocalChecked() ).ToLocalChecked();
-    context->gravity = !gravityValue->IsUndefined() ?
-        *Nan::Utf8String(gravityValue) : "Center";
+    if ( info.Length() < 1 || ! info[ 0 ]->IsString() ) {
+        return Nan::ThrowError("unregisterOverlay()'s 1st argument should be a string");
+    }
+    info.GetReturnValue().Set(Nan::New<Boolean>(overlays.erase(*Nan::Utf8String(info[ 0 ])) > 0));
+}
 
-    Local<Value> formatValue = Nan::Get( obj, Nan::New<String>("format").ToLocalChecked() ).ToLocalChecked();
-    context->format = !formatValue->IsUndefined() ?
-        *Nan::Utf8String(formatValue) : "";
+void DoLoad(uv_work_t* req) {
 
-    Local<Value> srcFormatValue = Nan::Get( obj, Nan::New<String>("srcFormat").ToLocalChecked() ).ToLocalChecked();
-    context->srcFormat = !srcFormatValue->IsUndefined() ?
-        *Nan::Utf8String(srcFormatValue) : "";
+    im_ctx_base* context = static_cast<im_ctx_base*>(req->data);
+    context->Time("queueWait");
 
-    Local<Value> filterValue = Nan::Get( obj, Nan::New<String>("filter").ToLocalChecked() ).ToLocalChecked();
-    context->filter = !filterValue->IsUndefined() ?
-        *Nan::Utf8String(filterValue) : "";
+    SetThreadBudget(context->threads, context->debug);
 
-    Local<Value> backgroundValue = Nan::Get( obj, Nan::New<String>("background").ToLocalChecked() ).ToLocalChecked();
-    context->background = !backgroundValue->IsUndefined() ?
-        *Nan::Utf8String(backgroundValue) : "";
+    Magick::Blob srcBlob( context->srcData, context->length );
 
-    ssize_t colorspace = -1;
-    Local<Value> colorspaceValue = Nan::Get( obj, Nan::New<String>("colorspace").ToLocalChecked() ).ToLocalChecked();
-    if (!colorspaceValue->IsUndefined()) {
-      colorspace = MagickCore::ParseCommandOption(MagickCore::MagickColorspaceOptions, MagickCore::MagickFalse, *Nan::Utf8String(colorspaceValue));
-      if (context->debug) printf("Parsing colorspace option \"%s\" to %ld\n", *Nan::Utf8String(colorspaceValue), colorspace);
+    std::shared_ptr<loaded_image> loaded = std::make_shared<loaded_image>();
+    if ( NeedsAdmission(context) ) {
+        Magick::Image header;
+        if ( ! context->srcFormat.empty() ) {
+            header.magick( context->srcFormat.c_str() );
+        }
+        if ( !AdmitImage(&header, srcBlob, &loaded->reservation, context) )
+            return;
+        context->Time("admission");
     }
-    context->colorspace = colorspace != (-1) ? (Magick::ColorspaceType) colorspace : Magick::UndefinedColorspace;
-
-    uv_work_t* req = new uv_work_t();
-    req->data = context;
-    if(!isSync) {
-        context->callback = new Nan::Callback(Local<Function>::Cast(info[1]));
-
-        uv_queue_work(uv_default_loop(), req, DoConvert, (uv_after_work_cb)GeneratedBlobAfter);
 
+    if ( !ReadImageMagick(&loaded->image, srcBlob, context->srcFormat, context) )
         return;
-    } else {
-        DoConvert(req);
-        RETURN_BLOB_OR_ERROR(req)
+    if ( context->control ) {
+        WatchImage(&loaded->image, NULL);
     }
+    context->Time("decode");
+
+    loaded->bytes = (MagickCore::MagickSizeType) loaded->image.columns() * loaded->image.rows() * sizeof(Magick::PixelPacket);
+    context->loaded = loaded;
 }
 
-void DoIdentify(uv_work_t* req) {
+void LoadAfter(uv_work_t* req) {
+    Nan::HandleScope scope;
 
-    MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, 1);
+    im_ctx_base* context = static_cast<im_ctx_base*>(req->data);
+    delete req;
 
-    identify_im_ctx* context = static_cast<identify_im_ctx*>(req->data);
+    Local<Value> argv[2];
+    if (!context->error.empty()) {
+        argv[0] = Exception::Error(Nan::New<String>(context->error.c_str()).ToLocalChecked());
+        argv[1] = Nan::Undefined();
+    }
+    else {
+        argv[0] = Nan::Undefined();
+        argv[1] = ImageHandle::NewInstance(context->loaded);
+    }
 
-    Magick::Blob srcBlob( context->srcData, context->length );
+    Nan::TryCatch try_catch;
 
-    Magick::Image image;
+    ReportMetrics(context);
 
-    if( ! context->srcFormat.empty() ){
-        if (context->debug) printf( "reading with format: %s\n", context->srcFormat.c_str() );
-        image.magick( context->srcFormat.c_str() );
+    Nan::AsyncResource resource("LoadAfter");
+    context->callback->Call(2, argv, &resource);
+
+    delete context->callback;
+    delete context;
+
+    if (try_catch.HasCaught()) {
+#if NODE_VERSION_AT_LEAST(0, 12, 0)
+        Nan::FatalException(try_catch);
+#else
+        FatalException(try_catch);
+#endif
     }
+}
 
-    try {
-        image.read( srcBlob );
+// input
+//   info[ 0 ]: srcData Buffer, or options. object with following key,values
+//              {
+//                  srcData:        required. Buffer with binary image data
+//                  srcPath:        optional. path of the image file instead of srcData, mapped and decoded by the worker
+//                  srcFormat:      optional. force source format if not detected
+//                  maxMemory:      optional. bytes. fail when the decoded image's pixel cache would be larger
+//                  maxPixels:      optional. fail when the decoded image would have more pixels
+//                  timeoutMs:      optional. fail with "job timed out" when the call takes longer, counted from the call
+//                  jobId:          optional. number. async calls can be stopped with cancel(jobId), failing with "job cancelled"
+//                  threads:        optional. threads ImageMagick may use to decode
+//                  priority:       optional. default: "interactive". worker pool lane of async calls, "interactive" or "batch"
+//                  metrics:        optional. function called with { stage: ms, ..., total: ms } before the result is returned
+//                  debug:          optional. 1 or 0
+//                  ignoreWarnings: optional. 1 or 0
+//              }
+//   info[ 1 ]: callback. optional, if present runs async and returns result with callback(error, image)
+// output
+//   an Image handle, to pass as the "image" option of convert, identify, composite, getConstPixels and quantizeColors
+NAN_METHOD(Load) {
+    Nan::HandleScope();
+
+    bool isSync = (info.Length() == 1);
+
+    if ( info.Length() < 1 ) {
+        return Nan::ThrowError("load() requires 1 argument!");
     }
-    catch (std::exception& err) {
-        std::string what (err.what());
-        std::string message = std::string("image.read failed with error: ") + what;
-        std::size_t found   = what.find( "warn" );
-        if (context->ignoreWarnings && (found != std::string::npos)) {
-            if (context->debug) printf("warning: %s\n", message.c_str());
-        }
-        else {
-            context->error = message;
-        }
+
+    if( ! isSync && ! info[ 1 ]->IsFunction() ) {
+        return Nan::ThrowError("load()'s 2nd argument should be a function");
     }
-    catch (...) {
-        context->error = std::string("unhandled error");
+
+    Local<Object> obj = Nan::New<Object>();
+    if ( Buffer::HasInstance(info[ 0 ]) ) {
+        Nan::Set(obj, Nan::New(optionKeys[ SrcDataKey ]), info[ 0 ]);
     }
-    if(!context->error.empty()) {
-        return;
+    else if ( info[ 0 ]->IsObject() ) {
+        obj = Local<Object>::Cast( info[ 0 ] );
     }
 
-    if (context->debug) printf("original width,height: %d, %d\n", (int) image.columns(), (int) image.rows());
+    im_ctx_base* context = new im_ctx_base();
+    context->operation = LoadOperation;
+    if ( ! ParseSource(obj, context) || context->loaded || ! context->error.empty() ) {
+        delete context;
+        return Nan::ThrowError("load()'s 1st argument should be a Buffer or have \"srcData\" key with a Buffer instance");
+    }
+    context->debug = Nan::To<Uint32>(GetOption( obj, DebugKey )).ToLocalChecked()->Value();
+    context->ignoreWarnings = Nan::To<Uint32>(GetOption( obj, IgnoreWarningsKey )).ToLocalChecked()->Value();
+    context->threads = Nan::To<Uint32>(GetOption( obj, ThreadsKey )).ToLocalChecked()->Value();
+    Local<Value> srcFormatValue = GetOption( obj, SrcFormatKey );
+    context->srcFormat = !srcFormatValue->IsUndefined() ?
+        *Nan::Utf8String(srcFormatValue) : "";
+    if ( ! ParsePriority(obj, context) ) {
+        delete context;
+        return Nan::ThrowError("priority not supported");
+    }
+    ParseLimits(obj, context);
+    ParseControl(obj, context);
+    ParseMetrics(obj, context);
 
-    context->image = image;
-}
+    uv_work_t* req = new uv_work_t();
+    req->data = context;
+    if(!isSync) {
+        context->callback = new Nan::Callback(Local<Function>::Cast(info[1]));
 
-void BuildIdentifyResult(uv_work_t *req, Local<Value> *argv) {
-    identify_im_ctx* context = static_cast<identify_im_ctx*>(req->data);
+        QueueJob(req, DoLoad, LoadAfter);
 
+        return;
+    }
+    RunJob(req, DoLoad);
+    ReportMetrics(context);
+    delete req;
     if (!context->error.empty()) {
-        argv[0] = Exception::Error(Nan::New<String>(context->error.c_str()).ToLocalChecked());
-        argv[1] = Nan::Undefined();
+        std::string error = context->error;
+        delete context;
+        return Nan::ThrowError(error.c_str());
+    }
+    info.GetReturnValue().Set(ImageHandle::NewInstance(context->loaded));
+    delete context;
+}
+
+// Extra context for fingerprint
+struct fingerprint_im_ctx : im_ctx_base {
+    std::string hash;
+    std::string digest;
+
+    fingerprint_im_ctx() {
+        operation = FingerprintOperation;
+    }
+};
+
+void DoFingerprint(uv_work_t* req) {
+
+    fingerprint_im_ctx* context = static_cast<fingerprint_im_ctx*>(req->data);
+    context->Time("queueWait");
+
+    SetThreadBudget(context->threads, context->debug);
+
+    // the hash is taken from a 9x8 proxy, the JPEG decoder can produce a small image right away
+    const unsigned int size = 32;
+
+    std::unique_lock<std::mutex> loadedLock;
+    Magick::Image image;
+    MemoryReservation reservation;
+    if ( context->loaded ) {
+        UseLoadedImage(&image, &loadedLock, context);
     }
     else {
-        argv[0] = Nan::Undefined();
-        Local<Object> out = Nan::New<Object>();
+        Magick::Blob srcBlob( context->srcData, context->length );
 
-        Nan::Set(out, Nan::New<String>("width").ToLocalChecked(), Nan::New<Integer>(static_cast<int>(context->image.columns())));
-        Nan::Set(out, Nan::New<String>("height").ToLocalChecked(), Nan::New<Integer>(static_cast<int>(context->image.rows())));
-        Nan::Set(out, Nan::New<String>("depth").ToLocalChecked(), Nan::New<Integer>(static_cast<int>(context->image.depth())));
-        Nan::Set(out, Nan::New<String>("format").ToLocalChecked(), Nan::New<String>(context->image.magick().c_str()).ToLocalChecked());
-        Nan::Set(out, Nan::New<String>("colorspace").ToLocalChecked(), Nan::New<String>(MagickCore::CommandOptionToMnemonic(MagickCore::MagickColorspaceOptions, static_cast<ssize_t>(context->image.colorSpace()))).ToLocalChecked());
+        SetDecodeSizeHint(&image, size, size, context->debug);
+        if ( NeedsAdmission(context) ) {
+            Magick::Image header;
+            if ( ! context->srcFormat.empty() ) {
+                header.magick( context->srcFormat.c_str() );
+            }
+            SetDecodeSizeHint(&header, size, size, 0);
+            if ( !AdmitImage(&header, srcBlob, &reservation, context) )
+                return;
+            context->Time("admission");
+        }
 
-        Local<Object> out_density = Nan::New<Object>();
-        Magick::Geometry density = context->image.density();
-        Nan::Set(out_density, Nan::New<String>("width").ToLocalChecked(), Nan::New<Integer>(static_cast<int>(density.width())));
-        Nan::Set(out_density, Nan::New<String>("height").ToLocalChecked(), Nan::New<Integer>(static_cast<int>(density.height())));
-        Nan::Set(out, Nan::New<String>("density").ToLocalChecked(), out_density);
+        if ( !ReadImageMagick(&image, srcBlob, context->srcFormat, context) )
+            return;
+        context->Time("decode");
 
-        Local<Object> out_exif = Nan::New<Object>();
-        Nan::Set(out_exif, Nan::New<String>("orientation").ToLocalChecked(), Nan::New<Integer>(atoi(context->image.attribute("EXIF:Orientation").c_str())));
-        Nan::Set(out, Nan::New<String>("exif").ToLocalChecked(), out_exif);
+        context->digest = Hash128(context->srcData, context->length);
+    }
+
+    if ( !DifferenceHash(image, &context->hash, context) )
+        return;
+    context->Time("fingerprint");
+}
 
-        argv[1] = out;
+void BuildFingerprintResult(uv_work_t *req, Local<Value> *argv) {
+    fingerprint_im_ctx* context = static_cast<fingerprint_im_ctx*>(req->data);
+
+    if (!context->error.empty()) {
+        argv[0] = Exception::Error(Nan::New<String>(context->error.c_str()).ToLocalChecked());
+        argv[1] = Nan::Undefined();
+        return;
     }
+    argv[0] = Nan::Undefined();
+    argv[1] = WrapFingerprint(context->hash, context->digest);
 }
 
-void IdentifyAfter(uv_work_t* req) {
+void FingerprintAfter(uv_work_t* req) {
     Nan::HandleScope scope;
 
     Local<Value> argv[2];
-    BuildIdentifyResult(req,argv);
+    BuildFingerprintResult(req, argv);
 
-    identify_im_ctx* context = static_cast<identify_im_ctx*>(req->data);
+    fingerprint_im_ctx* context = static_cast<fingerprint_im_ctx*>(req->data);
 
-    Nan::TryCatch try_catch; // don't quite see the necessity of this
+    Nan::TryCatch try_catch;
 
-    Nan::AsyncResource resource("GeneratedBlobAfter");
+    ReportMetrics(context);
+
+    Nan::AsyncResource resource("FingerprintAfter");
     context->callback->Call(2, argv, &resource);
 
     delete context->callback;
@@ -779,399 +6141,430 @@ void IdentifyAfter(uv_work_t* req) {
 }
 
 // input
-//   info[ 0 ]: options. required, object with following key,values
+//   info[ 0 ]: srcData Buffer, or options. object with following key,values
 //              {
 //                  srcData:        required. Buffer with binary image data
+//                  srcPath:        optional. path of the image file instead of srcData, mapped and decoded by the worker
+//                  srcFormat:      optional. force source format if not detected
+//                  maxMemory:      optional. bytes. fail when the decoded image's pixel cache would be larger
+//                  maxPixels:      optional. fail when the decoded image would have more pixels
+//                  timeoutMs:      optional. fail with "job timed out" when the call takes longer, counted from the call
+//                  jobId:          optional. number. async calls can be stopped with cancel(jobId), failing with "job cancelled"
+//                  threads:        optional. threads ImageMagick may use to decode
+//                  priority:       optional. default: "interactive". worker pool lane of async calls, "interactive" or "batch"
+//                  metrics:        optional. function called with { stage: ms, ..., total: ms } before the result is returned
 //                  debug:          optional. 1 or 0
+//                  ignoreWarnings: optional. 1 or 0
 //              }
-//   info[ 1 ]: callback. optional, if present runs async and returns result with callback(error, info)
-NAN_METHOD(Identify) {
-    Nan::HandleScope scope;
+//   info[ 1 ]: callback. optional, if present runs async and returns result with callback(error, fingerprint)
+// output
+//   { hash: 16 hex digits of the difference hash, digest: 32 hex digits of the 128 bit hash of srcData }
+//   JPEG sources are decoded at a reduced size, the hash is close to, not always equal to, convert's "fingerprint" hash
+NAN_METHOD(Fingerprint) {
+    Nan::HandleScope();
 
-    bool isSync = info.Length() == 1;
+    bool isSync = (info.Length() == 1);
 
     if ( info.Length() < 1 ) {
-        return Nan::ThrowError("identify() requires 1 (option) argument!");
-    }
-    Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
-
-    Local<Object> srcData = Local<Object>::Cast( Nan::Get( obj, Nan::New<String>("srcData").ToLocalChecked() ).ToLocalChecked() );
-    if ( srcData->IsUndefined() || ! Buffer::HasInstance(srcData) ) {
-        return Nan::ThrowError("identify()'s 1st argument should have \"srcData\" key with a Buffer instance");
+        return Nan::ThrowError("fingerprint() requires 1 argument!");
     }
 
     if( ! isSync && ! info[ 1 ]->IsFunction() ) {
-        return Nan::ThrowError("identify()'s 2nd argument should be a function");
+        return Nan::ThrowError("fingerprint()'s 2nd argument should be a function");
     }
 
-    identify_im_ctx* context = new identify_im_ctx();
-    context->srcData = Buffer::Data(srcData);
-    context->length = Buffer::Length(srcData);
-
-    context->debug = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("debug").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    context->ignoreWarnings = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("ignoreWarnings").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
+    Local<Object> obj = Nan::New<Object>();
+    if ( Buffer::HasInstance(info[ 0 ]) ) {
+        Nan::Set(obj, Nan::New(optionKeys[ SrcDataKey ]), info[ 0 ]);
+    }
+    else if ( info[ 0 ]->IsObject() ) {
+        obj = Local<Object>::Cast( info[ 0 ] );
+    }
 
-    Local<Value> srcFormatValue = Nan::Get( obj, Nan::New<String>("srcFormat").ToLocalChecked() ).ToLocalChecked();
+    fingerprint_im_ctx* context = new fingerprint_im_ctx();
+    if ( ! ParseSource(obj, context) ) {
+        delete context;
+        return Nan::ThrowError("fingerprint()'s 1st argument should be a Buffer or have \"srcData\" key with a Buffer instance");
+    }
+    if ( ! context->error.empty() ) {
+        std::string error = context->error;
+        delete context;
+        return Nan::ThrowError(error.c_str());
+    }
+    context->debug = Nan::To<Uint32>(GetOption( obj, DebugKey )).ToLocalChecked()->Value();
+    context->ignoreWarnings = Nan::To<Uint32>(GetOption( obj, IgnoreWarningsKey )).ToLocalChecked()->Value();
+    context->threads = Nan::To<Uint32>(GetOption( obj, ThreadsKey )).ToLocalChecked()->Value();
+    Local<Value> srcFormatValue = GetOption( obj, SrcFormatKey );
     context->srcFormat = !srcFormatValue->IsUndefined() ?
         *Nan::Utf8String(srcFormatValue) : "";
-
-    if (context->debug) printf( "debug: on\n" );
-    if (context->debug) printf( "ignoreWarnings: %d\n", context->ignoreWarnings );
+    if ( ! ParsePriority(obj, context) ) {
+        delete context;
+        return Nan::ThrowError("priority not supported");
+    }
+    ParseLimits(obj, context);
+    ParseControl(obj, context);
+    ParseMetrics(obj, context);
 
     uv_work_t* req = new uv_work_t();
     req->data = context;
     if(!isSync) {
         context->callback = new Nan::Callback(Local<Function>::Cast(info[1]));
 
-        uv_queue_work(uv_default_loop(), req, DoIdentify, (uv_after_work_cb)IdentifyAfter);
+        QueueJob(req, DoFingerprint, FingerprintAfter);
 
         return;
+    }
+    RunJob(req, DoFingerprint);
+    Local<Value> argv[2];
+    BuildFingerprintResult(req, argv);
+    ReportMetrics(context);
+    delete context;
+    delete req;
+    if ( argv[0]->IsUndefined() ) {
+        info.GetReturnValue().Set(argv[1]);
     } else {
-        DoIdentify(req);
-        Local<Value> argv[2];
-        BuildIdentifyResult(req, argv);
-        delete static_cast<identify_im_ctx*>(req->data);
-        delete req;
-        if(argv[0]->IsUndefined()){
-            info.GetReturnValue().Set(argv[1]);
-        } else {
-            return Nan::ThrowError(argv[0]);
-        }
+        return Nan::ThrowError(argv[0]);
     }
 }
 
-// input
-//   info[ 0 ]: options. required, object with following key,values
-//              {
-//                  srcData:        required. Buffer with binary image data
-//                  x:              required. x,y,columns,rows provide the area of interest.
-//                  y:              required.
-//                  columns:        required.
-//                  rows:           required.
-//              }
-NAN_METHOD(GetConstPixels) {
+NAN_METHOD(Version) {
     Nan::HandleScope();
-    MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, 1);
-
-    if ( info.Length() != 1 ) {
-        return Nan::ThrowError("getConstPixels() requires 1 (option) argument!");
-    }
-    Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
 
-    Local<Object> srcData = Local<Object>::Cast( Nan::Get( obj, Nan::New<String>("srcData").ToLocalChecked() ).ToLocalChecked() );
-    if ( srcData->IsUndefined() || ! Buffer::HasInstance(srcData) ) {
-        return Nan::ThrowError("getConstPixels()'s 1st argument should have \"srcData\" key with a Buffer instance");
-    }
+    info.GetReturnValue().Set(Nan::New<String>(MagickLibVersionText).ToLocalChecked());
+}
 
-    unsigned int xValue       = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("x").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    unsigned int yValue       = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("y").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    unsigned int columnsValue = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("columns").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    unsigned int rowsValue    = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("rows").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
+NAN_METHOD(GetQuantumDepth) {
+    Nan::HandleScope();
 
-    int debug          = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("debug").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    int ignoreWarnings = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("ignoreWarnings").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    if (debug) printf( "debug: on\n" );
-    if (debug) printf( "ignoreWarnings: %d\n", ignoreWarnings );
+    info.GetReturnValue().Set(Nan::New<Integer>(MAGICKCORE_QUANTUM_DEPTH));
+}
 
-    Magick::Blob srcBlob( Buffer::Data(srcData), Buffer::Length(srcData));
+// input
+//   info[ 0 ]: optional. threads ImageMagick may use per job, 0 derives it from the number of cores and the worker pool size
+// returns the number of threads a job uses
+NAN_METHOD(Threads) {
+    Nan::HandleScope();
 
-    Magick::Image image;
-    try {
-        image.read( srcBlob );
-    }
-    catch (std::exception& err) {
-        std::string what (err.what());
-        std::string message = std::string("image.read failed with error: ") + what;
-        std::size_t found   = what.find( "warn" );
-        if (ignoreWarnings && (found != std::string::npos)) {
-            if (debug) printf("warning: %s\n", message.c_str());
-        }
-        else {
-            return Nan::ThrowError(message.c_str());
+    if ( info.Length() > 0 ) {
+        if ( ! info[ 0 ]->IsNumber() ) {
+            return Nan::ThrowError("threads()'s 1st argument should be a number");
         }
-    }
-    catch (...) {
-        return Nan::ThrowError("unhandled error");
-    }
-
-    size_t w = image.columns();
-    size_t h = image.rows();
-
-    if (xValue+columnsValue > w || yValue+rowsValue > h) {
-        return Nan::ThrowError("x/y/columns/rows values are beyond the image\'s dimensions");
-    }
-
-    const Magick::PixelPacket *pixels = image.getConstPixels(xValue, yValue, columnsValue, rowsValue);
-
-    Local<Object> out = Nan::New<Array>();
-    for (unsigned int i=0; i<columnsValue * rowsValue; i++) {
-        Magick::PixelPacket pixel = pixels[ i ];
-        Local<Object> color = Nan::New<Object>();
-
-        Nan::Set(color, Nan::New<String>("red").ToLocalChecked(),     Nan::New<Integer>(pixel.red));
-        Nan::Set(color, Nan::New<String>("green").ToLocalChecked(),   Nan::New<Integer>(pixel.green));
-        Nan::Set(color, Nan::New<String>("blue").ToLocalChecked(),    Nan::New<Integer>(pixel.blue));
-        Nan::Set(color, Nan::New<String>("opacity").ToLocalChecked(), Nan::New<Integer>(pixel.opacity));
-
-        Nan::Set(out, i, color);
+        threadsPerJob = Nan::To<Uint32>(info[ 0 ]).ToLocalChecked()->Value();
     }
 
-    info.GetReturnValue().Set(out);
+    info.GetReturnValue().Set(Nan::New<Integer>(ThreadBudget(0)));
 }
 
 // input
-//   info[ 0 ]: options. required, object with following key,values
+//   info[ 0 ]: options. optional, object with following key,values
 //              {
-//                  srcData:        required. Buffer with binary image data
-//                  colors:         optional. 5 by default
-//                  debug:          optional. 1 or 0
+//                  size:       optional. number of worker threads running async jobs, defaults to UV_THREADPOOL_SIZE or 4
+//                  queueDepth: optional. jobs each lane may hold before new ones fail, 0 is unlimited
 //              }
-NAN_METHOD(QuantizeColors) {
+// returns the pool settings, how many jobs are running and queued per lane,
+// and how many calls failed because they were cancelled or timed out
+NAN_METHOD(Pool) {
     Nan::HandleScope();
-    MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, 1);
-
-    if ( info.Length() != 1 ) {
-        return Nan::ThrowError("quantizeColors() requires 1 (option) argument!");
-    }
-    Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
-
-    Local<Object> srcData = Local<Object>::Cast( Nan::Get( obj, Nan::New<String>("srcData").ToLocalChecked() ).ToLocalChecked() );
-    if ( srcData->IsUndefined() || ! Buffer::HasInstance(srcData) ) {
-        return Nan::ThrowError("quantizeColors()'s 1st argument should have \"srcData\" key with a Buffer instance");
-    }
-
-    int colorsCount = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("colors").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    if (!colorsCount) colorsCount = 5;
-
-    int debug = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("debug").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    int ignoreWarnings = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("ignoreWarnings").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    if (debug) printf( "debug: on\n" );
-    if (debug) printf( "ignoreWarnings: %d\n", ignoreWarnings );
-
-    Magick::Blob srcBlob( Buffer::Data(srcData), Buffer::Length(srcData) );
 
-    Magick::Image image;
-    try {
-        image.read( srcBlob );
-    }
-    catch (std::exception& err) {
-        std::string what (err.what());
-        std::string message = std::string("image.read failed with error: ") + what;
-        std::size_t found   = what.find( "warn" );
-        if (ignoreWarnings && (found != std::string::npos)) {
-            if (debug) printf("warning: %s\n", message.c_str());
+    if ( info.Length() > 0 && ! info[ 0 ]->IsUndefined() ) {
+        if ( ! info[ 0 ]->IsObject() ) {
+            return Nan::ThrowError("pool()'s 1st argument should be an object");
         }
-        else {
-            return Nan::ThrowError(message.c_str());
+        Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
+
+        unsigned int size = pool.Size();
+        Local<Value> sizeValue = Nan::Get( obj, Nan::New<String>("size").ToLocalChecked() ).ToLocalChecked();
+        if ( ! sizeValue->IsUndefined() ) {
+            size = Nan::To<Uint32>(sizeValue).ToLocalChecked()->Value();
+            if ( ! size ) {
+                return Nan::ThrowError("pool()'s \"size\" should be at least 1");
+            }
         }
-    }
-    catch (...) {
-        return Nan::ThrowError("unhandled error");
-    }
 
-    ssize_t rows = 196; ssize_t columns = 196;
-
-    if (debug) printf( "resize to: %d, %d\n", (int) rows, (int) columns );
-    Magick::Geometry resizeGeometry( rows, columns, 0, 0, 0, 0 );
-    image.zoom( resizeGeometry );
+        unsigned int queueDepth = pool.QueueDepth();
+        Local<Value> queueDepthValue = Nan::Get( obj, Nan::New<String>("queueDepth").ToLocalChecked() ).ToLocalChecked();
+        if ( ! queueDepthValue->IsUndefined() ) {
+            queueDepth = Nan::To<Uint32>(queueDepthValue).ToLocalChecked()->Value();
+        }
 
-    if (debug) printf("totalColors before: %d\n", (int) image.totalColors());
+        pool.Configure(size, queueDepth);
+    }
 
-    image.quantizeColors(colorsCount + 1);
-    image.quantize();
+    Local<Object> out = Nan::New<Object>();
+    Nan::Set(out, Nan::New<String>("size").ToLocalChecked(), Nan::New<Integer>(pool.Size()));
+    Nan::Set(out, Nan::New<String>("queueDepth").ToLocalChecked(), Nan::New<Integer>(pool.QueueDepth()));
+    Nan::Set(out, Nan::New<String>("running").ToLocalChecked(), Nan::New<Integer>(pool.Running()));
 
-    if (debug) printf("totalColors after: %d\n", (int) image.totalColors());
+    Local<Object> out_queued = Nan::New<Object>();
+    Nan::Set(out_queued, Nan::New<String>("interactive").ToLocalChecked(), Nan::New<Integer>(pool.Queued(InteractivePriority)));
+    Nan::Set(out_queued, Nan::New<String>("batch").ToLocalChecked(), Nan::New<Integer>(pool.Queued(BatchPriority)));
+    Nan::Set(out, Nan::New<String>("queued").ToLocalChecked(), out_queued);
 
-    Magick::PixelPacket* pixels = image.getPixels(0, 0, image.columns(), image.rows());
+    Nan::Set(out, Nan::New<String>("cancelled").ToLocalChecked(), Nan::New<Number>(cancelledJobs.load()));
+    Nan::Set(out, Nan::New<String>("timedOut").ToLocalChecked(), Nan::New<Number>(timedOutJobs.load()));
 
-    Magick::PixelPacket* colors = new Magick::PixelPacket[colorsCount]();
-    int index = 0;
+    info.GetReturnValue().Set(out);
+}
 
-    for ( ssize_t x = 0; x < rows ; x++ ) {
-        for ( ssize_t y = 0; y < columns ; y++ ) {
-            Magick::PixelPacket pixel = pixels[rows * x + y];
+// input
+//   info[ 0 ]: jobId. required, the "jobId" option of the async calls to cancel
+// Queued jobs of those calls fail right away with "job cancelled",
+// running ones once ImageMagick next reports progress of their decode, operations or encode.
+// returns whether a call with that jobId was in flight
+NAN_METHOD(Cancel) {
+    Nan::HandleScope();
 
-            bool found = false;
-            for(int x = 0; x < colorsCount; x++)
-                if (pixel.red == colors[x].red && pixel.green == colors[x].green && pixel.blue == colors[x].blue) found = true;
+    if ( info.Length() < 1 || ! info[ 0 ]->IsNumber() ) {
+        return Nan::ThrowError("cancel()'s 1st argument should be a number");
+    }
 
-            if (!found) colors[index++] = pixel;
-            if (index >= colorsCount) break;
+    std::unordered_map< uint32_t, std::vector<uv_work_t*> >::iterator found = controlledJobs.find(Nan::To<uint32_t>(info[ 0 ]).FromJust());
+    if ( found == controlledJobs.end() ) {
+        info.GetReturnValue().Set(Nan::False());
+        return;
+    }
+    for (size_t i = 0; i < found->second.size(); i++) {
+        uv_work_t* req = found->second[ i ];
+        im_ctx_base* context = static_cast<im_ctx_base*>(req->data);
+        context->control->aborted = true;
+        // the job's after callback runs on a later turn of the loop, after this sets its error
+        if ( pool.Dequeue(req) ) {
+            context->error = context->control->Reason();
         }
-        if (index >= colorsCount) break;
     }
+    info.GetReturnValue().Set(Nan::True());
+}
 
-    Local<Object> out = Nan::New<Array>();
-
-    for(int x = 0; x < colorsCount; x++)
-        if (debug) printf("found rgb : %d %d %d\n", ((int) colors[x].red) / 255, ((int) colors[x].green) / 255, ((int) colors[x].blue) / 255);
-
-    for(int x = 0; x < colorsCount; x++) {
-        Local<Object> color = Nan::New<Object>();
-
-        int r = ((int) colors[x].red) / 255;
-        if (r > 255) r = 255;
-
-        int g = ((int) colors[x].green) / 255;
-        if (g > 255) g = 255;
+// input
+//   info[ 0 ]: options. optional, object with following key,values
+//              {
+//                  memory: optional. bytes of pixel cache all jobs together may use, 0 is unlimited
+//                  wait:   optional. default: true. async jobs wait for memory to be released instead of failing
+//              }
+// returns the settings and usage of the process wide memory budget
+NAN_METHOD(Limits) {
+    Nan::HandleScope();
 
-        int b = ((int) colors[x].blue) / 255;
-        if (b > 255) b = 255;
+    if ( info.Length() > 0 && ! info[ 0 ]->IsUndefined() ) {
+        if ( ! info[ 0 ]->IsObject() ) {
+            return Nan::ThrowError("limits()'s 1st argument should be an object");
+        }
+        Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
 
-        Nan::Set(color, Nan::New<String>("r").ToLocalChecked(), Nan::New<Integer>(r));
-        Nan::Set(color, Nan::New<String>("g").ToLocalChecked(), Nan::New<Integer>(g));
-        Nan::Set(color, Nan::New<String>("b").ToLocalChecked(), Nan::New<Integer>(b));
+        MagickCore::MagickSizeType memory = budget.Limit();
+        Local<Value> memoryValue = Nan::Get( obj, Nan::New<String>("memory").ToLocalChecked() ).ToLocalChecked();
+        if ( ! memoryValue->IsUndefined() ) {
+            memory = ToSize(memoryValue);
+        }
 
-        char hexcol[16];
-        snprintf(hexcol, sizeof hexcol, "%02x%02x%02x", r, g, b);
-        Nan::Set(color, Nan::New<String>("hex").ToLocalChecked(), Nan::New<String>(hexcol).ToLocalChecked());
+        bool wait = budget.Wait();
+        Local<Value> waitValue = Nan::Get( obj, Nan::New<String>("wait").ToLocalChecked() ).ToLocalChecked();
+        if ( ! waitValue->IsUndefined() ) {
+            wait = Nan::To<Boolean>(waitValue).ToLocalChecked()->IsTrue();
+        }
 
-        Nan::Set(out, x, color);
+        budget.Configure(memory, wait);
     }
 
-    delete[] colors;
+    Local<Object> out = Nan::New<Object>();
+    Nan::Set(out, Nan::New<String>("memory").ToLocalChecked(), Nan::New<Number>((double) budget.Limit()));
+    Nan::Set(out, Nan::New<String>("wait").ToLocalChecked(), Nan::New<Boolean>(budget.Wait()));
+    Nan::Set(out, Nan::New<String>("memoryInUse").ToLocalChecked(), Nan::New<Number>((double) budget.InUse()));
+    Nan::Set(out, Nan::New<String>("memoryPeak").ToLocalChecked(), Nan::New<Number>((double) budget.Peak()));
+    Nan::Set(out, Nan::New<String>("admitted").ToLocalChecked(), Nan::New<Number>((double) budget.Admitted()));
+    Nan::Set(out, Nan::New<String>("waited").ToLocalChecked(), Nan::New<Number>((double) budget.Waited()));
+    Nan::Set(out, Nan::New<String>("rejected").ToLocalChecked(), Nan::New<Number>((double) budget.Rejected()));
 
     info.GetReturnValue().Set(out);
 }
 
-void DoComposite(uv_work_t* req) {
-
-    composite_im_ctx* context = static_cast<composite_im_ctx*>(req->data);
-
-    MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, 1);
-
-    if (context->debug) printf( "debug: on\n" );
-    if (context->debug) printf( "ignoreWarnings: %d\n", context->ignoreWarnings );
-
-    Magick::Blob srcBlob( context->srcData, context->length );
-    Magick::Blob compositeBlob( context->compositeData, context->compositeLength );
-
-    Magick::Image image;
+// input
+//   info[ 0 ]: options. optional, object with following key,values
+//              {
+//                  memory: optional. bytes of results kept in memory, 0 keeps none and empties the memory tier
+//                  dir:    optional. existing directory results are also stored in, "" for none
+//              }
+// returns the settings and counters of the result cache of convert, identify and composite
+NAN_METHOD(Cache) {
+    Nan::HandleScope();
 
-    if ( !ReadImageMagick(&image, srcBlob, "", context) )
-        return;
+    if ( info.Length() > 0 && ! info[ 0 ]->IsUndefined() ) {
+        if ( ! info[ 0 ]->IsObject() ) {
+            return Nan::ThrowError("cache()'s 1st argument should be an object");
+        }
+        Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
 
-    Magick::GravityType gravityType;
+        MagickCore::MagickSizeType memory = cache.Limit();
+        Local<Value> memoryValue = Nan::Get( obj, Nan::New<String>("memory").ToLocalChecked() ).ToLocalChecked();
+        if ( ! memoryValue->IsUndefined() ) {
+            memory = ToSize(memoryValue);
+        }
 
-    const char* gravity = context->gravity.c_str();
+        std::string dir = cache.Dir();
+        Local<Value> dirValue = Nan::Get( obj, Nan::New<String>("dir").ToLocalChecked() ).ToLocalChecked();
+        if ( ! dirValue->IsUndefined() ) {
+            dir = *Nan::Utf8String(dirValue);
+        }
 
-    if(strcmp("CenterGravity", gravity)==0)         gravityType=Magick::CenterGravity;
-    else if(strcmp("EastGravity", gravity)==0)      gravityType=Magick::EastGravity;
-    else if(strcmp("ForgetGravity", gravity)==0)    gravityType=Magick::ForgetGravity;
-    else if(strcmp("NorthEastGravity", gravity)==0) gravityType=Magick::NorthEastGravity;
-    else if(strcmp("NorthGravity", gravity)==0)     gravityType=Magick::NorthGravity;
-    else if(strcmp("NorthWestGravity", gravity)==0) gravityType=Magick::NorthWestGravity;
-    else if(strcmp("SouthEastGravity", gravity)==0) gravityType=Magick::SouthEastGravity;
-    else if(strcmp("SouthGravity", gravity)==0)     gravityType=Magick::SouthGravity;
-    else if(strcmp("SouthWestGravity", gravity)==0) gravityType=Magick::SouthWestGravity;
-    else if(strcmp("WestGravity", gravity)==0)      gravityType=Magick::WestGravity;
-    else {
-        gravityType = Magick::ForgetGravity;
-        if (context->debug) printf( "invalid gravity: '%s' fell through to ForgetGravity\n", gravity);
+        cache.Configure(memory, dir);
     }
 
-    if (context->debug) printf( "gravity: %s (%d)\n", gravity,(int) gravityType);
+    Local<Object> out = Nan::New<Object>();
+    Nan::Set(out, Nan::New<String>("memory").ToLocalChecked(), Nan::New<Number>((double) cache.Limit()));
+    Nan::Set(out, Nan::New<String>("dir").ToLocalChecked(), Nan::New<String>(cache.Dir().c_str()).ToLocalChecked());
+    Nan::Set(out, Nan::New<String>("bytes").ToLocalChecked(), Nan::New<Number>((double) cache.Bytes()));
+    Nan::Set(out, Nan::New<String>("entries").ToLocalChecked(), Nan::New<Number>((double) cache.Entries()));
+    Nan::Set(out, Nan::New<String>("hits").ToLocalChecked(), Nan::New<Number>((double) cache.Hits()));
+    Nan::Set(out, Nan::New<String>("diskHits").ToLocalChecked(), Nan::New<Number>((double) cache.DiskHits()));
+    Nan::Set(out, Nan::New<String>("misses").ToLocalChecked(), Nan::New<Number>((double) cache.Misses()));
+    Nan::Set(out, Nan::New<String>("coalesced").ToLocalChecked(), Nan::New<Number>((double) cache.Coalesced()));
+    Nan::Set(out, Nan::New<String>("evictions").ToLocalChecked(), Nan::New<Number>((double) cache.Evictions()));
 
-    Magick::Image compositeImage;
-
-    if ( !ReadImageMagick(&compositeImage, compositeBlob, "", context) )
-        return;
-
-    image.composite(compositeImage,gravityType,Magick::OverCompositeOp);
-
-    Magick::Blob dstBlob;
-    image.write( &dstBlob );
-
-    context->dstBlob = dstBlob;
+    info.GetReturnValue().Set(out);
 }
 
-// input
-//   info[ 0 ]: options. required, object with following key,values
-//              {
-//                  srcData:        required. Buffer with binary image data
-//                  compositeData:  required. Buffer with image to composite
-//                  gravity:        optional. One of CenterGravity EastGravity
-//                                  ForgetGravity NorthEastGravity NorthGravity
-//                                  NorthWestGravity SouthEastGravity SouthGravity
-//                                  SouthWestGravity WestGravity
-//                  debug:          optional. 1 or 0
-//              }
-//   info[ 1 ]: callback. optional, if present runs async and returns result with callback(error, buffer)
-NAN_METHOD(Composite) {
+// returns a snapshot of the process wide counters: the pool's jobs, ImageMagick's resources in use,
+// and per operation calls, errors, bytes, megapixels and a latency histogram. Counters only grow.
+NAN_METHOD(Stats) {
     Nan::HandleScope();
 
-    bool isSync = (info.Length() == 1);
-
-    if ( info.Length() < 1 ) {
-        return Nan::ThrowError("composite() requires 1 (option) argument!");
-    }
-    Local<Object> obj = Local<Object>::Cast( info[ 0 ] );
-
-    Local<Object> srcData = Local<Object>::Cast( Nan::Get( obj, Nan::New<String>("srcData").ToLocalChecked() ).ToLocalChecked() );
-    if ( srcData->IsUndefined() || ! Buffer::HasInstance(srcData) ) {
-        return Nan::ThrowError("composite()'s 1st argument should have \"srcData\" key with a Buffer instance");
+    Local<Object> out = Nan::New<Object>();
+
+    Local<Object> out_pool = Nan::New<Object>();
+    Nan::Set(out_pool, Nan::New<String>("running").ToLocalChecked(), Nan::New<Integer>(pool.Running()));
+    Nan::Set(out_pool, Nan::New<String>("queued").ToLocalChecked(), Nan::New<Integer>(pool.Queued(InteractivePriority) + pool.Queued(BatchPriority)));
+    Nan::Set(out_pool, Nan::New<String>("cancelled").ToLocalChecked(), Nan::New<Number>(cancelledJobs.load()));
+    Nan::Set(out_pool, Nan::New<String>("timedOut").ToLocalChecked(), Nan::New<Number>(timedOutJobs.load()));
+    Nan::Set(out, Nan::New<String>("pool").ToLocalChecked(), out_pool);
+
+    // what ImageMagick currently holds, the pixel caches of all images alive in the process
+    Local<Object> out_magick = Nan::New<Object>();
+    Nan::Set(out_magick, Nan::New<String>("area").ToLocalChecked(), Nan::New<Number>((double) MagickCore::GetMagickResource(MagickCore::AreaResource)));
+    Nan::Set(out_magick, Nan::New<String>("memory").ToLocalChecked(), Nan::New<Number>((double) MagickCore::GetMagickResource(MagickCore::MemoryResource)));
+    Nan::Set(out_magick, Nan::New<String>("map").ToLocalChecked(), Nan::New<Number>((double) MagickCore::GetMagickResource(MagickCore::MapResource)));
+    Nan::Set(out_magick, Nan::New<String>("disk").ToLocalChecked(), Nan::New<Number>((double) MagickCore::GetMagickResource(MagickCore::DiskResource)));
+    Nan::Set(out_magick, Nan::New<String>("files").ToLocalChecked(), Nan::New<Number>((double) MagickCore::GetMagickResource(MagickCore::FileResource)));
+    Nan::Set(out, Nan::New<String>("magick").ToLocalChecked(), out_magick);
+
+    Nan::Set(out, Nan::New<String>("memoryInUse").ToLocalChecked(), Nan::New<Number>((double) budget.InUse()));
+    Nan::Set(out, Nan::New<String>("warningsIgnored").ToLocalChecked(), Nan::New<Number>((double) stats.WarningsIgnored()));
+    Nan::Set(out, Nan::New<String>("cacheSpills").ToLocalChecked(), Nan::New<Number>((double) stats.CacheSpills()));
+
+    Local<Object> out_errors = Nan::New<Object>();
+    std::map<std::string, uint64_t> errorsByStage = stats.ErrorsByStage();
+    for (std::map<std::string, uint64_t>::const_iterator it = errorsByStage.begin(); it != errorsByStage.end(); ++it) {
+        Nan::Set(out_errors, Nan::New<String>(it->first.c_str()).ToLocalChecked(), Nan::New<Number>((double) it->second));
     }
+    Nan::Set(out, Nan::New<String>("errorsByStage").ToLocalChecked(), out_errors);
 
-    Local<Object> compositeData = Local<Object>::Cast(
-            Nan::Get( obj, Nan::New<String>("compositeData").ToLocalChecked() ).ToLocalChecked() );
-    if ( compositeData->IsUndefined() || ! Buffer::HasInstance(compositeData) ) {
-        return Nan::ThrowError("composite()'s 1st argument should have \"compositeData\" key with a Buffer instance");
+    // upper bounds of the latency buckets, in ms
+    Local<Array> out_bounds = Nan::New<Array>(LatencyBucketCount);
+    for (int b = 0; b < LatencyBucketCount; b++) {
+        Nan::Set(out_bounds, b, Nan::New<Number>(b < LatencyBucketCount - 1 ? (double) ( (uint64_t) 1 << b ) : INFINITY));
     }
-
-    if( ! isSync && ! info[ 1 ]->IsFunction() ) {
-        return Nan::ThrowError("composite()'s 2nd argument should be a function");
+    Nan::Set(out, Nan::New<String>("latencyBuckets").ToLocalChecked(), out_bounds);
+
+    Local<Object> out_operations = Nan::New<Object>();
+    for (int i = 0; i < OperationCount; i++) {
+        const CallStats::operation_stats &op = stats.Operation(i);
+        Local<Object> out_op = Nan::New<Object>();
+        Nan::Set(out_op, Nan::New<String>("calls").ToLocalChecked(), Nan::New<Number>((double) op.calls.load(std::memory_order_relaxed)));
+        Nan::Set(out_op, Nan::New<String>("errors").ToLocalChecked(), Nan::New<Number>((double) op.errors.load(std::memory_order_relaxed)));
+        Nan::Set(out_op, Nan::New<String>("bytesIn").ToLocalChecked(), Nan::New<Number>((double) op.bytesIn.load(std::memory_order_relaxed)));
+        Nan::Set(out_op, Nan::New<String>("bytesOut").ToLocalChecked(), Nan::New<Number>((double) op.bytesOut.load(std::memory_order_relaxed)));
+        Nan::Set(out_op, Nan::New<String>("megapixels").ToLocalChecked(), Nan::New<Number>(op.pixels.load(std::memory_order_relaxed) / 1e6));
+        Nan::Set(out_op, Nan::New<String>("latencyMs").ToLocalChecked(), Nan::New<Number>(op.latencyUs.load(std::memory_order_relaxed) / 1e3));
+        Local<Array> out_latency = Nan::New<Array>(LatencyBucketCount);
+        for (int b = 0; b < LatencyBucketCount; b++) {
+            Nan::Set(out_latency, b, Nan::New<Number>((double) op.latency[ b ].load(std::memory_order_relaxed)));
+        }
+        Nan::Set(out_op, Nan::New<String>("latency").ToLocalChecked(), out_latency);
+        Nan::Set(out_operations, Nan::New<String>(operationNames[ i ]).ToLocalChecked(), out_op);
     }
+    Nan::Set(out, Nan::New<String>("operations").ToLocalChecked(), out_operations);
 
-    composite_im_ctx* context = new composite_im_ctx();
-    context->debug = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("debug").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-    context->ignoreWarnings = Nan::To<Uint32>(Nan::Get( obj, Nan::New<String>("ignoreWarnings").ToLocalChecked() ).ToLocalChecked()).ToLocalChecked()->Value();
-
-    context->srcData = Buffer::Data(srcData);
-    context->length = Buffer::Length(srcData);
-
-    context->compositeData = Buffer::Data(compositeData);
-    context->compositeLength = Buffer::Length(compositeData);
-
-    Local<Value> gravityValue = Nan::Get( obj, Nan::New<String>("gravity").ToLocalChecked() ).ToLocalChecked();
-    context->gravity = !gravityValue->IsUndefined() ?
-         *Nan::Utf8String(gravityValue) : "";
-
-    uv_work_t* req = new uv_work_t();
-    req->data = context;
-    if(!isSync) {
-        context->callback = new Nan::Callback(Local<Function>::Cast(info[1]));
+    info.GetReturnValue().Set(out);
+}
 
-        uv_queue_work(uv_default_loop(), req, DoComposite, (uv_after_work_cb)GeneratedBlobAfter);
+// MagickCore is set up by the first JS environment loading the addon and torn down with the last one,
+// unless the pool still runs a job of an environment that is gone
+static std::mutex magickMutex;
+static unsigned int magickInstances = 0;
 
-        return;
-    } else {
-        DoComposite(req);
-        RETURN_BLOB_OR_ERROR(req)
+void AcquireMagick() {
+    std::lock_guard<std::mutex> lock(magickMutex);
+    if ( magickInstances++ == 0 && ! MagickCore::IsMagickCoreInstantiated() ) {
+        // worker_threads must not install ImageMagick's signal handlers
+        MagickCore::MagickCoreGenesis(NULL, MagickCore::MagickFalse);
     }
 }
 
-NAN_METHOD(Version) {
-    Nan::HandleScope();
-
-    info.GetReturnValue().Set(Nan::New<String>(MagickLibVersionText).ToLocalChecked());
+void ReleaseMagick() {
+    std::lock_guard<std::mutex> lock(magickMutex);
+    if ( --magickInstances == 0 && ! pool.Running() ) {
+        MagickCore::MagickCoreTerminus();
+    }
 }
 
-NAN_METHOD(GetQuantumDepth) {
-    Nan::HandleScope();
+#if NODE_VERSION_AT_LEAST(14, 8, 0)
+// Frees the state of a JS environment that is torn down: a worker_thread exiting, or the main thread at exit.
+// Runs on the environment's thread, the teardown waits for done(doneArg).
+void CleanupInstance(void* arg, void (*done)(void*), void* doneArg) {
+    controlledJobs.clear();
+    cacheInFlight.clear();
+    // overlays hold images, they must go before MagickCore may be torn down
+    overlays.clear();
+    for (int i = 0; i < OptionKeyCount; i++) {
+        optionKeys[ i ].Reset();
+    }
+    delete[] optionKeys;
+    optionKeys = NULL;
 
-    info.GetReturnValue().Set(Nan::New<Integer>(MAGICKCORE_QUANTUM_DEPTH));
+    pool.ClosePort(done, doneArg);
+    ReleaseMagick();
 }
+#endif
 
+// Called once per JS environment loading the addon, on its thread
 void init(Local<Object> exports) {
+    AcquireMagick();
+#if NODE_VERSION_AT_LEAST(14, 8, 0)
+    node::AddEnvironmentCleanupHook(v8::Isolate::GetCurrent(), CleanupInstance, NULL);
+#endif
+    InitOptionKeys();
+    Converter::Init();
+    ImageHandle::Init();
+
     Nan::SetMethod(exports, "convert", Convert);
+    Nan::SetMethod(exports, "createConverter", CreateConverter);
+#ifdef IMAGEMAGICK_NATIVE_STREAMS
+    StreamInput::Init();
+    Nan::SetMethod(exports, "convertStream", ConvertStream);
+#endif
     Nan::SetMethod(exports, "identify", Identify);
     Nan::SetMethod(exports, "quantizeColors", QuantizeColors);
     Nan::SetMethod(exports, "composite", Composite);
+    Nan::SetMethod(exports, "registerOverlay", RegisterOverlay);
+    Nan::SetMethod(exports, "unregisterOverlay", UnregisterOverlay);
     Nan::SetMethod(exports, "version", Version);
     Nan::SetMethod(exports, "getConstPixels", GetConstPixels);
     Nan::SetMethod(exports, "quantumDepth", GetQuantumDepth); // QuantumDepth is already defined
+    Nan::SetMethod(exports, "threads", Threads);
+    Nan::SetMethod(exports, "pool", Pool);
+    Nan::SetMethod(exports, "cancel", Cancel);
+    Nan::SetMethod(exports, "limits", Limits);
+    Nan::SetMethod(exports, "cache", Cache);
+    Nan::SetMethod(exports, "stats", Stats);
+    Nan::SetMethod(exports, "load", Load);
+    Nan::SetMethod(exports, "fingerprint", Fingerprint);
+    Nan::Set(exports, Nan::New<String>("Image").ToLocalChecked(), ImageHandle::Constructor());
 }
 
 // There is no semi-colon after NODE_MODULE as it's not a function (see node.h).
 // see http://nodejs.org/api/addons.html
+// Context aware, so worker_threads can load it, where environments can release their handles asynchronously on teardown
+#if NODE_VERSION_AT_LEAST(14, 8, 0)
+NAN_MODULE_WORKER_ENABLED(imagemagick, init)
+#else
 NODE_MODULE(imagemagick, init)
+#endif
@@ -0,0 +1,67 @@
+// Measures how long the event loop is blocked when async convert() hands large outputs back to JS.
+// A setImmediate ticker records the longest gap between ticks while each convert runs,
+// the gap around the callback is the time spent in the after work callback.
+//
+//   node test/benchmark.after.js [iterations]
+var imagemagick = require('..')
+,   fs          = require('fs')
+,   path        = require('path')
+;
+
+var iterations = parseInt(process.argv[2], 10) || 5;
+
+var srcData = fs.readFileSync(path.join(__dirname, 'test.jpg'));
+
+// uncompressed 24 bit BMP, 3 bytes per pixel
+var sizes = [20, 50, 100].map(function (mb) {
+    var side = Math.round(Math.sqrt(mb * 1024 * 1024 / 3));
+    return { mb: mb, width: side, height: side };
+});
+
+function measure (size, done) {
+    var maxGap = 0, last = process.hrtime(), running = true;
+
+    (function tick () {
+        var diff = process.hrtime(last);
+        var ms   = diff[0] * 1e3 + diff[1] / 1e6;
+        if (ms > maxGap) maxGap = ms;
+        last = process.hrtime();
+        if (running) setImmediate(tick);
+    })();
+
+    imagemagick.convert({
+        srcData: srcData,
+        width: size.width,
+        height: size.height,
+        resizeStyle: 'fill',
+        format: 'BMP3',
+        shrinkOnLoad: false
+    }, function (err, buffer) {
+        if (err) throw err;
+        var length = buffer.length;
+        // let the ticker see the gap caused by this callback
+        setImmediate(function () {
+            running = false;
+            done(maxGap, length);
+        });
+    });
+}
+
+(function next () {
+    var size = sizes.shift();
+    if (!size) return;
+    var gaps = [], length = 0;
+    (function iterate () {
+        if (gaps.length === iterations) {
+            var mean = gaps.reduce(function (a, b) { return a + b; }, 0) / gaps.length;
+            console.log('%d MB output (%d bytes): %s ms mean, %s ms max loop block',
+                size.mb, length, mean.toFixed(2), Math.max.apply(null, gaps).toFixed(2));
+            return next();
+        }
+        measure(size, function (gap, outputLength) {
+            gaps.push(gap);
+            length = outputLength;
+            iterate();
+        });
+    })();
+})();
@@ -0,0 +1,50 @@
+// Compares resizing a large animated GIF with convert({ animated: true }) against the convert CLI
+// (-coalesce -resize -layers Optimize), for different per job thread budgets.
+// The source is generated with the CLI from test.jpg.
+//
+//   node test/benchmark.animated.js [width] [height] [frames] [iterations]
+var imagemagick  = require('..')
+,   execFileSync = require('child_process').execFileSync
+,   fs           = require('fs')
+,   os           = require('os')
+,   path         = require('path')
+;
+
+var width      = parseInt(process.argv[2], 10) || 1280;
+var height     = parseInt(process.argv[3], 10) || 720;
+var frames     = parseInt(process.argv[4], 10) || 60;
+var iterations = parseInt(process.argv[5], 10) || 5;
+
+var file = path.join(os.tmpdir(), 'benchmark.animated.' + width + 'x' + height + 'x' + frames + '.gif');
+var args = [path.join(__dirname, 'test.jpg'), '-resize', width + 'x' + height + '!'];
+for (var i = 1; i < frames; i++) {
+    // every frame differs a little from the previous one, like a pan over the picture
+    args.push('(', '-clone', '0', '-roll', '+' + (i * 4) + '+' + (i * 2), ')');
+}
+args.push('-set', 'delay', '4', '-loop', '0', file);
+execFileSync('convert', args);
+var srcData = fs.readFileSync(file);
+console.log('source: %dx%d GIF, %d frames, %d bytes, %d iterations, %d cores', width, height, frames, srcData.length, iterations, os.cpus().length);
+
+function time (run) {
+    var start = process.hrtime();
+    for (var i = 0; i < iterations; i++) run();
+    var diff = process.hrtime(start);
+    return (diff[0] * 1e3 + diff[1] / 1e6) / iterations;
+}
+
+var cli = time(function () {
+    execFileSync('convert', [file, '-coalesce', '-resize', '320x180', '-layers', 'Optimize', 'gif:-'], { maxBuffer: 1 << 30 });
+});
+console.log('convert CLI: %s ms per call', cli.toFixed(1));
+
+[1, 2, 4, os.cpus().length].filter(function (n, i, a) {
+    return n <= os.cpus().length && a.indexOf(n) === i;
+}).forEach(function (threads) {
+    var ms = time(function () {
+        imagemagick.convert({ srcData: srcData, animated: true, width: 320, height: 180, resizeStyle: 'aspectfit', threads: threads });
+    });
+    console.log('animated, threads %d: %s ms per call, %sx the CLI', threads, ms.toFixed(1), (cli / ms).toFixed(1));
+});
+
+fs.unlinkSync(file);
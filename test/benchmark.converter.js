@@ -0,0 +1,47 @@
+// Compares convert() with a converter created once by createConverter() on small thumbnails,
+// where parsing the options is a noticeable part of the main thread time.
+//
+//   node test/benchmark.converter.js [iterations]
+var imagemagick = require('..')
+,   fs          = require('fs')
+,   path        = require('path')
+;
+
+var iterations = parseInt(process.argv[2], 10) || 2000;
+
+var srcData = imagemagick.convert({
+    srcData: fs.readFileSync(path.join(__dirname, 'test.jpg')),
+    width: 64,
+    height: 64,
+    format: 'JPEG'
+});
+var options = {
+    width: 32,
+    height: 32,
+    resizeStyle: 'aspectfill',
+    gravity: 'North',
+    filter: 'Lanczos',
+    blur: 0.8,
+    format: 'JPEG',
+    quality: 80
+};
+console.log('source: 64x64 JPEG, %d iterations', iterations);
+
+function run (name, convert) {
+    var start = process.hrtime();
+    for (var i = 0; i < iterations; i++) {
+        convert();
+    }
+    var diff = process.hrtime(start);
+    var ms   = (diff[0] * 1e3 + diff[1] / 1e6) / iterations;
+    console.log('%s: %s ms per call, %s calls/s', name, ms.toFixed(3), (1000 / ms).toFixed(0));
+}
+
+var convertOptions = Object.assign({ srcData: srcData }, options);
+run('convert', function () {
+    imagemagick.convert(convertOptions);
+});
+var converter = imagemagick.createConverter(options);
+run('createConverter', function () {
+    converter.run(srcData);
+});
@@ -0,0 +1,64 @@
+// Compares identify() with a full decode against identify({ ping: true }).
+// Each mode runs in its own child process so that peak RSS is not shared.
+//
+//   node test/benchmark.identify.js [width] [height] [iterations]
+var imagemagick = require('..')
+,   fork        = require('child_process').fork
+,   fs          = require('fs')
+,   path        = require('path')
+;
+
+var width      = parseInt(process.argv[2], 10) || 8000;
+var height     = parseInt(process.argv[3], 10) || 6000;
+var iterations = parseInt(process.argv[4], 10) || 10;
+
+function run (mode, srcData) {
+    var start = process.hrtime();
+    for (var i = 0; i < iterations; i++) {
+        var info = imagemagick.identify({
+            srcData: srcData,
+            ping: mode === 'ping'
+        });
+        if (info.width !== width) throw new Error('unexpected width: ' + info.width);
+    }
+    var diff = process.hrtime(start);
+    var ms   = (diff[0] * 1e3 + diff[1] / 1e6) / iterations;
+    process.send({
+        mode: mode,
+        ms: ms,
+        maxRSS: process.resourceUsage().maxRSS / 1024 // MB
+    });
+}
+
+if (process.argv[2] === '--child') {
+    width      = parseInt(process.argv[5], 10);
+    iterations = parseInt(process.argv[6], 10);
+    run(process.argv[3], fs.readFileSync(process.argv[4]));
+    return;
+}
+
+var file = path.join(require('os').tmpdir(), 'benchmark.identify.' + width + 'x' + height + '.jpg');
+fs.writeFileSync(file, imagemagick.convert({
+    srcData: fs.readFileSync(path.join(__dirname, 'test.jpg')),
+    width: width,
+    height: height,
+    resizeStyle: 'fill',
+    format: 'JPEG',
+    quality: 90
+}));
+console.log('source: %dx%d JPEG, %d bytes, %d iterations', width, height, fs.statSync(file).size, iterations);
+
+var modes = ['read', 'ping'];
+(function next () {
+    var mode = modes.shift();
+    if (!mode) {
+        fs.unlinkSync(file);
+        return;
+    }
+    var child = fork(__filename, ['--child', mode, file, width, iterations]);
+    child.on('message', function (result) {
+        console.log('%s: %s ms per call, peak RSS %s MB', result.mode, result.ms.toFixed(2), result.maxRSS.toFixed(1));
+    });
+    child.on('exit', next);
+})();
+
@@ -0,0 +1,60 @@
+// Cost of autoOrient for each EXIF orientation on a large image, read from the "orient" stage of metrics.
+// Orientations 2, 5 and 7 used to take two passes over the pixels (a rotate and a flip),
+// their cost as two separate passes is shown next to the single fused transform.
+//
+//   node test/benchmark.orient.js [width] [height] [iterations]
+var imagemagick = require('..')
+,   fs          = require('fs')
+,   path        = require('path')
+;
+
+var width      = parseInt(process.argv[2], 10) || 6000;
+var height     = parseInt(process.argv[3], 10) || 4500;
+var iterations = parseInt(process.argv[4], 10) || 10;
+
+// the passes the orientations took before they were fused
+var passes = {
+    2: [{ rotate: 180 }, { flip: true }],
+    5: [{ flip: true }, { rotate: 90 }],
+    7: [{ flip: true }, { rotate: 270 }]
+};
+
+// ms of the "orient" stage of one convert of srcData to an uncompressed format
+function orient (srcData, options) {
+    var ms = 0;
+    imagemagick.convert(Object.assign({
+        srcData: srcData,
+        format: 'MIFF',
+        metrics: function (stages) { ms = stages.orient || 0; }
+    }, options));
+    return ms;
+}
+
+function mean (run) {
+    var total = 0;
+    for (var i = 0; i < iterations; i++) {
+        total += run();
+    }
+    return total / iterations;
+}
+
+console.log('%dx%d, %d iterations', width, height, iterations);
+for (var orientation = 1; orientation <= 8; orientation++) {
+    // MIFF keeps the orientation
+    var srcData = imagemagick.convert({
+        srcData: fs.readFileSync(path.join(__dirname, 'orientation-suite', 'Landscape_' + orientation + '.jpg')),
+        width: orientation < 5 ? width : height,
+        height: orientation < 5 ? height : width,
+        resizeStyle: 'fill',
+        format: 'MIFF'
+    });
+    var fused = mean(function () { return orient(srcData, { autoOrient: true }); });
+    if (!passes[orientation]) {
+        console.log('orientation %d: %s ms', orientation, fused.toFixed(1));
+        continue;
+    }
+    var separate = mean(function () {
+        return passes[orientation].reduce(function (ms, pass) { return ms + orient(srcData, pass); }, 0);
+    });
+    console.log('orientation %d: %s ms fused, %s ms as %d separate passes', orientation, fused.toFixed(1), separate.toFixed(1), passes[orientation].length);
+}
@@ -0,0 +1,74 @@
+// Compares converting a large TIFF through Buffers (fs.readFileSync, srcData, fs.writeFileSync)
+// against srcPath/dstPath, where the worker maps the source and writes the result itself.
+// Each mode runs in its own child process so that peak RSS is not shared.
+//
+//   node test/benchmark.paths.js [width] [height] [iterations]
+var imagemagick = require('..')
+,   fork        = require('child_process').fork
+,   fs          = require('fs')
+,   os          = require('os')
+,   path        = require('path')
+;
+
+var width      = parseInt(process.argv[2], 10) || 8000;
+var height     = parseInt(process.argv[3], 10) || 6000;
+var iterations = parseInt(process.argv[4], 10) || 5;
+
+var options = { width: 1600, height: 1600, resizeStyle: 'aspectfit', format: 'JPEG', quality: 85 };
+
+function run (mode, srcPath, dstPath, done) {
+    if (mode === 'buffer') {
+        return imagemagick.convert(Object.assign({ srcData: fs.readFileSync(srcPath) }, options), function (err, buffer) {
+            if (err) throw err;
+            fs.writeFileSync(dstPath, buffer);
+            done();
+        });
+    }
+    imagemagick.convert(Object.assign({ srcPath: srcPath, dstPath: dstPath }, options), function (err) {
+        if (err) throw err;
+        done();
+    });
+}
+
+if (process.argv[2] === '--child') {
+    var mode = process.argv[3], srcPath = process.argv[4], dstPath = srcPath + '.' + mode + '.jpg';
+    iterations = parseInt(process.argv[5], 10);
+    var start = process.hrtime(), done = 0;
+    (function next () {
+        if (done++ === iterations) {
+            var diff = process.hrtime(start);
+            fs.unlinkSync(dstPath);
+            return process.send({
+                mode: mode,
+                ms: (diff[0] * 1e3 + diff[1] / 1e6) / iterations,
+                maxRSS: process.resourceUsage().maxRSS / 1024 // MB
+            });
+        }
+        run(mode, srcPath, dstPath, next);
+    })();
+    return;
+}
+
+var file = path.join(os.tmpdir(), 'benchmark.paths.' + width + 'x' + height + '.tif');
+fs.writeFileSync(file, imagemagick.convert({
+    srcData: fs.readFileSync(path.join(__dirname, 'test.jpg')),
+    width: width,
+    height: height,
+    resizeStyle: 'fill',
+    format: 'TIFF'
+}));
+console.log('source: %dx%d TIFF, %d MB, %d iterations', width, height, (fs.statSync(file).size / 1024 / 1024).toFixed(1), iterations);
+
+var modes = ['buffer', 'path'];
+(function next () {
+    var mode = modes.shift();
+    if (!mode) {
+        fs.unlinkSync(file);
+        return;
+    }
+    var child = fork(__filename, ['--child', mode, file, iterations]);
+    child.on('message', function (result) {
+        console.log('%s: %s ms per call, peak RSS %s MB', result.mode, result.ms.toFixed(2), result.maxRSS.toFixed(1));
+    });
+    child.on('exit', next);
+})();
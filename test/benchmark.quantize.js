@@ -0,0 +1,40 @@
+// Times quantizeColors() over the test images, one by one and on the worker pool.
+//
+//   node test/benchmark.quantize.js [iterations]
+var imagemagick = require('..')
+,   fs          = require('fs')
+,   path        = require('path')
+;
+
+var iterations = parseInt(process.argv[2], 10) || 20;
+
+var images = fs.readdirSync(__dirname).filter(function (name) {
+    return /\.(jpg|png)$/.test(name) && name !== 'broken.png';
+}).map(function (name) {
+    return { name: name, srcData: fs.readFileSync(path.join(__dirname, name)) };
+});
+
+images.forEach(function (image) {
+    var start = process.hrtime();
+    for (var i = 0; i < iterations; i++) {
+        imagemagick.quantizeColors({ srcData: image.srcData, colors: 5 });
+    }
+    var diff = process.hrtime(start);
+    console.log('%s: %s ms per call', image.name, ((diff[0] * 1e3 + diff[1] / 1e6) / iterations).toFixed(2));
+});
+
+var jobs = images.length * iterations, finished = 0;
+var start = process.hrtime();
+images.forEach(function (image) {
+    for (var i = 0; i < iterations; i++) {
+        imagemagick.quantizeColors({ srcData: image.srcData, colors: 5 }, function (err) {
+            if (err) throw err;
+            if (++finished === jobs) {
+                var diff = process.hrtime(start);
+                var ms   = diff[0] * 1e3 + diff[1] / 1e6;
+                console.log('async: %d calls in %s ms, %s calls/s on %d workers',
+                    jobs, ms.toFixed(1), (jobs / ms * 1000).toFixed(1), imagemagick.pool().size);
+            }
+        });
+    }
+});
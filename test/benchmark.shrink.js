@@ -0,0 +1,45 @@
+// Compares thumbnail generation with and without the JPEG decode size hint.
+//
+//   node test/benchmark.shrink.js [width] [height] [iterations]
+var imagemagick = require('..')
+,   fs          = require('fs')
+,   path        = require('path')
+;
+
+var width      = parseInt(process.argv[2], 10) || 4000;
+var height     = parseInt(process.argv[3], 10) || 3000;
+var iterations = parseInt(process.argv[4], 10) || 20;
+
+var srcData = imagemagick.convert({
+    srcData: fs.readFileSync(path.join(__dirname, 'test.jpg')),
+    width: width,
+    height: height,
+    resizeStyle: 'fill',
+    format: 'JPEG',
+    quality: 90
+});
+console.log('source: %dx%d JPEG, %d bytes, %d iterations', width, height, srcData.length, iterations);
+
+function run (resizeStyle, shrinkOnLoad) {
+    var start = process.hrtime();
+    for (var i = 0; i < iterations; i++) {
+        imagemagick.convert({
+            srcData: srcData,
+            width: 48,
+            height: 48,
+            resizeStyle: resizeStyle,
+            quality: 80,
+            format: 'JPEG',
+            shrinkOnLoad: shrinkOnLoad
+        });
+    }
+    var diff = process.hrtime(start);
+    return (diff[0] * 1e3 + diff[1] / 1e6) / iterations;
+}
+
+['aspectfill', 'aspectfit', 'fill'].forEach(function (resizeStyle) {
+    var full   = run(resizeStyle, false);
+    var shrunk = run(resizeStyle, true);
+    console.log('%s: %s ms full decode, %s ms shrinkOnLoad, %sx faster',
+        resizeStyle, full.toFixed(2), shrunk.toFixed(2), (full / shrunk).toFixed(1));
+});
@@ -0,0 +1,179 @@
+// Self-contained benchmark of the async API, without the imagemagick CLI.
+// Every operation runs over a corpus of sizes and formats generated from test.jpg,
+// reporting latency percentiles, throughput, peak RSS and the peak pixel cache estimate.
+//
+//   npm run bench -- [--concurrency 4] [--iterations 50] [--filter convert] [--json [file]]
+//
+// With --json the results are written as JSON (to stdout or file) so runs can be diffed between versions.
+var imagemagick = require('..')
+,   fs          = require('fs')
+,   os          = require('os')
+,   path        = require('path')
+;
+
+function option (name, fallback) {
+    var index = process.argv.indexOf('--' + name);
+    if (index === -1) return fallback;
+    var value = process.argv[index + 1];
+    return value === undefined || value.indexOf('--') === 0 ? true : value;
+}
+
+var concurrency = parseInt(option('concurrency', 4), 10);
+var iterations  = parseInt(option('iterations', 50), 10);
+var filter      = new RegExp(option('filter', '.'));
+var json        = option('json', false);
+
+var sizes   = [[640, 480], [1920, 1080], [4000, 3000]];
+var formats = ['JPEG', 'PNG'];
+
+var source = fs.readFileSync(path.join(__dirname, 'test.jpg'));
+var corpus = [];
+sizes.forEach(function (size) {
+    formats.forEach(function (format) {
+        corpus.push({
+            name: size[0] + 'x' + size[1] + '.' + format.toLowerCase(),
+            srcData: imagemagick.convert({
+                srcData: source,
+                width: size[0],
+                height: size[1],
+                resizeStyle: 'fill',
+                format: format,
+                quality: 90
+            })
+        });
+    });
+});
+var overlay = fs.readFileSync(path.join(__dirname, 'test.png'));
+
+var operations = {};
+['aspectfill', 'aspectfit', 'fill', 'crop'].forEach(function (resizeStyle) {
+    operations['convert ' + resizeStyle] = function (srcData, done) {
+        imagemagick.convert({
+            srcData: srcData,
+            width: 320,
+            height: 240,
+            resizeStyle: resizeStyle,
+            format: 'JPEG',
+            quality: 80
+        }, done);
+    };
+});
+operations['identify'] = function (srcData, done) {
+    imagemagick.identify({ srcData: srcData }, done);
+};
+operations['identify ping'] = function (srcData, done) {
+    imagemagick.identify({ srcData: srcData, ping: true }, done);
+};
+operations['composite'] = function (srcData, done) {
+    imagemagick.composite({ srcData: srcData, compositeData: overlay, gravity: 'SouthEastGravity' }, done);
+};
+imagemagick.registerOverlay('overlay', overlay);
+operations['composite layers'] = function (srcData, done) {
+    imagemagick.composite({ srcData: srcData, layers: [
+        { overlay: 'overlay', gravity: 'SouthEast', x: 8, y: 8, opacity: 0.6 },
+        { overlay: 'overlay', gravity: 'NorthWest', compose: 'Multiply' }
+    ] }, done);
+};
+operations['getConstPixels'] = function (srcData, done) {
+    imagemagick.getConstPixels({ srcData: srcData, x: 0, y: 0, columns: 224, rows: 224, map: 'RGB' }, done);
+};
+operations['quantizeColors'] = function (srcData, done) {
+    imagemagick.quantizeColors({ srcData: srcData, colors: 5 }, done);
+};
+
+function percentile (sorted, p) {
+    return sorted[Math.min(sorted.length - 1, Math.ceil(p / 100 * sorted.length) - 1)];
+}
+
+function run (operation, image, done) {
+    var latencies = [], started = 0, finished = 0, peakRSS = 0, peakPixelCache = 0;
+
+    // the memory budget only accounts for images when it is set, make it large enough to never block
+    imagemagick.limits({ memory: Number.MAX_SAFE_INTEGER });
+
+    function sample () {
+        peakRSS        = Math.max(peakRSS, process.memoryUsage().rss);
+        peakPixelCache = Math.max(peakPixelCache, imagemagick.limits().memoryInUse);
+    }
+    var sampler = setInterval(sample, 10);
+    var start = process.hrtime();
+
+    function next () {
+        if (started >= iterations) return;
+        started++;
+        var jobStart = process.hrtime();
+        operations[operation](image.srcData, function (err) {
+            if (err) throw err;
+            var diff = process.hrtime(jobStart);
+            latencies.push(diff[0] * 1e3 + diff[1] / 1e6);
+            if (++finished < iterations) return next();
+
+            clearInterval(sampler);
+            sample();
+            var elapsed = process.hrtime(start);
+            var ms      = elapsed[0] * 1e3 + elapsed[1] / 1e6;
+            var sorted  = latencies.sort(function (a, b) { return a - b; });
+            imagemagick.limits({ memory: 0 });
+            done({
+                operation: operation,
+                image: image.name,
+                iterations: iterations,
+                concurrency: concurrency,
+                p50: percentile(sorted, 50),
+                p95: percentile(sorted, 95),
+                p99: percentile(sorted, 99),
+                opsPerSec: iterations / ms * 1000,
+                peakRSS: peakRSS,
+                // sampled peak of the estimated pixel cache of all running jobs
+                peakPixelCache: peakPixelCache
+            });
+        });
+    }
+    for (var i = 0; i < concurrency; i++) next();
+}
+
+var queue = [];
+Object.keys(operations).forEach(function (operation) {
+    corpus.forEach(function (image) {
+        if (filter.test(operation + ' ' + image.name)) queue.push([operation, image]);
+    });
+});
+
+var results = [];
+function mb (bytes) {
+    return (bytes / 1024 / 1024).toFixed(1);
+}
+
+if (!json) {
+    console.log('imagemagick %s, %d cores, %d pool workers, concurrency %d, %d iterations',
+        imagemagick.version(), os.cpus().length, imagemagick.pool().size, concurrency, iterations);
+}
+(function next () {
+    var item = queue.shift();
+    if (!item) {
+        if (!json) return;
+        var report = JSON.stringify({
+            version: require('../package.json').version,
+            imagemagick: imagemagick.version(),
+            node: process.version,
+            cores: os.cpus().length,
+            poolSize: imagemagick.pool().size,
+            results: results
+        }, null, 2);
+        if (json === true) {
+            console.log(report);
+        } else {
+            fs.writeFileSync(json, report);
+        }
+        return;
+    }
+    run(item[0], item[1], function (result) {
+        results.push(result);
+        if (!json) {
+            console.log('%s %s: p50 %s ms, p95 %s ms, p99 %s ms, %s ops/s, peak RSS %s MB, pixel cache %s MB',
+                result.operation, result.image, result.p50.toFixed(2), result.p95.toFixed(2), result.p99.toFixed(2),
+                result.opsPerSec.toFixed(1), mb(result.peakRSS), mb(result.peakPixelCache));
+        }
+        next();
+    });
+})();
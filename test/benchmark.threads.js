@@ -0,0 +1,65 @@
+// Compares latency and throughput of resizing a large image with different per job thread budgets.
+//
+//   node test/benchmark.threads.js [width] [height] [jobs] [concurrency]
+var imagemagick = require('..')
+,   fs          = require('fs')
+,   os          = require('os')
+,   path        = require('path')
+;
+
+var width       = parseInt(process.argv[2], 10) || 6000;
+var height      = parseInt(process.argv[3], 10) || 4000;
+var jobs        = parseInt(process.argv[4], 10) || 8;
+var concurrency = parseInt(process.argv[5], 10) || 1;
+
+var srcData = imagemagick.convert({
+    srcData: fs.readFileSync(path.join(__dirname, 'test.jpg')),
+    width: width,
+    height: height,
+    resizeStyle: 'fill',
+    format: 'TIFF'
+});
+console.log('source: %dx%d TIFF, %d jobs, concurrency %d, %d cores', width, height, jobs, concurrency, os.cpus().length);
+
+function run (threads, done) {
+    var started = 0, finished = 0, latencies = [];
+    var start = Date.now();
+
+    function next () {
+        if (started >= jobs) return;
+        started++;
+        var jobStart = Date.now();
+        imagemagick.convert({
+            srcData: srcData,
+            width: Math.round(width / 3),
+            height: Math.round(height / 3),
+            filter: 'Lanczos',
+            blur: 1.2,
+            format: 'JPEG',
+            shrinkOnLoad: false,
+            threads: threads
+        }, function (err) {
+            if (err) throw err;
+            latencies.push(Date.now() - jobStart);
+            if (++finished === jobs) {
+                var elapsed = Date.now() - start;
+                var mean    = latencies.reduce(function (a, b) { return a + b; }, 0) / latencies.length;
+                return done(mean, jobs / elapsed * 1000);
+            }
+            next();
+        });
+    }
+    for (var i = 0; i < concurrency; i++) next();
+}
+
+var budgets = [1, 2, 4, os.cpus().length].filter(function (n, i, a) {
+    return n <= os.cpus().length && a.indexOf(n) === i;
+});
+(function nextBudget () {
+    var threads = budgets.shift();
+    if (!threads) return;
+    run(threads, function (mean, throughput) {
+        console.log('threads %d: %s ms mean latency, %s jobs/s', threads, mean.toFixed(1), throughput.toFixed(2));
+        nextBudget();
+    });
+})();
@@ -0,0 +1,63 @@
+// Sync convert throughput with the same number of jobs spread over 1, 2, 4 … worker_threads.
+// Needs Node.js 14.8 or later.
+//
+//   node test/benchmark.workers.js [width] [height] [jobs]
+var imagemagick = require('..')
+,   fs          = require('fs')
+,   os          = require('os')
+,   path        = require('path')
+,   Worker      = require('worker_threads').Worker
+;
+
+var width  = parseInt(process.argv[2], 10) || 1920;
+var height = parseInt(process.argv[3], 10) || 1080;
+var jobs   = parseInt(process.argv[4], 10) || 64;
+
+var srcData = imagemagick.convert({
+    srcData: fs.readFileSync(path.join(__dirname, 'test.jpg')),
+    width: width,
+    height: height,
+    resizeStyle: 'fill',
+    format: 'JPEG',
+    quality: 90
+});
+console.log('source: %dx%d JPEG, %d jobs, %d cores', width, height, jobs, os.cpus().length);
+
+// each worker converts its share synchronously, blocking only its own thread
+var worker = [
+    "var imagemagick = require(" + JSON.stringify(path.join(__dirname, '..')) + ");",
+    "var wt = require('worker_threads');",
+    "var srcData = Buffer.from(wt.workerData.srcData);",
+    "for (var i = 0; i < wt.workerData.jobs; i++) {",
+    "    imagemagick.convert({ srcData: srcData, width: 320, height: 240, format: 'JPEG', quality: 80 });",
+    "}"
+].join('\n');
+
+function run (workers, done) {
+    var exited = 0;
+    var start = process.hrtime();
+    for (var i = 0; i < workers; i++) {
+        var share = Math.floor(jobs / workers) + (i < jobs % workers ? 1 : 0);
+        new Worker(worker, { eval: true, workerData: { srcData: srcData, jobs: share } })
+            .on('error', function (err) { throw err; })
+            .on('exit', function () {
+                if (++exited < workers) return;
+                var diff = process.hrtime(start);
+                done(jobs / (diff[0] + diff[1] / 1e9));
+            });
+    }
+}
+
+var counts = [1, 2, 4, os.cpus().length].filter(function (n, i, a) {
+    return n <= os.cpus().length && a.indexOf(n) === i;
+});
+var single;
+(function next () {
+    var workers = counts.shift();
+    if (!workers) return;
+    run(workers, function (throughput) {
+        single = single || throughput;
+        console.log('workers %d: %s jobs/s, %sx', workers, throughput.toFixed(1), (throughput / single).toFixed(2));
+        next();
+    });
+})();
@@ -0,0 +1,74 @@
+var test        = require('tap').test
+,   imagemagick = require('..')
+,   fs          = require('fs')
+;
+
+process.chdir(__dirname);
+
+// 40x30, 3 frames: a full red canvas then 10x10 blue and green patches drawn over it
+var srcData = fs.readFileSync( "test.animated.gif" );
+
+// counts the image descriptors of a GIF by walking its blocks
+function gifFrames (buffer) {
+    var position = 13, frames = 0;
+    if ( buffer[ 10 ] & 0x80 ) position += 3 * (1 << ((buffer[ 10 ] & 7) + 1));
+    while ( position < buffer.length ) {
+        var block = buffer[ position ];
+        if ( block === 0x3b ) break;
+        if ( block === 0x21 ) {
+            position += 2;
+        } else {
+            frames++;
+            var flags = buffer[ position + 9 ];
+            position += 10;
+            if ( flags & 0x80 ) position += 3 * (1 << ((flags & 7) + 1));
+            position++; // LZW minimum code size
+        }
+        while ( buffer[ position ] ) position += buffer[ position ] + 1;
+        position++;
+    }
+    return frames;
+}
+
+test( 'animated keeps every frame', function (t) {
+    t.equal( gifFrames(srcData), 3 );
+    t.equal( gifFrames(imagemagick.convert({ srcData: srcData, width: 20, height: 20, format: 'GIF' })), 1, 'first frame by default' );
+
+    var buffer = imagemagick.convert({ srcData: srcData, animated: true, width: 20, height: 20, format: 'GIF' });
+    t.equal( gifFrames(buffer), 3 );
+    var info = imagemagick.identify({ srcData: buffer });
+    t.equal( info.width, 20 );
+    t.equal( info.height, 20 );
+    t.end();
+});
+
+test( 'animated renditions and threads', function (t) {
+    var single = imagemagick.convert({ srcData: srcData, animated: true, width: 16, height: 12, resizeStyle: 'fill', threads: 1 });
+    var buffers = imagemagick.convert({ srcData: srcData, animated: true, threads: 3, outputs: [
+        { width: 16, height: 12, resizeStyle: 'fill' },
+        { width: 10, height: 10, format: 'PNG' }
+    ] });
+    t.ok( buffers[ 0 ].equals(single), 'frames spread over threads give the same result' );
+    t.equal( imagemagick.identify({ srcData: buffers[ 1 ] }).format, 'PNG', 'formats without animation get the first frame' );
+    t.end();
+});
+
+test( 'animated async with limits', function (t) {
+    imagemagick.convert({ srcData: srcData, animated: true, width: 20, height: 20, maxPixels: 40 * 30 * 2 }, function (err) {
+        t.equal( err.message, 'image exceeds maxPixels', 'limits count every frame' );
+
+        imagemagick.convert({ srcData: srcData, animated: true, width: 20, height: 20 }, function (err, buffer) {
+            t.equal( err, undefined );
+            t.equal( gifFrames(buffer), 3 );
+            t.end();
+        });
+    });
+});
+
+test( 'animated single frame source', function (t) {
+    var jpeg = fs.readFileSync( "test.jpg" );
+    var options = { width: 10, height: 10, shrinkOnLoad: false };
+    t.ok( imagemagick.convert(Object.assign({ srcData: jpeg, animated: true }, options))
+        .equals(imagemagick.convert(Object.assign({ srcData: jpeg }, options))) );
+    t.end();
+});
@@ -33,6 +33,24 @@ test( 'convert filter Lagrange', function (t) {
     });
 });
 
+test( 'convert multiple outputs async', function (t) {
+    imagemagick.convert({
+        srcData: require('fs').readFileSync( "test.png" ), // 58x66
+        format: 'PNG',
+        outputs: [
+            { width: 10, height: 10 },
+            { width: 20, height: 20, format: 'JPEG' }
+        ],
+        debug: debug
+    },function(err,buffers){
+        t.equal( err, undefined );
+        t.equal( buffers.length, 2 );
+        t.equal( imagemagick.identify({srcData: buffers[0]}).format, 'PNG' );
+        t.equal( imagemagick.identify({srcData: buffers[1]}).format, 'JPEG' );
+        t.end();
+    });
+});
+
 test( 'identify results async', function (t) {
     t.plan(5);
     imagemagick.identify({
@@ -59,3 +77,68 @@ test( 'composite async', function (t) {
         t.end();
     });
 });
+
+test( 'getConstPixels raw async', function (t) {
+    imagemagick.getConstPixels({
+        srcData: require('fs').readFileSync( "test.png" ),
+        x: 0,
+        y: 0,
+        columns: 58,
+        rows: 66,
+        map: 'RGBA'
+    },function(err,pixels){
+        t.equal( err, undefined );
+        t.ok( pixels instanceof Uint8Array, 'pixels is a Uint8Array' );
+        t.equal( pixels.length, 58 * 66 * 4 );
+        t.end();
+    });
+});
+
+test( 'quantizeColors async', function (t) {
+    var srcData = require('fs').readFileSync( "test.quantizeColors.png" );
+    var sync    = imagemagick.quantizeColors({ srcData: srcData, colors: 3 });
+    imagemagick.quantizeColors({
+        srcData: srcData,
+        colors: 3
+    },function(err,results){
+        t.equal( err, undefined );
+        t.same( results, sync, 'same palette as the sync call' );
+        t.end();
+    });
+});
+
+test( 'convert metrics async', function (t) {
+    var timings;
+    imagemagick.convert({
+        srcData: require('fs').readFileSync( "test.jpg" ),
+        width: 20,
+        height: 20,
+        resizeStyle: 'aspectfill',
+        metrics: function (m) { timings = m; }
+    },function(err,buffer){
+        t.equal( err, undefined );
+        t.equal( typeof timings, 'object', 'metrics were reported before the callback' );
+        ['queueWait', 'decode', 'zoom', 'extent', 'encode', 'total'].forEach(function (stage) {
+            t.equal( typeof timings[stage], 'number', stage + ' is timed' );
+        });
+        t.equal( timings.total >= timings.decode + timings.encode, true, 'total covers the stages' );
+        t.end();
+    });
+});
+
+test( 'createConverter async', function (t) {
+    t.plan(4);
+    var timings;
+    var converter = imagemagick.createConverter({
+        width: 10,
+        height: 10,
+        format: 'PNG',
+        metrics: function (m) { timings = m; }
+    });
+    converter.run(require('fs').readFileSync('test.png'), function (err, buffer) {
+        t.equal(err, undefined);
+        t.ok(Buffer.isBuffer(buffer));
+        t.equal(imagemagick.identify({ srcData: buffer }).width, 10);
+        t.equal(typeof timings.decode, 'number');
+    });
+});
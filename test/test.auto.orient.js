@@ -44,3 +44,69 @@ test( 'convert autoOrient option', function (t) {
     t.end();
 
 });
+
+// A small lossless copy of a converted image, to compare pixels across orientations
+function thumbnail (buffer) {
+    return imagemagick.getConstPixels({
+        srcData: imagemagick.convert({ srcData: buffer, width: 60, height: 45, resizeStyle: 'fill', format: 'PNG' }),
+        x: 0, y: 0, columns: 60, rows: 45, map: 'RGB'
+    });
+}
+
+function meanDifference (a, b) {
+    var sum = 0;
+    for (var i = 0; i < a.length; i++) {
+        sum += Math.abs(a[i] - b[i]);
+    }
+    return sum / a.length;
+}
+
+test( 'autoOrient makes every orientation of the suite upright', function (t) {
+    var upright = thumbnail( fs.readFileSync( path.join(__dirname, 'orientation-suite', testFiles[0]) ) );
+    testFiles.forEach( function (f) {
+        var buffer = imagemagick.convert({
+            srcData: fs.readFileSync( path.join(__dirname, 'orientation-suite', f) ),
+            format: 'PNG',
+            autoOrient: true
+        });
+        var info = imagemagick.identify({ srcData: buffer });
+        t.equal( info.width, 600, f + ' width' );
+        t.equal( info.height, 450, f + ' height' );
+        t.ok( info.exif.orientation <= 1, f + ' orientation is reset' );
+        t.ok( meanDifference( thumbnail(buffer), upright ) < 8, f + ' matches Landscape_1' );
+    });
+    t.end();
+});
+
+test( 'autoOrient, rotate and flip compose like separate passes', function (t) {
+    var srcData = imagemagick.convert({
+        srcData: fs.readFileSync( path.join(__dirname, 'orientation-suite', 'Landscape_1.jpg') ),
+        width: 30, height: 20, resizeStyle: 'fill', format: 'PNG'
+    });
+    function pixels (buffer) {
+        var info = imagemagick.identify({ srcData: buffer });
+        return imagemagick.getConstPixels({ srcData: buffer, x: 0, y: 0, columns: info.width, rows: info.height, map: 'RGB' });
+    }
+    [-90, 0, 90, 180, 270, 450].forEach( function (rotate) {
+        [false, true].forEach( function (flip) {
+            var fused = imagemagick.convert({ srcData: srcData, rotate: rotate, flip: flip, format: 'PNG' });
+            var steps = imagemagick.convert({ srcData: srcData, rotate: rotate, format: 'PNG' });
+            if (flip) {
+                steps = imagemagick.convert({ srcData: steps, flip: true, format: 'PNG' });
+            }
+            t.same( pixels(fused), pixels(steps), 'rotate ' + rotate + (flip ? ' flip' : '') );
+        });
+    });
+
+    // the orientation is corrected first, then rotate and flip apply
+    [5, 6, 7].forEach( function (orientation) {
+        var source = fs.readFileSync( path.join(__dirname, 'orientation-suite', 'Landscape_' + orientation + '.jpg') );
+        var fused  = imagemagick.convert({ srcData: source, autoOrient: true, rotate: 90, flip: true, format: 'PNG' });
+        var steps  = imagemagick.convert({ srcData: source, autoOrient: true, format: 'PNG' });
+        steps = imagemagick.convert({ srcData: steps, rotate: 90, format: 'PNG' });
+        steps = imagemagick.convert({ srcData: steps, flip: true, format: 'PNG' });
+        t.same( pixels(fused), pixels(steps), 'Landscape_' + orientation + ' autoOrient rotate 90 flip' );
+        t.equal( imagemagick.identify({ srcData: fused }).width, 450 );
+    });
+    t.end();
+});
@@ -0,0 +1,125 @@
+var test        = require('tap').test
+,   imagemagick = require('..')
+,   fs          = require('fs')
+,   os          = require('os')
+,   path        = require('path')
+;
+
+process.chdir(__dirname);
+
+var options = {
+    srcData: fs.readFileSync( "test.jpg" ),
+    width: 10,
+    height: 10,
+    format: 'PNG'
+};
+
+test( 'cache disabled by default', function (t) {
+    var state = imagemagick.cache();
+    t.equal( state.memory, 0 );
+    t.equal( state.dir, '' );
+    imagemagick.convert(options);
+    t.equal( imagemagick.cache().misses, 0, 'calls are not cached' );
+    t.end();
+});
+
+test( 'cache memory tier', function (t) {
+    imagemagick.cache({ memory: 1024 * 1024 });
+    var first  = imagemagick.convert(options);
+    var second = imagemagick.convert({ format: 'PNG', height: 10, width: 10, srcData: options.srcData });
+    t.ok( first.equals(second) );
+
+    var state = imagemagick.cache();
+    t.equal( state.misses, 1 );
+    t.equal( state.hits, 1, 'the same options in another order hit' );
+    t.equal( state.entries, 1 );
+
+    second[0] ^= 0xff;
+    t.ok( imagemagick.convert(options).equals(first), 'results do not alias the cache' );
+
+    imagemagick.convert({ srcData: options.srcData, width: 11, height: 10, format: 'PNG' });
+    imagemagick.convert({ srcData: options.srcData, width: 10, height: 10, format: 'PNG', cache: false });
+    t.equal( imagemagick.cache().misses, 2, 'other options miss, cache: false skips the cache' );
+
+    var info = imagemagick.identify({ srcData: options.srcData });
+    t.same( imagemagick.identify({ srcData: options.srcData }), info );
+    t.equal( imagemagick.cache().hits, 3 );
+
+    imagemagick.cache({ memory: 0 });
+    t.equal( imagemagick.cache().entries, 0 );
+    t.equal( imagemagick.cache().bytes, 0 );
+    t.end();
+});
+
+test( 'cached results keep the limits of the call', function (t) {
+    imagemagick.cache({ memory: 1024 * 1024 });
+    var hits = imagemagick.cache().hits;
+    imagemagick.convert(options);
+    t.throws( function () {
+        imagemagick.convert({ srcData: options.srcData, width: 10, height: 10, format: 'PNG', maxPixels: 100 });
+    }, /image exceeds maxPixels/, 'convert' );
+    imagemagick.identify({ srcData: options.srcData });
+    t.throws( function () {
+        imagemagick.identify({ srcData: options.srcData, maxMemory: 1024 });
+    }, /image exceeds maxMemory/, 'identify' );
+    t.equal( imagemagick.cache().hits, hits, 'neither call is answered by the cache' );
+
+    imagemagick.cache({ memory: 0 });
+    t.end();
+});
+
+test( 'cache eviction', function (t) {
+    var size = imagemagick.convert(options).length;
+    imagemagick.cache({ memory: size * 2 + 1024 });
+    var evictions = imagemagick.cache().evictions;
+    [10, 11, 12, 13].forEach(function (width) {
+        imagemagick.convert({ srcData: options.srcData, width: width, height: 10, format: 'PNG' });
+    });
+    var state = imagemagick.cache();
+    t.ok( state.evictions > evictions );
+    t.ok( state.bytes <= state.memory );
+    imagemagick.cache({ memory: 0 });
+    t.end();
+});
+
+test( 'cache single flight', function (t) {
+    imagemagick.cache({ memory: 1024 * 1024 });
+    var before = imagemagick.cache();
+    var pending = 4, results = [];
+    for (var i = 0; i < 4; i++) {
+        imagemagick.convert({ srcData: options.srcData, width: 20, height: 20, format: 'PNG' }, function (err, buffer) {
+            t.equal( err, undefined );
+            results.push(buffer);
+            if (--pending) return;
+
+            var state = imagemagick.cache();
+            t.equal( state.misses - before.misses, 1, 'computed once' );
+            t.equal( state.coalesced - before.coalesced, 3, 'identical calls joined it' );
+            t.ok( results[0].equals(results[3]) );
+            t.notEqual( results[0], results[3], 'each call gets its own Buffer' );
+
+            imagemagick.convert({ srcData: options.srcData, width: 20, height: 20, format: 'PNG' }, function (err, buffer) {
+                t.ok( buffer.equals(results[0]) );
+                t.equal( imagemagick.cache().hits - before.hits, 1 );
+                imagemagick.cache({ memory: 0 });
+                t.end();
+            });
+        });
+    }
+});
+
+test( 'cache dir', function (t) {
+    var dir = fs.mkdtempSync(path.join(os.tmpdir(), 'imagemagick-cache-'));
+    imagemagick.cache({ memory: 0, dir: dir });
+    var first = imagemagick.convert(options);
+    t.equal( fs.readdirSync(dir).length, 1, 'the result was written' );
+
+    var before = imagemagick.cache().diskHits;
+    t.ok( imagemagick.convert(options).equals(first) );
+    t.equal( imagemagick.cache().diskHits, before + 1 );
+
+    imagemagick.cache({ dir: '' });
+    fs.readdirSync(dir).forEach(function (file) { fs.unlinkSync(path.join(dir, file)); });
+    fs.rmdirSync(dir);
+    t.end();
+});
@@ -0,0 +1,98 @@
+var test        = require('tap').test
+,   imagemagick = require('..')
+,   fs          = require('fs')
+;
+
+process.chdir(__dirname);
+
+var srcData = fs.readFileSync( "test.jpg" );
+
+// keeps the only worker busy, so that the jobs queued after it have not started yet
+function blocker (callback) {
+    imagemagick.convert({ srcData: srcData, width: 3000, height: 3000, resizeStyle: 'fill', blur: 3, format: 'PNG' }, callback);
+}
+
+test( 'cancel a queued job', function (t) {
+    imagemagick.pool({ size: 1 });
+    var before = imagemagick.pool().cancelled;
+    blocker(function (err) {
+        t.equal( err, undefined, 'other jobs are not affected' );
+    });
+    imagemagick.convert({ srcData: srcData, width: 10, height: 10, jobId: 42 }, function (err, buffer) {
+        t.equal( err.message, 'job cancelled' );
+        t.equal( buffer, undefined );
+        t.equal( imagemagick.pool().cancelled, before + 1 );
+        t.equal( imagemagick.cancel(42), false, 'done calls are forgotten' );
+        imagemagick.pool({ size: 4 });
+        t.end();
+    });
+    t.equal( imagemagick.cancel(42), true );
+});
+
+test( 'cancel a running job', function (t) {
+    imagemagick.convert({ srcData: srcData, width: 4000, height: 4000, resizeStyle: 'fill', blur: 5, format: 'PNG', jobId: 7 }, function (err) {
+        t.equal( err.message, 'job cancelled' );
+        t.end();
+    });
+    setTimeout(function () {
+        imagemagick.cancel(7);
+    }, 20);
+});
+
+test( 'timeoutMs', function (t) {
+    imagemagick.pool({ size: 1 });
+    var before = imagemagick.pool().timedOut;
+    blocker(function () {});
+    imagemagick.identify({ srcData: srcData, timeoutMs: 1 }, function (err) {
+        t.equal( err.message, 'job timed out' );
+        t.equal( imagemagick.pool().timedOut, before + 1 );
+        imagemagick.pool({ size: 4 });
+
+        var info = imagemagick.identify({ srcData: srcData, timeoutMs: 60000 });
+        t.equal( info.width, 58, 'calls within their deadline succeed' );
+        t.end();
+    });
+});
+
+test( 'AbortSignal', { skip: typeof AbortController === 'undefined' }, function (t) {
+    var controller = new AbortController();
+    imagemagick.convert({ srcData: srcData, width: 4000, height: 4000, resizeStyle: 'fill', blur: 5, format: 'PNG', signal: controller.signal }, function (err) {
+        t.equal( err.name, 'AbortError' );
+
+        imagemagick.identify({ srcData: srcData, signal: controller.signal }, function (err) {
+            t.equal( err.name, 'AbortError', 'an aborted signal fails right away' );
+
+            imagemagick.promises.identify({ srcData: srcData, signal: new AbortController().signal }).then(function (info) {
+                t.equal( info.width, 58 );
+                t.end();
+            });
+        });
+    });
+    setTimeout(function () {
+        controller.abort();
+    }, 20);
+});
+
+test( 'AbortSignal jobIds are apart from callers\' ones', { skip: typeof AbortController === 'undefined' }, function (t) {
+    var controller = new AbortController();
+    imagemagick.convert({ srcData: srcData, width: 1000, height: 1000, resizeStyle: 'fill', format: 'PNG', jobId: 1 }, function (err, buffer) {
+        t.equal( err, undefined, 'aborting a signal doesn\'t cancel a call with its caller\'s jobId' );
+        t.ok( buffer.length > 0 );
+        imagemagick.convert({ srcData: srcData, width: 1000, height: 1000, resizeStyle: 'fill', format: 'PNG', signal: new AbortController().signal }, function (err, buffer) {
+            t.equal( err, undefined, 'cancel(jobId) doesn\'t cancel a signal\'s call' );
+            t.ok( buffer.length > 0 );
+            t.end();
+        });
+        for (var id = 1; id < 8; id++) imagemagick.cancel(id);
+    });
+    imagemagick.identify({ srcData: srcData, signal: controller.signal }, function () {});
+    controller.abort();
+
+    t.throws(function () { imagemagick.cancel(0xffffffff); }, /reserved for signal/);
+    t.throws(function () { imagemagick.identify({ srcData: srcData, jobId: 0x80000000 }); }, /reserved for signal/);
+});
+
+test( 'cancel invalid argument', function (t) {
+    t.throws(function () { imagemagick.cancel('a'); }, /should be a number/);
+    t.end();
+});
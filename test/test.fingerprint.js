@@ -0,0 +1,80 @@
+var test        = require('tap').test
+,   imagemagick = require('..')
+,   fs          = require('fs')
+;
+
+process.chdir(__dirname);
+
+var srcData = fs.readFileSync( "test.jpg" ); // 58x66
+var other   = fs.readFileSync( "test.quantizeColors.png" );
+
+// bits that differ between two hex hashes
+function distance (a, b) {
+    var bits = 0;
+    for (var i = 0; i < a.length; i++) {
+        var x = parseInt(a[ i ], 16) ^ parseInt(b[ i ], 16);
+        for (; x; x >>= 1) bits += x & 1;
+    }
+    return bits;
+}
+
+test( 'convert with fingerprint', function (t) {
+    var result = imagemagick.convert({ srcData: srcData, width: 20, height: 20, format: 'PNG', fingerprint: true });
+    t.ok( Buffer.isBuffer(result.data), 'data is the converted Buffer' );
+    t.equal( imagemagick.identify({ srcData: result.data }).width, 20 );
+    t.match( result.fingerprint.hash, /^[0-9a-f]{16}$/ );
+    t.match( result.fingerprint.digest, /^[0-9a-f]{32}$/ );
+
+    var again = imagemagick.convert({ srcData: srcData, width: 40, height: 40, format: 'PNG', fingerprint: true });
+    t.same( again.fingerprint, result.fingerprint, 'the fingerprint is of the source, not the rendition' );
+    t.end();
+});
+
+test( 'similar images have close hashes', function (t) {
+    var hash    = imagemagick.convert({ srcData: srcData, fingerprint: true }).fingerprint.hash;
+    var resized = imagemagick.convert({ srcData: srcData, width: 116, height: 132, resizeStyle: 'fill', format: 'JPEG', quality: 60 });
+    var similar = imagemagick.convert({ srcData: resized, fingerprint: true }).fingerprint;
+    var unlike  = imagemagick.convert({ srcData: other, fingerprint: true }).fingerprint;
+
+    t.ok( distance(hash, similar.hash) <= 10, 'resized and recompressed: ' + distance(hash, similar.hash) + ' bits' );
+    t.ok( distance(hash, unlike.hash) > distance(hash, similar.hash), 'another image: ' + distance(hash, unlike.hash) + ' bits' );
+    t.not( similar.digest, imagemagick.convert({ srcData: srcData, fingerprint: true }).fingerprint.digest );
+    t.end();
+});
+
+test( 'outputs and converters', function (t) {
+    var result = imagemagick.convert({ srcData: srcData, fingerprint: true, outputs: [ { width: 10, height: 10 }, { width: 20, height: 20 } ] });
+    t.equal( result.data.length, 2 );
+    t.match( result.fingerprint.hash, /^[0-9a-f]{16}$/ );
+
+    var converter = imagemagick.createConverter({ width: 20, height: 20, fingerprint: true });
+    t.same( converter.run(srcData).fingerprint, result.fingerprint );
+    t.end();
+});
+
+test( 'fingerprint()', function (t) {
+    var expected = imagemagick.convert({ srcData: srcData, fingerprint: true }).fingerprint;
+    t.same( imagemagick.fingerprint(srcData), expected, 'sources smaller than the decode hint are decoded whole' );
+    imagemagick.fingerprint({ srcData: srcData }, function (err, fingerprint) {
+        t.equal( err, undefined );
+        t.same( fingerprint, expected );
+        imagemagick.load(srcData, function (err, image) {
+            t.equal( err, undefined );
+            var loaded = image.fingerprint();
+            t.equal( loaded.hash, expected.hash );
+            t.equal( loaded.digest, undefined, 'loaded images have no source bytes' );
+            image.dispose();
+            t.end();
+        });
+    });
+});
+
+test( 'unsupported combinations', function (t) {
+    t.throws( function () {
+        imagemagick.convert({ srcData: srcData, pages: [ 0 ], fingerprint: true });
+    }, /can't be combined with "pages"/ );
+    t.throws( function () {
+        imagemagick.fingerprint({});
+    }, /should be a Buffer/ );
+    t.end();
+});
@@ -0,0 +1,62 @@
+var test        = require('tap').test
+,   imagemagick = require('..')
+,   fs          = require('fs')
+;
+
+process.chdir(__dirname);
+
+var srcData = fs.readFileSync( "test.jpg" ); // 58x66
+
+test( 'load sync', function (t) {
+    var image = imagemagick.load(srcData);
+    t.ok( image instanceof imagemagick.Image );
+
+    t.same( image.identify(), imagemagick.identify({ srcData: srcData }) );
+
+    var options = { width: 10, height: 10, format: 'PNG', shrinkOnLoad: false };
+    t.ok( image.convert(options).equals(imagemagick.convert(Object.assign({ srcData: srcData }, options))),
+        'same rendition as from srcData' );
+
+    var region = { x: 0, y: 0, columns: 6, rows: 6, map: 'RGB' };
+    t.same( image.getConstPixels(region), imagemagick.getConstPixels(Object.assign({ srcData: srcData }, region)) );
+    t.equal( image.getConstPixels({ x: 0, y: 0, columns: 2, rows: 1 }).length, 2, 'legacy pixel objects' );
+
+    t.same( image.quantizeColors({ colors: 3, shrinkOnLoad: false }),
+        imagemagick.quantizeColors({ srcData: srcData, colors: 3, shrinkOnLoad: false }) );
+
+    image.dispose();
+    t.throws(function () { image.identify(); }, /image is disposed/);
+    t.end();
+});
+
+test( 'load async', function (t) {
+    imagemagick.load({ srcData: srcData }, function (err, image) {
+        t.equal( err, undefined );
+        var pending = 3;
+        function done () {
+            if (--pending) return;
+            image.dispose();
+            t.end();
+        }
+        image.identify(function (err, info) {
+            t.equal( info.width, 58 );
+            done();
+        });
+        image.convert({ width: 20, height: 20, format: 'PNG' }, function (err, buffer) {
+            t.equal( imagemagick.identify({ srcData: buffer }).width, 20 );
+            done();
+        });
+        image.composite({ compositeData: fs.readFileSync( "test.png" ) }, function (err, buffer) {
+            t.equal( err, undefined );
+            t.ok( Buffer.isBuffer(buffer) );
+            done();
+        });
+    });
+});
+
+test( 'load errors', function (t) {
+    t.throws(function () { imagemagick.load({}); }, /should be a Buffer/);
+    t.throws(function () { imagemagick.load(srcData, { maxPixels: 1 }); }, /2nd argument should be a function/);
+    t.throws(function () { imagemagick.load({ srcData: srcData, maxPixels: 10 }); }, /image exceeds maxPixels/);
+    t.end();
+});
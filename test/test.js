@@ -226,6 +226,72 @@ test( 'convert jpg -> jpg aspectfit', function (t) {
     t.end();
 });
 
+test( 'convert jpg -> jpg aspectfill shrinkOnLoad', function (t) {
+    [ true, false ].forEach( function (shrinkOnLoad) {
+        var buffer = imagemagick.convert({
+            srcData: require('fs').readFileSync( "test.jpg" ), // 58x66
+            width: 10,
+            height: 10,
+            resizeStyle: 'aspectfill',
+            shrinkOnLoad: shrinkOnLoad,
+            quality: 80,
+            format: 'JPEG',
+            debug: debug
+        });
+        t.equal( Buffer.isBuffer(buffer), true, 'buffer is Buffer' );
+        var info = imagemagick.identify({srcData: buffer});
+        t.equal( info.width, 10 );
+        t.equal( info.height, 10 );
+    });
+    t.end();
+});
+
+test( 'convert multiple outputs', function (t) {
+    var buffers = imagemagick.convert({
+        srcData: require('fs').readFileSync( "test.jpg" ), // 58x66
+        quality: 80,
+        format: 'JPEG',
+        outputs: [
+            { width: 10, height: 10 },
+            { width: 20, height: 30, resizeStyle: 'fill', format: 'PNG' },
+            { width: 40, height: 40, resizeStyle: 'aspectfit' }
+        ],
+        debug: debug
+    });
+    t.equal( Array.isArray(buffers), true, 'result is an Array' );
+    t.equal( buffers.length, 3 );
+
+    var info = imagemagick.identify({srcData: buffers[0]});
+    t.equal( info.format, 'JPEG' );
+    t.equal( info.width, 10 );
+    t.equal( info.height, 10 );
+
+    info = imagemagick.identify({srcData: buffers[1]});
+    t.equal( info.format, 'PNG' );
+    t.equal( info.width, 20 );
+    t.equal( info.height, 30 );
+
+    info = imagemagick.identify({srcData: buffers[2]});
+    t.equal( info.format, 'JPEG' );
+    t.equal( info.width, 35 );
+    t.equal( info.height, 40 );
+    t.end();
+});
+
+test( 'convert invalid outputs', function (t) {
+    var error = 0;
+    try {
+        imagemagick.convert({
+            srcData: require('fs').readFileSync( "test.jpg" ),
+            outputs: []
+        });
+    } catch (e) {
+        error = e;
+    }
+    t.equal( error.message, "convert()'s \"outputs\" should be a non-empty array of objects" );
+    t.end();
+});
+
 test( 'convert broken png', function (t) {
     var srcData = require('fs').readFileSync( "broken.png" )
     , buffer;
@@ -247,34 +313,31 @@ test( 'convert broken png', function (t) {
     t.end();
 });
 
-// segmentation faults on Mac...
-// if (versions[1] > 6) {
-//     test( 'convert too wide jpg', function (t) {
-//         var srcData = require('fs').readFileSync( "test.maxmemory.jpg" )
-//         , buffer
-//         , seenError = 0;
-
-//         try {
-//             buffer = imagemagick.convert({
-//                 srcData: srcData,
-//                 width: 640,
-//                 height: 960,
-//                 resizeStyle: "aspectfill",
-//                 quality: 80,
-//                 format: 'JPEG',
-//                 maxMemory: 100 * 1000, // 100kB
-//                 debug: debug
-//             });
-//         } catch (e) {
-//             seenError = 1;
-//             t.similar( e.message,
-//                        new RegExp("cache resources exhausted") );
-//         }
-//         saveToFileIfDebug( buffer, "out.jpg-maxmemory.jpg" );
-//         t.equal( seenError, 1 );
-//         t.end();
-//     });
-// }
+test( 'convert too wide jpg', function (t) {
+    var srcData = require('fs').readFileSync( "test.maxmemory.jpg" )
+    , buffer
+    , seenError = 0;
+
+    try {
+        buffer = imagemagick.convert({
+            srcData: srcData,
+            width: 640,
+            height: 960,
+            resizeStyle: "aspectfill",
+            quality: 80,
+            format: 'JPEG',
+            shrinkOnLoad: false,
+            maxMemory: 100 * 1000, // 100kB
+            debug: debug
+        });
+    } catch (e) {
+        seenError = 1;
+        t.equal( e.message, "image exceeds maxMemory" );
+    }
+    saveToFileIfDebug( buffer, "out.jpg-maxmemory.jpg" );
+    t.equal( seenError, 1 );
+    t.end();
+});
 
 test( 'convert to rotate 90 degrees', function (t) {
   var buffer = imagemagick.convert({
@@ -340,6 +403,19 @@ test( 'identify results', function (t) {
     t.end();
 });
 
+test( 'identify ping results', function (t) {
+    var info = imagemagick.identify({
+        srcData: require('fs').readFileSync( "test.jpg" ),
+        ping: true
+    });
+    t.equal( info.width, 58, 'width is 58' );
+    t.equal( info.height, 66, 'height is 66' );
+    t.equal( info.depth, 8, 'depth is 8' );
+    t.equal( info.format, 'JPEG', 'format is JPEG' );
+    t.equal( info.exif.orientation, 1, 'orientation is upper-left' );
+    t.end();
+});
+
 test( 'quantizeColors invalid number of arguments', function (t) {
     var error = 0;
     try {
@@ -414,6 +490,21 @@ test( 'quantizeColors results, 5 colors', function (t) {
     t.end();
 });
 
+test( 'quantizeColors pixel counts', function (t) {
+    var results = imagemagick.quantizeColors({
+        srcData: require('fs').readFileSync( "test.quantizeColors.png" ),
+        colors: 5
+    });
+
+    var percent = 0;
+    results.forEach(function (color) {
+        t.equal( color.count > 0, true, color.hex + ' is used' );
+        percent += color.percent;
+    });
+    t.equal( percent <= 100.0001, true, 'percentages add up to at most 100' );
+    t.end();
+});
+
 test( 'composite invalid number of arguments', function (t) {
     var error = 0;
     try {
@@ -492,9 +583,88 @@ test( 'get pixel colors: pixel colors from each 6x6 square', function(t) {
     t.end();
 });
 
+test( 'get pixel colors: raw typed arrays', function(t) {
+    var srcData = require('fs').readFileSync("test.getPixelColor.png");
+    var region  = { srcData: srcData, x: 0, y: 0, columns: 6, rows: 6 };
+    var quantumRange = Math.pow(2, imagemagick.quantumDepth()) - 1;
+
+    var colors = imagemagick.getConstPixels(region);
+
+    region.map = 'RGB';
+    var rgb = imagemagick.getConstPixels(region);
+    t.ok(rgb instanceof Uint8Array);
+    t.equal(rgb.length, 6 * 6 * 3);
+    t.equal(rgb[0], Math.round(colors[0].red   * 255 / quantumRange));
+    t.equal(rgb[1], Math.round(colors[0].green * 255 / quantumRange));
+    t.equal(rgb[2], Math.round(colors[0].blue  * 255 / quantumRange));
+
+    region.map   = 'RGBA';
+    region.depth = 16;
+    var rgba = imagemagick.getConstPixels(region);
+    t.ok(rgba instanceof Uint16Array);
+    t.equal(rgba.length, 6 * 6 * 4);
+
+    region.map   = 'Gray';
+    region.depth = 32;
+    var gray = imagemagick.getConstPixels(region);
+    t.ok(gray instanceof Float32Array);
+    t.equal(gray.length, 6 * 6);
+    t.equal(gray[0] >= 0 && gray[0] <= 1, true);
+
+    t.throws(function () {
+        imagemagick.getConstPixels({ srcData: srcData, x: 0, y: 0, columns: 1, rows: 1, map: 'RGB', depth: 12 });
+    }, /depth not supported/);
+    t.end();
+});
+
+test( 'identify metrics', function(t) {
+    var timings;
+    imagemagick.identify({
+        srcData: require('fs').readFileSync( "test.jpg" ),
+        ping: true,
+        metrics: function (m) { timings = m; }
+    });
+    t.equal( typeof timings.queueWait, 'number' );
+    t.equal( typeof timings.ping, 'number' );
+    t.equal( timings.decode, undefined, 'pixels were not decoded' );
+    t.equal( typeof timings.total, 'number' );
+    t.end();
+});
+
+test( 'createConverter', function(t) {
+    var srcData = require('fs').readFileSync( "test.png" );
+    var options = { width: 10, height: 10, resizeStyle: 'fill', format: 'PNG', filter: 'Lanczos', blur: 0.8 };
+    var converter = imagemagick.createConverter(options);
+
+    var expected = imagemagick.convert(Object.assign({ srcData: srcData }, options));
+    var buffer = converter.run(srcData);
+    t.ok(Buffer.isBuffer(buffer));
+    t.ok(buffer.equals(expected), 'same result as convert()');
+    t.ok(converter.run(srcData).equals(expected), 'converter can run again');
+
+    var info = imagemagick.identify({ srcData: buffer });
+    t.equal(info.width, 10);
+    t.equal(info.height, 10);
+
+    t.throws(function () { converter.run(); }, /run\(\)'s 1st argument should be a Buffer/);
+    t.throws(function () { imagemagick.createConverter({ filter: 'Nonexistent' }); }, /filter not supported/);
+    t.throws(function () { imagemagick.createConverter({ gravity: 'Middle' }); }, /gravity not supported/);
+    t.end();
+});
+
 test( 'quantumDepth', function(t) {
     var q = imagemagick.quantumDepth();
     t.equal(typeof(q), "number");
     t.equal(q >= 8, true);
     t.end();
 });
+
+test( 'threads', function(t) {
+    var original = imagemagick.threads();
+    t.equal(typeof(original), "number");
+    t.equal(original >= 1, true);
+    t.equal(imagemagick.threads(1), 1);
+    imagemagick.threads(0);
+    t.equal(imagemagick.threads(), original);
+    t.end();
+});
@@ -0,0 +1,89 @@
+var test        = require('tap').test
+,   imagemagick = require('..')
+,   fs          = require('fs')
+;
+
+process.chdir(__dirname);
+
+var srcData     = fs.readFileSync( "test.quantizeColors.png" );
+var compositeData = fs.readFileSync( "test.png" );
+
+test( 'layers match the legacy single overlay', function (t) {
+    var legacy = imagemagick.composite({ srcData: srcData, compositeData: compositeData, gravity: "SouthEastGravity" });
+    var layers = imagemagick.composite({ srcData: srcData, layers: [ { compositeData: compositeData, gravity: "SouthEast" } ] });
+    t.ok( legacy.equals(layers) );
+    t.end();
+});
+
+test( 'registered overlay', function (t) {
+    imagemagick.registerOverlay( 'logo', compositeData );
+    var inline = imagemagick.composite({ srcData: srcData, layers: [ { compositeData: compositeData, gravity: "NorthEast", x: 2, y: 3 } ] });
+    var registered = imagemagick.composite({ srcData: srcData, layers: [ { overlay: 'logo', gravity: "NorthEast", x: 2, y: 3 } ] });
+    t.ok( inline.equals(registered) );
+
+    var faded = imagemagick.composite({ srcData: srcData, layers: [ { overlay: 'logo', gravity: "NorthEast", x: 2, y: 3, opacity: 0.5 } ] });
+    t.notOk( faded.equals(registered), 'opacity changes the result' );
+
+    t.equal( imagemagick.unregisterOverlay( 'logo' ), true );
+    t.equal( imagemagick.unregisterOverlay( 'logo' ), false );
+    t.throws(function () {
+        imagemagick.composite({ srcData: srcData, layers: [ { overlay: 'logo' } ] });
+    }, /overlay not registered/);
+    t.end();
+});
+
+test( 'registered overlay async', function (t) {
+    imagemagick.registerOverlay( 'async', { srcData: compositeData }, function (err) {
+        t.equal( err, undefined );
+        imagemagick.composite({ srcData: srcData, layers: [ { overlay: 'async' }, { overlay: 'async', gravity: 'Center', compose: 'Multiply' } ] }, function (err, buffer) {
+            t.equal( err, undefined );
+            t.ok( Buffer.isBuffer(buffer) );
+            imagemagick.unregisterOverlay( 'async' );
+            t.end();
+        });
+    });
+});
+
+test( 'registerOverlay errors', function (t) {
+    t.throws(function () { imagemagick.registerOverlay( 'broken', fs.readFileSync( "broken.png" ) ); });
+    t.equal( imagemagick.unregisterOverlay( 'broken' ), false, 'failed overlays are not registered' );
+    t.throws(function () { imagemagick.registerOverlay( 'empty', {} ); }, /should be a Buffer/);
+    t.end();
+});
+
+test( 'invalid layers throw', function (t) {
+    t.throws(function () {
+        imagemagick.composite({ srcData: srcData, layers: [ { compositeData: compositeData, gravity: "Up" } ] });
+    }, /gravity not supported/);
+    t.throws(function () {
+        imagemagick.composite({ srcData: srcData, layers: [ { compositeData: compositeData, compose: "Sideways" } ] });
+    }, /compose not supported/);
+    t.throws(function () {
+        imagemagick.composite({ srcData: srcData, layers: [ { compositeData: compositeData, opacity: 2 } ] });
+    }, /opacity should be between 0 and 1/);
+    t.throws(function () {
+        imagemagick.composite({ srcData: srcData, layers: [ {} ] });
+    }, /"overlay" id or a "compositeData" Buffer/);
+    t.end();
+});
+
+test( 'batch of sources', function (t) {
+    var options = { layers: [ { compositeData: compositeData, gravity: "SouthEast" } ] };
+    var single = imagemagick.composite(Object.assign({ srcData: srcData }, options));
+
+    var buffers = imagemagick.composite(Object.assign({ srcData: [ srcData, srcData ] }, options));
+    t.equal( buffers.length, 2 );
+    t.ok( buffers[ 0 ].equals(single) && buffers[ 1 ].equals(single) );
+
+    imagemagick.composite(Object.assign({ srcData: [ srcData, srcData, srcData ] }, options), function (err, buffers) {
+        t.equal( err, undefined );
+        t.equal( buffers.length, 3 );
+        t.ok( buffers[ 2 ].equals(single) );
+
+        imagemagick.composite(Object.assign({ srcData: [ srcData, fs.readFileSync( "broken.png" ) ] }, options), function (err, buffers) {
+            t.ok( err instanceof Error, 'first error fails the batch' );
+            t.equal( buffers, undefined );
+            t.end();
+        });
+    });
+});
@@ -0,0 +1,126 @@
+var test        = require('tap').test
+,   imagemagick = require('..')
+,   fs          = require('fs')
+,   debug       = 0
+;
+
+process.chdir(__dirname);
+
+test( 'convert maxPixels', function (t) {
+    var error = 0;
+    try {
+        imagemagick.convert({
+            srcData: fs.readFileSync( "test.jpg" ), // 58x66
+            width: 10,
+            height: 10,
+            maxPixels: 58 * 66 - 1,
+            debug: debug
+        });
+    } catch (e) {
+        error = e;
+    }
+    t.equal( error.message, 'image exceeds maxPixels' );
+
+    var buffer = imagemagick.convert({
+        srcData: fs.readFileSync( "test.jpg" ),
+        width: 10,
+        height: 10,
+        maxPixels: 58 * 66,
+        debug: debug
+    });
+    t.equal( imagemagick.identify({ srcData: buffer }).width, 10 );
+    t.end();
+});
+
+test( 'identify maxMemory async', function (t) {
+    imagemagick.identify({
+        srcData: fs.readFileSync( "test.jpg" ),
+        maxMemory: 1024,
+        debug: debug
+    }, function (err, info) {
+        t.equal( err.message, 'image exceeds maxMemory' );
+        t.end();
+    });
+});
+
+test( 'limits budget', function (t) {
+    var state = imagemagick.limits();
+    t.equal( state.memory, 0, 'unlimited by default' );
+    t.equal( state.wait, true );
+    t.equal( state.memoryInUse, 0, 'nothing is running' );
+
+    state = imagemagick.limits({ memory: 1024, wait: false });
+    t.equal( state.memory, 1024 );
+    t.equal( state.wait, false );
+
+    var error = 0;
+    try {
+        imagemagick.convert({
+            srcData: fs.readFileSync( "test.jpg" ),
+            width: 10,
+            height: 10,
+            debug: debug
+        });
+    } catch (e) {
+        error = e;
+    }
+    t.equal( error.message, 'image exceeds the memory budget' );
+    t.equal( imagemagick.limits().rejected, state.rejected + 1, 'rejection is counted' );
+
+    state = imagemagick.limits({ memory: 64 * 1024 * 1024, wait: true });
+    imagemagick.convert({
+        srcData: fs.readFileSync( "test.jpg" ),
+        width: 10,
+        height: 10,
+        debug: debug
+    }, function (err, buffer) {
+        t.equal( err, undefined );
+        var after = imagemagick.limits();
+        t.equal( after.admitted, state.admitted + 1, 'admission is counted' );
+        t.equal( after.memoryInUse, 0, 'reservation is released' );
+        t.equal( after.memoryPeak > 0, true );
+        imagemagick.limits({ memory: 0 });
+        t.end();
+    });
+});
+
+test( 'animated sources are admitted before they are decoded', function (t) {
+    var timings = {};
+    var error = 0;
+    try {
+        imagemagick.convert({
+            srcData: fs.readFileSync( "test.animated.gif" ),
+            animated: true,
+            width: 10,
+            height: 10,
+            maxPixels: 1,
+            cache: false,
+            metrics: function (stages) { timings = stages; },
+            debug: debug
+        });
+    } catch (e) {
+        error = e;
+    }
+    t.equal( error.message, 'image exceeds maxPixels' );
+    t.equal( timings.decode, undefined, 'no frame was decoded' );
+    t.end();
+});
+
+test( 'streams are admitted before they are decoded', { skip: !imagemagick.convertStream && 'needs native streams' }, function (t) {
+    var timings = {};
+    var stream = imagemagick.streams.convert({
+        width: 10,
+        height: 10,
+        format: 'PNG',
+        maxPixels: 58 * 66 - 1,
+        metrics: function (stages) { timings = stages; },
+        debug: debug
+    });
+    stream.on('error', function (err) {
+        t.equal( err.message, 'image exceeds maxPixels' );
+        t.equal( timings.decode, undefined, 'the stream was not decoded' );
+        t.end();
+    });
+    stream.resume();
+    fs.createReadStream( "test.jpg", { highWaterMark: 256 } ).pipe(stream);
+});
@@ -0,0 +1,72 @@
+var test        = require('tap').test
+,   imagemagick = require('..')
+,   fs          = require('fs')
+;
+
+process.chdir(__dirname);
+
+// GIF frames are pages too: a 40x30 red canvas, then 10x10 blue and green patches
+var srcData = fs.readFileSync( "test.animated.gif" );
+
+function widths (buffers) {
+    return buffers.map(function (buffer) {
+        return imagemagick.identify({ srcData: buffer }).width;
+    });
+}
+
+test( 'pages sync', function (t) {
+    var buffers = imagemagick.convert({ srcData: srcData, pages: [ 1, 0 ], format: 'PNG' });
+    t.equal( buffers.length, 2 );
+    t.same( widths(buffers), [ 10, 40 ], 'one Buffer per page, in the order of pages' );
+
+    buffers = imagemagick.convert({ srcData: srcData, pages: '0, 1-2', format: 'PNG' });
+    t.same( widths(buffers), [ 40, 10, 10 ] );
+    t.ok( buffers[ 0 ].equals(imagemagick.convert({ srcData: srcData, format: 'PNG' })), 'page 0 is what convert reads by default' );
+    t.end();
+});
+
+test( 'pages with outputs', function (t) {
+    var buffers = imagemagick.convert({ srcData: srcData, pages: '1-2', format: 'PNG', outputs: [
+        { width: 5, height: 5, resizeStyle: 'fill' },
+        { }
+    ] });
+    t.equal( buffers.length, 2 );
+    t.same( widths(buffers[ 0 ]), [ 5, 10 ] );
+    t.same( widths(buffers[ 1 ]), [ 5, 10 ] );
+    t.end();
+});
+
+test( 'pages async', function (t) {
+    var timings = 0;
+    imagemagick.convert({
+        srcData: srcData,
+        pages: '0-2',
+        width: 8,
+        height: 8,
+        resizeStyle: 'fill',
+        format: 'PNG',
+        metrics: function () { timings++; }
+    }, function (err, buffers) {
+        t.equal( err, undefined );
+        t.same( widths(buffers), [ 8, 8, 8 ] );
+        t.equal( timings, 3, 'every page reports its own timings' );
+
+        imagemagick.convert({ srcData: srcData, pages: [ 0, 7 ], format: 'PNG' }, function (err, buffers) {
+            t.ok( err, 'a missing page fails the call' );
+            t.equal( buffers, undefined );
+            t.end();
+        });
+    });
+});
+
+test( 'pages errors', function (t) {
+    [ [], '', '2-1', '0,,1', '-1', 'a', [ -1 ], [ 0.5 ], 3 ].forEach(function (pages) {
+        t.throws( function () {
+            imagemagick.convert({ srcData: srcData, pages: pages });
+        }, /"pages" should be an array of page indexes/, JSON.stringify(pages) );
+    });
+    t.throws( function () {
+        imagemagick.createConverter({ pages: [ 0 ] });
+    }, /createConverter\(\) doesn't support "pages"/ );
+    t.end();
+});
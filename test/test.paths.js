@@ -0,0 +1,68 @@
+var test        = require('tap').test
+,   imagemagick = require('..')
+,   fs          = require('fs')
+,   os          = require('os')
+,   path        = require('path')
+;
+
+process.chdir(__dirname);
+
+var srcPath = path.join(__dirname, 'test.jpg');
+var srcData = fs.readFileSync( srcPath );
+var options = { width: 40, height: 30, format: 'PNG' };
+
+function tmp (name) {
+    return path.join(os.tmpdir(), 'test.paths.' + process.pid + '.' + name);
+}
+
+test( 'srcPath reads the file like srcData', function (t) {
+    var expected = imagemagick.convert(Object.assign({ srcData: srcData }, options));
+    t.ok( imagemagick.convert(Object.assign({ srcPath: srcPath }, options)).equals(expected) );
+    t.same( imagemagick.identify({ srcPath: srcPath }), imagemagick.identify({ srcData: srcData }) );
+    t.same( imagemagick.getConstPixels({ srcPath: srcPath, x: 10, y: 10, columns: 2, rows: 2 }),
+        imagemagick.getConstPixels({ srcData: srcData, x: 10, y: 10, columns: 2, rows: 2 }) );
+
+    var image = imagemagick.load({ srcPath: srcPath });
+    t.ok( image.convert(options).equals(expected), 'load' );
+    image.dispose();
+
+    imagemagick.convert(Object.assign({ srcPath: srcPath }, options), function (err, buffer) {
+        t.equal( err, undefined );
+        t.ok( buffer.equals(expected), 'async' );
+        t.end();
+    });
+});
+
+test( 'dstPath writes the result', function (t) {
+    var dstPath = tmp('sync.png');
+    var expected = imagemagick.convert(Object.assign({ srcData: srcData }, options));
+    t.equal( imagemagick.convert(Object.assign({ srcData: srcData, dstPath: dstPath }, options)), undefined );
+    t.ok( fs.readFileSync(dstPath).equals(expected) );
+    fs.unlinkSync(dstPath);
+
+    dstPath = tmp('async.png');
+    imagemagick.convert(Object.assign({ srcPath: srcPath, dstPath: dstPath }, options), function (err, buffer) {
+        t.equal( err, undefined );
+        t.equal( buffer, undefined );
+        t.ok( fs.readFileSync(dstPath).equals(expected) );
+        fs.unlinkSync(dstPath);
+        t.end();
+    });
+});
+
+test( 'srcPath and dstPath errors', function (t) {
+    t.throws( function () {
+        imagemagick.convert({ srcPath: tmp('missing.jpg') });
+    }, /unable to open srcPath: /);
+    t.throws( function () {
+        imagemagick.convert({ srcData: srcData, dstPath: path.join(tmp('missing'), 'out.jpg') });
+    }, /unable to open dstPath: /);
+    t.throws( function () {
+        imagemagick.convert({ srcData: srcData, dstPath: tmp('outputs.jpg'), outputs: [ {}, {} ] });
+    }, /"dstPath" takes a single result/);
+
+    imagemagick.identify({ srcPath: tmp('missing.jpg') }, function (err) {
+        t.match( err.message, /unable to open srcPath: / );
+        t.end();
+    });
+});
@@ -0,0 +1,90 @@
+var test        = require('tap').test
+,   imagemagick = require('..')
+,   debug       = 0
+;
+
+process.chdir(__dirname);
+
+test( 'pool settings', function (t) {
+    var state = imagemagick.pool();
+    t.equal( state.size >= 1, true, 'size is at least 1' );
+    t.equal( state.queueDepth, 0, 'queue is unlimited by default' );
+    t.equal( state.running, 0, 'nothing is running' );
+    t.equal( state.queued.interactive, 0, 'nothing is queued' );
+    t.equal( state.queued.batch, 0, 'nothing is queued' );
+
+    state = imagemagick.pool({ size: 2, queueDepth: 10 });
+    t.equal( state.size, 2 );
+    t.equal( state.queueDepth, 10 );
+
+    imagemagick.pool({ size: 4, queueDepth: 0 });
+    t.end();
+});
+
+test( 'pool invalid size', function (t) {
+    var error = 0;
+    try {
+        imagemagick.pool({ size: 0 });
+    } catch (e) {
+        error = e;
+    }
+    t.equal( error.message, 'pool()\'s "size" should be at least 1' );
+    t.end();
+});
+
+test( 'convert invalid priority', function (t) {
+    var error = 0;
+    try {
+        imagemagick.convert({
+            srcData: require('fs').readFileSync( "test.png" ),
+            priority: 'urgent'
+        }, function () {});
+    } catch (e) {
+        error = e;
+    }
+    t.equal( error.message, 'priority not supported' );
+    t.end();
+});
+
+test( 'convert batch priority', function (t) {
+    imagemagick.convert({
+        srcData: require('fs').readFileSync( "test.png" ),
+        width: 10,
+        height: 10,
+        priority: 'batch',
+        debug: debug
+    }, function (err, buffer) {
+        t.equal( err, undefined );
+        t.equal( Buffer.isBuffer(buffer), true, 'buffer is Buffer' );
+        t.end();
+    });
+});
+
+test( 'pool queue full', function (t) {
+    imagemagick.pool({ size: 1, queueDepth: 1 });
+
+    var srcData = require('fs').readFileSync( "test.png" );
+    var jobs = 4, finished = 0, rejected = 0;
+    for (var i = 0; i < jobs; i++) {
+        imagemagick.convert({
+            srcData: srcData,
+            width: 100,
+            height: 100,
+            debug: debug
+        }, function (err, buffer) {
+            if (err) {
+                t.equal( err.message, 'worker pool queue is full' );
+                rejected++;
+            }
+            else {
+                t.equal( Buffer.isBuffer(buffer), true, 'buffer is Buffer' );
+            }
+            if (++finished === jobs) {
+                // at most one job runs and one waits, the others are rejected
+                t.equal( rejected >= jobs - 2, true, 'jobs beyond the queue depth were rejected' );
+                imagemagick.pool({ size: 4, queueDepth: 0 });
+                t.end();
+            }
+        });
+    }
+});
@@ -0,0 +1,76 @@
+var test        = require('tap').test
+,   imagemagick = require('..')
+,   fs          = require('fs')
+;
+
+process.chdir(__dirname);
+
+var jpeg = imagemagick.convert({
+    srcData: fs.readFileSync( "test.jpg" ),
+    width: 2000,
+    height: 1500,
+    resizeStyle: 'fill',
+    format: 'JPEG',
+    quality: 90
+});
+// the same pixels, in a format that is decoded whole
+var png = imagemagick.convert({ srcData: jpeg, format: 'PNG' });
+
+var region = { x: 1200, y: 700, width: 64, height: 48 };
+// estimated pixel cache of the region, one PixelPacket of 4 quantums per pixel, twice for HDRI builds
+var regionBytes = region.width * region.height * 4 * imagemagick.quantumDepth() / 8 * 2;
+
+function rgb (srcData, x, y, width, height) {
+    return imagemagick.getConstPixels({ srcData: srcData, x: x, y: y, columns: width, rows: height, map: 'RGB' });
+}
+
+test( 'srcRegion streams the region of a JPEG', function (t) {
+    var buffer = imagemagick.convert({ srcData: jpeg, srcRegion: region, format: 'PNG' });
+    var info = imagemagick.identify({ srcData: buffer });
+    t.equal( info.width, region.width );
+    t.equal( info.height, region.height );
+    t.same( rgb(buffer, 0, 0, region.width, region.height), rgb(png, region.x, region.y, region.width, region.height),
+        'same pixels as a crop of the whole image' );
+    t.end();
+});
+
+test( 'srcRegion limits count the region, not the source', function (t) {
+    var options = { srcData: jpeg, format: 'PNG', maxPixels: region.width * region.height, maxMemory: regionBytes };
+    t.throws( function () {
+        imagemagick.convert(options);
+    }, /image exceeds max(Pixels|Memory)/, 'the whole source is over the limits' );
+    t.ok( imagemagick.convert(Object.assign({ srcRegion: region }, options)) );
+
+    t.ok( imagemagick.getConstPixels({ srcData: jpeg, x: region.x, y: region.y, columns: region.width, rows: region.height,
+        map: 'RGB', maxPixels: region.width * region.height, maxMemory: regionBytes }), 'getConstPixels decodes its window only' );
+    t.end();
+});
+
+test( 'srcRegion of a source decoded whole', function (t) {
+    var buffer = imagemagick.convert({ srcData: png, srcRegion: region, format: 'PNG' });
+    t.same( rgb(buffer, 0, 0, region.width, region.height), rgb(png, region.x, region.y, region.width, region.height) );
+    t.end();
+});
+
+test( 'srcRegion async with resize', function (t) {
+    imagemagick.convert({ srcData: jpeg, srcRegion: region, width: 32, height: 24, format: 'PNG' }, function (err, buffer) {
+        t.equal( err, undefined );
+        t.equal( imagemagick.identify({ srcData: buffer }).width, 32 );
+        t.end();
+    });
+});
+
+test( 'srcRegion errors', function (t) {
+    t.throws( function () {
+        imagemagick.convert({ srcData: jpeg, srcRegion: { x: 1990, y: 0, width: 20, height: 20 } });
+    }, /srcRegion is beyond the image's dimensions/ );
+    t.throws( function () {
+        imagemagick.getConstPixels({ srcData: jpeg, x: 1990, y: 0, columns: 20, rows: 20 });
+    }, /x\/y\/columns\/rows values are beyond the image's dimensions/ );
+    [ 1, { x: 0, y: 0, width: 0, height: 10 }, { x: -1, y: 0, width: 10, height: 10 }, { width: 10, height: 10 } ].forEach(function (srcRegion) {
+        t.throws( function () {
+            imagemagick.convert({ srcData: jpeg, srcRegion: srcRegion });
+        }, /"srcRegion" should be an object/, JSON.stringify(srcRegion) );
+    });
+    t.end();
+});
@@ -0,0 +1,102 @@
+var test        = require('tap').test
+,   imagemagick = require('..')
+,   fs          = require('fs')
+,   os          = require('os')
+,   path        = require('path')
+;
+
+process.chdir(__dirname);
+
+var srcData = fs.readFileSync( "test.jpg" ); // 58x66
+
+function sum (array) {
+    return array.reduce(function (a, b) { return a + b; }, 0);
+}
+function errors (stats) {
+    return sum(Object.keys(stats.errorsByStage).map(function (stage) { return stats.errorsByStage[ stage ]; }));
+}
+
+test( 'stats shape', function (t) {
+    var stats = imagemagick.stats();
+    t.equal( typeof stats.pool.running, 'number' );
+    t.equal( typeof stats.pool.queued, 'number' );
+    t.equal( typeof stats.magick.memory, 'number' );
+    t.equal( typeof stats.warningsIgnored, 'number' );
+    t.equal( typeof stats.cacheSpills, 'number' );
+    t.equal( stats.latencyBuckets[ 0 ], 1 );
+    t.equal( stats.latencyBuckets[ stats.latencyBuckets.length - 1 ], Infinity );
+    ['convert', 'composite', 'identify', 'getConstPixels', 'quantizeColors', 'load', 'registerOverlay', 'fingerprint'].forEach(function (name) {
+        t.equal( stats.operations[ name ].latency.length, stats.latencyBuckets.length, name );
+    });
+    t.end();
+});
+
+test( 'convert is counted', function (t) {
+    var before = imagemagick.stats().operations.convert;
+    var buffer = imagemagick.convert({ srcData: srcData, width: 10, height: 10, format: 'PNG' });
+    var after  = imagemagick.stats().operations.convert;
+
+    t.equal( after.calls - before.calls, 1 );
+    t.equal( after.errors, before.errors );
+    t.equal( after.bytesIn - before.bytesIn, srcData.length );
+    t.equal( after.bytesOut - before.bytesOut, buffer.length );
+    t.ok( Math.abs(after.megapixels - before.megapixels - 58 * 66 / 1e6) < 1e-9, 'decoded pixels' );
+    t.equal( sum(after.latency) - sum(before.latency), 1 );
+    t.ok( after.latencyMs >= before.latencyMs );
+    t.end();
+});
+
+test( 'results written to dstPath are counted once', function (t) {
+    var dstPath = path.join(os.tmpdir(), 'imagemagick-native-stats-' + process.pid + '.png');
+    var before = imagemagick.stats().operations.convert;
+    imagemagick.convert({ srcData: srcData, width: 10, height: 10, format: 'PNG', dstPath: dstPath });
+    var after  = imagemagick.stats().operations.convert;
+
+    t.equal( after.bytesOut - before.bytesOut, fs.statSync(dstPath).size );
+    fs.unlinkSync(dstPath);
+    t.end();
+});
+
+test( 'errors are counted by stage', function (t) {
+    var before = imagemagick.stats();
+    t.throws( function () {
+        imagemagick.convert({ srcData: srcData, width: 10, height: 10, maxPixels: 100 });
+    });
+    var after = imagemagick.stats();
+    t.equal( after.operations.convert.errors - before.operations.convert.errors, 1 );
+    t.equal( errors(after) - errors(before), 1 );
+    t.end();
+});
+
+test( 'async calls of every kind are counted', function (t) {
+    var before = imagemagick.stats().operations;
+    imagemagick.getConstPixels({ srcData: srcData, x: 0, y: 0, columns: 2, rows: 2, map: 'RGB' }, function (err) {
+        t.equal( err, undefined );
+        imagemagick.quantizeColors({ srcData: srcData, colors: 3 }, function (err) {
+            t.equal( err, undefined );
+            imagemagick.identify({ srcData: srcData }, function (err) {
+                t.equal( err, undefined );
+                var after = imagemagick.stats().operations;
+                t.equal( after.getConstPixels.calls - before.getConstPixels.calls, 1 );
+                t.equal( after.quantizeColors.calls - before.quantizeColors.calls, 1 );
+                t.equal( after.identify.calls - before.identify.calls, 1 );
+                t.end();
+            });
+        });
+    });
+});
+
+test( 'periodic report', function (t) {
+    var keepAlive = setTimeout(function () {}, 5000);
+    t.throws( function () {
+        imagemagick.stats({ interval: 10 });
+    }, 'report is required' );
+    var reports = 0;
+    imagemagick.stats({ interval: 10, report: function (stats) {
+        t.ok( stats.operations.convert.calls > 0 );
+        if ( ++reports < 2 ) return;
+        imagemagick.stats({ interval: 0 });
+        clearTimeout(keepAlive);
+        t.end();
+    } });
+});
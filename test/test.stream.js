@@ -52,3 +52,189 @@ test( 'stream.convert can pipes streams', function (t) {
 
     input.pipe(stream).pipe(output);
 });
+
+test( 'stream.convert emits large output in chunks', function (t) {
+    var stream = imagemagick.streams.convert({
+        width: 1000,
+        height: 1000,
+        resizeStyle: 'fill',
+        format: 'BMP',
+        debug: debug
+    });
+
+    var chunks = [];
+    stream.on('data', function (chunk) {
+        chunks.push(chunk);
+    });
+    stream.on('end', function () {
+        if (imagemagick.convertStream) {
+            t.equal( chunks.length > 1, true, 'output arrives in several chunks' );
+        }
+        var ret = imagemagick.identify({ srcData: Buffer.concat(chunks) });
+        t.equal( ret.width, 1000 );
+        t.equal( ret.height, 1000 );
+        t.end();
+    });
+
+    fs.createReadStream('test.jpg', { highWaterMark: 256 }).pipe(stream);
+});
+
+test( 'stream.convert reports errors', function (t) {
+    var stream = imagemagick.streams.convert({
+        width: 100,
+        height: 100,
+        format: 'PNG',
+        debug: debug
+    });
+
+    stream.on('error', function (err) {
+        t.ok( err instanceof Error );
+        t.end();
+    });
+    stream.resume();
+
+    stream.end(Buffer.from ? Buffer.from('not an image') : new Buffer('not an image'));
+});
+
+test( 'stream.convert keeps the first frame of animated sources', function (t) {
+    var stream = imagemagick.streams.convert({
+        width: 50,
+        height: 50,
+        format: 'PNG',
+        debug: debug
+    });
+
+    var chunks = [];
+    stream.on('data', function (chunk) {
+        chunks.push(chunk);
+    });
+    stream.on('error', function (err) {
+        t.fail( err.message );
+        t.end();
+    });
+    stream.on('end', function () {
+        var ret = imagemagick.identify({ srcData: Buffer.concat(chunks) });
+        t.equal( ret.width, 50 );
+        t.equal( ret.height, 50 );
+        t.end();
+    });
+
+    fs.createReadStream('test.animated.gif', { highWaterMark: 256 }).pipe(stream);
+});
+
+test( 'stream.convert decodes formats that seek back, e.g. TIFF', function (t) {
+    // uncompressed, its directory is written after the pixels, far beyond what the stream keeps
+    var tiff = imagemagick.convert({
+        srcData: fs.readFileSync('test.jpg'),
+        width: 400,
+        height: 400,
+        resizeStyle: 'fill',
+        format: 'TIFF'
+    });
+    t.ok( tiff.length > 64 * 1024 );
+
+    var stream = imagemagick.streams.convert({
+        width: 100,
+        height: 100,
+        format: 'PNG',
+        debug: debug
+    });
+
+    var chunks = [];
+    stream.on('data', function (chunk) {
+        chunks.push(chunk);
+    });
+    stream.on('error', function (err) {
+        t.fail( err.message );
+        t.end();
+    });
+    stream.on('end', function () {
+        var ret = imagemagick.identify({ srcData: Buffer.concat(chunks) });
+        t.equal( ret.width, 100 );
+        t.equal( ret.height, 100 );
+        t.end();
+    });
+
+    for (var offset = 0; offset < tiff.length; offset += 4096) {
+        stream.write(tiff.slice(offset, offset + 4096));
+    }
+    stream.end();
+});
+
+test( 'stream.convert keeps every frame with animated', function (t) {
+    var options = {
+        width: 50,
+        height: 50,
+        animated: true,
+        format: 'GIF',
+        debug: debug
+    };
+    var expected = imagemagick.convert(Object.assign({ srcData: fs.readFileSync('test.animated.gif') }, options));
+    var stream = imagemagick.streams.convert(options);
+
+    var chunks = [];
+    stream.on('data', function (chunk) {
+        chunks.push(chunk);
+    });
+    stream.on('error', function (err) {
+        t.fail( err.message );
+        t.end();
+    });
+    stream.on('end', function () {
+        var output = Buffer.concat(chunks);
+        t.ok( output.length > 0 );
+        t.ok( output.equals(expected), 'the same frames as convert' );
+        t.end();
+    });
+
+    fs.createReadStream('test.animated.gif', { highWaterMark: 256 }).pipe(stream);
+});
+
+test( 'convertStream rejects animated', { skip: !imagemagick.convertStream && 'needs native streams' }, function (t) {
+    t.throws( function () {
+        imagemagick.convertStream({ animated: true }, function () {}, function () {});
+    }, /doesn't support "animated"/ );
+    t.end();
+});
+
+test( 'a stalled stream times out', { skip: !imagemagick.convertStream && 'needs native streams' }, function (t) {
+    var stream = imagemagick.streams.convert({
+        width: 10,
+        height: 10,
+        format: 'PNG',
+        timeoutMs: 100,
+        debug: debug
+    });
+    stream.on('error', function (err) {
+        t.equal( err.message, 'job timed out' );
+        t.end();
+    });
+    stream.resume();
+    // the first bytes of the source, the rest never arrives
+    stream.write(fs.readFileSync('test.jpg').slice(0, 512));
+});
+
+test( 'stream.convert stops encoding while its output is not read', { skip: !imagemagick.convertStream && 'needs native streams' }, function (t) {
+    var stream = imagemagick.streams.convert({
+        width: 1000,
+        height: 1000,
+        resizeStyle: 'fill',
+        format: 'BMP', // 3MB
+        debug: debug
+    });
+    stream.end(fs.readFileSync('test.jpg'));
+
+    setTimeout(function () {
+        t.ok( stream.readableLength < 1024 * 1024, 'held ' + stream.readableLength + ' bytes of output' );
+        var chunks = [];
+        stream.on('data', function (chunk) {
+            chunks.push(chunk);
+        });
+        stream.on('end', function () {
+            var ret = imagemagick.identify({ srcData: Buffer.concat(chunks) });
+            t.equal( ret.width, 1000 );
+            t.equal( ret.height, 1000 );
+            t.end();
+        });
+    }, 500);
+});
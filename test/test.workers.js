@@ -0,0 +1,90 @@
+var test        = require('tap').test
+,   imagemagick = require('..')
+,   fs          = require('fs')
+,   path        = require('path')
+;
+
+var workerThreads;
+try {
+    workerThreads = require('worker_threads');
+} catch (e) {}
+var version = process.versions.node.split('.').map(Number);
+var skip = !workerThreads || version[0] < 14 || (version[0] === 14 && version[1] < 8)
+    ? 'needs worker_threads and Node.js 14.8' : false;
+
+var srcPath = path.join(__dirname, 'test.jpg');
+var srcData = fs.readFileSync( srcPath );
+
+// runs in each worker: the same calls as the main thread, sync and async
+var worker = [
+    "var imagemagick = require(" + JSON.stringify(path.join(__dirname, '..')) + ");",
+    "var wt = require('worker_threads');",
+    "var srcData = Buffer.from(wt.workerData.srcData);",
+    "var result = {",
+    "    convert: imagemagick.convert({ srcData: srcData, width: 40, height: 30, format: 'PNG' }),",
+    "    pixels: imagemagick.getConstPixels({ srcData: srcData, x: 10, y: 10, columns: 2, rows: 2 }),",
+    "    colors: imagemagick.quantizeColors({ srcData: srcData, colors: 3 })",
+    "};",
+    "imagemagick.convert({ srcData: srcData, width: 20, height: 15, format: 'PNG' }, function (err, buffer) {",
+    "    if (err) throw err;",
+    "    result.async = buffer;",
+    "    wt.parentPort.postMessage(result);",
+    "});"
+].join('\n');
+
+function run (count, done) {
+    var results = [], exited = 0;
+    for (var i = 0; i < count; i++) {
+        var w = new workerThreads.Worker(worker, { eval: true, workerData: { srcData: srcData } });
+        w.on('message', function (result) { results.push(result); });
+        w.on('error', done);
+        w.on('exit', function () {
+            if (++exited === count) done(null, results);
+        });
+    }
+}
+
+test( 'workers convert concurrently like the main thread', { skip: skip }, function (t) {
+    var expected = {
+        convert: imagemagick.convert({ srcData: srcData, width: 40, height: 30, format: 'PNG' }),
+        pixels: imagemagick.getConstPixels({ srcData: srcData, x: 10, y: 10, columns: 2, rows: 2 }),
+        colors: imagemagick.quantizeColors({ srcData: srcData, colors: 3 }),
+        async: imagemagick.convert({ srcData: srcData, width: 20, height: 15, format: 'PNG' })
+    };
+    run(4, function (err, results) {
+        t.error( err );
+        t.equal( results.length, 4 );
+        results.forEach(function (result) {
+            t.ok( Buffer.from(result.convert).equals(expected.convert), 'sync convert' );
+            t.ok( Buffer.from(result.async).equals(expected.async), 'async convert' );
+            t.same( result.pixels, expected.pixels, 'getConstPixels' );
+            t.same( result.colors, expected.colors, 'quantizeColors' );
+        });
+        t.end();
+    });
+});
+
+test( 'the main thread keeps working after workers exited', { skip: skip }, function (t) {
+    run(2, function (err) {
+        t.error( err );
+        imagemagick.convert({ srcData: srcData, width: 40, height: 30, format: 'PNG' }, function (err, buffer) {
+            t.equal( err, undefined );
+            t.equal( imagemagick.identify({ srcData: buffer }).width, 40 );
+            t.end();
+        });
+    });
+});
+
+test( 'a worker exiting with jobs in flight', { skip: skip }, function (t) {
+    var w = new workerThreads.Worker([
+        "var imagemagick = require(" + JSON.stringify(path.join(__dirname, '..')) + ");",
+        "var srcData = Buffer.from(require('worker_threads').workerData.srcData);",
+        "for (var i = 0; i < 8; i++) imagemagick.convert({ srcData: srcData, width: 400, height: 300, format: 'PNG' }, function () {});",
+        "process.exit(0);"
+    ].join('\n'), { eval: true, workerData: { srcData: srcData } });
+    w.on('exit', function (code) {
+        t.equal( code, 0 );
+        t.equal( imagemagick.convert({ srcData: srcData, width: 40, height: 30, format: 'PNG' }).length > 0, true );
+        t.end();
+    });
+});